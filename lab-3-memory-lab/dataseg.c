@@ -66,12 +66,33 @@
 // The heap size can be adjusted by calling ds_sbrk(). The memory protection flags are set 
 // automatically whenever the ds_heap_brk pointer is adjusted.
 //
-// ds_heap_stat() can be used to retrieve information about the heap area.
+// ds_heap_stat() can be used to retrieve information about the heap area. ds_sbrk_stat() reports
+// how often the break has been moved and how much time these calls took (mostly mprotect()).
+//
+// Large blocks do not have to live in the heap area. ds_seg_mmap()/_munmap()/_mremap() manage
+// separate, page-aligned regions of memory outside of the data segment that are returned to the
+// system immediately. The regions are kept in a list (linked through a small header at the start
+// of each region) so that the segment can release them as well. ds_map_stat() reports the number
+// and total size of these regions. ds_peak_stat() reports the largest footprint (heap area plus
+// mapped regions) the segment has had and how often the footprint was enlarged.
+//
+// Memory is given back to the system when the break is lowered with a negative increment to
+// ds_sbrk(). ds_seg_discard() releases the whole pages inside a range of the heap area that the caller
+// no longer needs; the pages read as zero when they are accessed the next time. ds_resident()
+// reports how much of the heap area and the mapped regions is currently resident in memory.
 //
 // ds_release() releases all memory and resets all internal variables. A subsequent call to
 // ds_allocate() is supported and initializes a 'fresh' heap.
 //
+// Multiple data segments:
+// -----------------------
+// The functions above operate on the default data segment. ds_create() sets up an additional,
+// independent data segment that is described by a DataSeg handle; the ds_seg_*() functions
+// operate on a given segment and ds_destroy() releases it. ds_default() returns the handle of the
+// default segment so that code written against the handle API works on both.
+//
 
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <stdarg.h>
@@ -79,25 +100,58 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dataseg.h"
 
 
-static void *ds_start = NULL;       ///< start of the data segment
-static void *ds_end   = NULL;       ///< end of the data segment
-static void *ds_heap_start = NULL;  ///< start of the user space heap
-static void *ds_heap_brk   = NULL;  ///< current logical end of the user space heap
-static void *ds_heap_end   = NULL;  ///< end of the user space heap
-static int  PAGESIZE  = 0;          ///< (system) page size
-static int  ds_initialized = 0;     ///< initialized flag (yes: 1, otherwise 0)
+/// @brief header of a region mapped by ds_seg_mmap(). Occupies the first DS_MAP_OVERHEAD bytes.
+typedef struct __region {
+  struct __region *prev, *next;     ///< prev/next region in list of mapped regions
+  size_t          size;             ///< size of region including this header
+  DataSeg         *owner;           ///< data segment that mapped the region
+} Region;
+
+/// @brief simulated data segment
+struct __dataseg {
+  void *start;                      ///< start of the data segment
+  void *end;                        ///< end of the data segment
+  void *heap_start;                 ///< start of the user space heap
+  void *heap_brk;                   ///< current logical end of the user space heap
+  void *heap_end;                   ///< end of the user space heap
+  int  initialized;                 ///< initialized flag (yes: 1, otherwise 0)
+
+  unsigned long sbrk_calls;         ///< number of ds_sbrk() calls that moved the break
+  unsigned long sbrk_nsec;          ///< time spent in these calls (ns)
+
+  Region *regions;                  ///< list of regions mapped by ds_seg_mmap()
+  size_t map_regions;               ///< number of regions mapped by ds_seg_mmap()
+  size_t map_bytes;                 ///< total size of regions mapped by ds_seg_mmap()
+
+  size_t peak;                      ///< largest footprint (heap area + mapped regions) so far
+  unsigned long expansions;         ///< number of calls that enlarged the footprint
+};
+
+static DataSeg ds_default_seg;      ///< the default data segment
+static int  PAGESIZE  = 0;          ///< (system) page size; shared by all segments, never reset
 static int  ds_loglevel    = 0;     ///< log level (0: off; 1: info; 2: verbose)
 
+#define PAGE_ALIGN(p) ((void*)(((unsigned long)(p) + PAGESIZE-1) & ~(unsigned long)(PAGESIZE-1)))
+                                    ///< round p up to the next page boundary
+
 //TODO: static means it cannot br accessed from outside the module
 
+#ifndef LOG_MAX
+#define LOG_MAX 2                   ///< highest log level compiled in (0: none)
+#endif
+
 /// @brief print a log message if level <= ds_loglevel. The variadic argument is a printf format
-///        string followed by its parametrs
-#define LOG(level, ...) ds_log(level, __VA_ARGS__)
+///        string followed by its parametrs. The level is tested before the arguments are evaluated;
+///        levels above LOG_MAX are removed by the compiler.
+#define LOG(level, ...) \
+  do { if (((level) <= LOG_MAX) && __builtin_expect((level) <= ds_loglevel, 0)) \
+         ds_log(level, __VA_ARGS__); } while (0)
 
 /// @brief print a log message. Do not call directly; use LOG() instead
 /// @param level log level of message.
@@ -118,23 +172,20 @@ static void ds_log(int level, ...)
 }// no need to understand this part of code. just use the macro LOG
 
 
-void ds_allocate(size_t max_heap_size) //sbrk = start of heap when first allocate
-{// no need to touch this either
-  LOG(1, "ds_allocate(%lx)", max_heap_size);
-
-  if (ds_start != NULL) ds_release();           // if not NULL, means that it is allocated
-
-  PAGESIZE = getpagesize();
+/// @brief initialize a data segment
+/// @param ds data segment
+/// @param max_heap_size maximum possible size of heap data segment
+/// @retval 0 on success
+/// @retval -1 if the memory cannot be mapped
+static int seg_allocate(DataSeg *ds, size_t max_heap_size)
+{
+  if (PAGESIZE == 0) PAGESIZE = getpagesize();  // set once; other segments may be in use
   size_t ds_size = max_heap_size + 2*PAGESIZE;  // add one page at beginning, one at end
 
   // allocate memory for the data segment
   LOG(2, "  allocating %lx bytes of memory", ds_size);
-  ds_start = mmap(NULL, ds_size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
-  if (ds_start == (void*)-1) {
-    fprintf(stderr, "ERROR: cannot map memory in %s: %s.\n",
-                    __func__, strerror(errno));
-    exit(EXIT_FAILURE);
-  }
+  void *start = mmap(NULL, ds_size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+  if (start == MAP_FAILED) return -1;
 
   // try to lock the memory in RAM. Print only a warning if we don't succeed.
   /* don't do this for now. Requires changing resource limits in VM.
@@ -146,11 +197,13 @@ void ds_allocate(size_t max_heap_size) //sbrk = start of heap when first allocat
   */
 
   // initalize pointers
-  ds_end         = ds_start + ds_size;
-  ds_heap_start  = ds_start + PAGESIZE;
-  ds_heap_brk    = ds_heap_start; //TODO: brk originally points to where heap start is
-  ds_heap_end    = ds_end - PAGESIZE;
-  ds_initialized = 1;
+  memset(ds, 0, sizeof(DataSeg));
+  ds->start       = start;
+  ds->end         = start + ds_size;
+  ds->heap_start  = start + PAGESIZE;
+  ds->heap_brk    = ds->heap_start; //TODO: brk originally points to where heap start is
+  ds->heap_end    = ds->end - PAGESIZE;
+  ds->initialized = 1;
 
   LOG(2, "  ds_start:           %p\n"
          "  ds_heap_start:      %p\n"
@@ -158,7 +211,52 @@ void ds_allocate(size_t max_heap_size) //sbrk = start of heap when first allocat
          "  ds_heap_end:        %p\n"
          "  ds_end:             %p\n"
          "  PAGESIZE:           %d\n",
-         ds_start, ds_heap_start, ds_heap_brk, ds_heap_end, ds_end, PAGESIZE);
+         ds->start, ds->heap_start, ds->heap_brk, ds->heap_end, ds->end, PAGESIZE);
+
+  return 0;
+}
+
+/// @brief account for an enlarged footprint of a data segment
+/// @param ds data segment
+static void grown(DataSeg *ds)
+{
+  size_t footprint = (ds->heap_brk - ds->heap_start) + ds->map_bytes;
+  if (footprint > ds->peak) ds->peak = footprint;
+  ds->expansions++;
+}
+
+/// @brief release the memory of a data segment and the regions mapped by it
+/// @param ds data segment
+static void seg_release(DataSeg *ds)
+{
+  if (ds->start != NULL) {
+    // unlock & release memory. Ignore error message here.
+    //munlock(ds_start, ds_end-ds_start);
+    munmap(ds->start, ds->end-ds->start);
+  }
+
+  // release the regions that have not been unmapped
+  while (ds->regions != NULL) {
+    Region *r = ds->regions;
+    ds->regions = r->next;
+    munmap(r, r->size);
+  }
+
+  memset(ds, 0, sizeof(DataSeg));
+}
+
+
+void ds_allocate(size_t max_heap_size) //sbrk = start of heap when first allocate
+{// no need to touch this either
+  LOG(1, "ds_allocate(%lx)", max_heap_size);
+
+  if (ds_default_seg.start != NULL) ds_release();  // if not NULL, means that it is allocated
+
+  if (seg_allocate(&ds_default_seg, max_heap_size) != 0) {
+    fprintf(stderr, "ERROR: cannot map memory in %s: %s.\n",
+                    __func__, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
 }
 
 
@@ -166,81 +264,309 @@ void ds_release(void)
 {
   LOG(1, "ds_release()");
 
-  if (ds_start != NULL) {
-    // unlock & release memory. Ignore error message here.
-    //munlock(ds_start, ds_end-ds_start);
-    munmap(ds_start, ds_end-ds_start);
+  seg_release(&ds_default_seg);
+}
+
+
+DataSeg* ds_default(void)
+{
+  return &ds_default_seg;
+}
+
+
+DataSeg* ds_create(size_t max_heap_size)
+{
+  LOG(1, "ds_create(%lx)", max_heap_size);
+
+  // the descriptor is mapped as well so that creating a segment does not depend on malloc()
+  DataSeg *ds = mmap(NULL, sizeof(DataSeg), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (ds == MAP_FAILED) return NULL;
+
+  if (seg_allocate(ds, max_heap_size) != 0) {
+    munmap(ds, sizeof(DataSeg));
+    return NULL;
   }
 
-  ds_start = ds_end = ds_heap_start = ds_heap_brk = ds_heap_end = NULL;
-  PAGESIZE = 0;
-  ds_initialized = 0;
+  return ds;
 }
 
 
-void* ds_sbrk(intptr_t increment)
+void ds_destroy(DataSeg *ds)
+{
+  LOG(1, "ds_destroy(%p)", ds);
+
+  if ((ds == NULL) || (ds == &ds_default_seg)) return;
+
+  seg_release(ds);
+  munmap(ds, sizeof(DataSeg));
+}
+
+
+void* ds_seg_sbrk(DataSeg *ds, intptr_t increment)
 {
   LOG(1, "ds_sbrk(%c0x%lx)", increment < 0 ? '-' : '+', labs(increment));
-  assert(ds_initialized);
+  assert(ds->initialized);
 
-  void *old_heap_brk = ds_heap_brk;
+  void *old_heap_brk = ds->heap_brk;
 
   if (increment != 0) {
-    ds_heap_brk += increment;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    ds->heap_brk += increment;
 
-    if ((ds_heap_start <= ds_heap_brk) && (ds_heap_brk < ds_heap_end)) {
+    if ((ds->heap_start <= ds->heap_brk) && (ds->heap_brk < ds->heap_end)) {
       // adjust memory access permissions
       // since we are not aligning brk at PAGESIZE , we need to mark the invalid part before
       // allowing access to the permissible area because permissions are set on a page-level basis
       LOG(1, "  setting memory protection:\n"
              "    READ/WRITE from %p to %p\n"
              "    NO ACCESS  from %p to %p\n",
-             ds_heap_start, ds_heap_brk, ds_heap_brk, ds_end);
-      /*LOG(1, "in sbrk: ds_heap_brk: %p", ds_heap_brk);
-      LOG(1, "in sbrk: ds_end-ds_heap_brk: %p", ds_end - ds_heap_brk);
-      LOG(1, "in sbrk: ds_heap_start: %p", ds_heap_start);
-      LOG(1, "in sbrk: ds_heap_sbrk-ds_heap_start: %p", ds_heap_brk-ds_heap_start);
-      LOG(1, "%d", mprotect(ds_heap_brk, ds_end-ds_heap_brk, PROT_NONE));
-      LOG(1, "%d", mprotect(ds_heap_start, ds_heap_brk-ds_heap_start, PROT_READ|PROT_WRITE));*/ //TODO: commented for debugging by jinsol
-      if ((mprotect(ds_heap_brk, ds_end-ds_heap_brk, PROT_NONE) != 0) ||
-          (mprotect(ds_heap_start, ds_heap_brk-ds_heap_start, PROT_READ|PROT_WRITE) != 0))
+             ds->heap_start, ds->heap_brk, ds->heap_brk, ds->end);
+      if ((mprotect(ds->heap_brk, ds->end-ds->heap_brk, PROT_NONE) != 0) ||
+          (mprotect(ds->heap_start, ds->heap_brk-ds->heap_start, PROT_READ|PROT_WRITE) != 0))
       {//TODO: the above uses mprotect to make sure that only the part btw ds_heap_start and ds_heap_brk is accessed
         fprintf(stderr, "ERROR: cannot set memory protection flags in %s: %s.\n", 
                         __func__, strerror(errno));
         exit(EXIT_FAILURE);
       }
+
+      // give the pages above the new break back to the system. PROT_NONE alone keeps them resident
+      if (increment < 0) {
+        void *from = PAGE_ALIGN(ds->heap_brk);
+        void *to   = PAGE_ALIGN(old_heap_brk);
+        if ((from < to) && (madvise(from, to-from, MADV_DONTNEED) != 0)) {
+          LOG(1, "  cannot release pages %p - %p: %s", from, to, strerror(errno));
+        }
+      }
     } else {
       // ignore increment and signal an error if we ended up outside the simulated data segment
       LOG(1, "  invalid increment (ended up outside valid data segment)");
       errno = ENOMEM;
-      ds_heap_brk = old_heap_brk;
+      ds->heap_brk = old_heap_brk;
       old_heap_brk = (void*)-1;
     }
+    if ((increment > 0) && (old_heap_brk != (void*)-1)) grown(ds);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ds->sbrk_calls++;
+    ds->sbrk_nsec += (t1.tv_sec - t0.tv_sec) * 1000000000UL + t1.tv_nsec - t0.tv_nsec;
   }
 
   return old_heap_brk;
 }
 
 
+void* ds_sbrk(intptr_t increment)
+{
+  return ds_seg_sbrk(&ds_default_seg, increment);
+}
+
+
 int ds_getpagesize(void)
 {
-  assert(ds_initialized);
+  assert(ds_default_seg.initialized);
 
   return PAGESIZE;
 }
 
 
+int ds_seg_getpagesize(DataSeg *ds)
+{
+  assert(ds->initialized);
+
+  return PAGESIZE;
+}
+
+
+void ds_seg_heap_stat(DataSeg *ds, void **start, void **brk, void **end)
+{
+  if (start) *start = ds->heap_start;
+  if (brk)   *brk   = ds->heap_brk;
+  if (end)   *end   = ds->heap_end;
+}
+
+
 void ds_heap_stat(void **start, void **brk, void **end)
 {
-  if (start) *start = ds_heap_start;
-  if (brk)   *brk   = ds_heap_brk;
-  if (end)   *end   = ds_heap_end;
+  ds_seg_heap_stat(&ds_default_seg, start, brk, end);
 }
 
 
-void ds_setloglevel(int level)
+void* ds_seg_mmap(DataSeg *ds, size_t size)
 {
-  ds_loglevel = level;
+  LOG(1, "ds_mmap(0x%lx)", size);
+  assert(ds->initialized);
+
+  size = (size + DS_MAP_OVERHEAD + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+  Region *r = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (r == MAP_FAILED) return (void*)-1;
+
+  r->size = size;
+  r->owner = ds;
+  r->prev = NULL;
+  r->next = ds->regions;
+  if (r->next != NULL) r->next->prev = r;
+  ds->regions = r;
+
+  ds->map_regions++;
+  ds->map_bytes += size;
+  grown(ds);
+  LOG(2, "  mapped %p - %p", r, (void*)r + size);
+
+  return (void*)r + DS_MAP_OVERHEAD;
+}
+
+
+DataSeg* ds_region_owner(void *addr)
+{
+  return ((Region*)(addr - DS_MAP_OVERHEAD))->owner;
+}
+
+
+int ds_seg_munmap(DataSeg *ds, void *addr)
+{
+  LOG(1, "ds_munmap(%p)", addr);
+  assert(ds->initialized);
+
+  Region *r = addr - DS_MAP_OVERHEAD;
+  size_t size = r->size;
+
+  if (r->prev != NULL) r->prev->next = r->next;
+  else ds->regions = r->next;
+  if (r->next != NULL) r->next->prev = r->prev;
+
+  ds->map_regions--;
+  ds->map_bytes -= size;
+
+  return munmap(r, size);
+}
+
+
+void* ds_seg_mremap(DataSeg *ds, void *addr, size_t size)
+{
+  LOG(1, "ds_mremap(%p, 0x%lx)", addr, size);
+  assert(ds->initialized);
+
+  Region *r = addr - DS_MAP_OVERHEAD;
+  size_t old_size = r->size;
+
+  size = (size + DS_MAP_OVERHEAD + PAGESIZE - 1) / PAGESIZE * PAGESIZE;
+  Region *n = mremap(r, old_size, size, MREMAP_MAYMOVE);
+  if (n == MAP_FAILED) return (void*)-1;
+
+  // the region may have moved: fix the links of its neighbours
+  n->size = size;
+  if (n->prev != NULL) n->prev->next = n;
+  else ds->regions = n;
+  if (n->next != NULL) n->next->prev = n;
+
+  ds->map_bytes += size - old_size;
+  if (size > old_size) grown(ds);
+  LOG(2, "  remapped %p - %p", n, (void*)n + size);
+
+  return (void*)n + DS_MAP_OVERHEAD;
+}
+
+
+int ds_seg_discard(DataSeg *ds, void *addr, size_t size)
+{
+  LOG(1, "ds_discard(%p, 0x%lx)", addr, size);
+  assert(ds->initialized);
+
+  void *from = PAGE_ALIGN(addr);
+  void *to   = (void*)((unsigned long)(addr + size) & ~(unsigned long)(PAGESIZE-1));
+  if (from >= to) return 0;
+
+  LOG(2, "  releasing %p - %p", from, to);
+  return madvise(from, to-from, MADV_DONTNEED);
+}
+
+
+/// @brief count the resident pages of an area
+/// @param from page-aligned start of area
+/// @param to page-aligned end of area
+/// @retval number of resident bytes
+static size_t resident(void *from, void *to)
+{
+  unsigned char vec[256];
+  size_t bytes = 0;
+
+  while (from < to) {
+    size_t len = to - from;
+    if (len > sizeof(vec)*PAGESIZE) len = sizeof(vec)*PAGESIZE;
+
+    if (mincore(from, len, vec) == 0) {
+      for (size_t i = 0; i < len/PAGESIZE; i++) {
+        if (vec[i] & 1) bytes += PAGESIZE;
+      }
+    }
+    from += len;
+  }
+
+  return bytes;
 }
 
 
+size_t ds_seg_resident(DataSeg *ds)
+{
+  if (!ds->initialized) return 0;
+
+  size_t bytes = resident(ds->heap_start, PAGE_ALIGN(ds->heap_brk));
+  for (Region *r = ds->regions; r != NULL; r = r->next) {
+    bytes += resident(r, (void*)r + r->size);
+  }
+
+  return bytes;
+}
+
+
+size_t ds_resident(void)
+{
+  return ds_seg_resident(&ds_default_seg);
+}
+
+
+void ds_seg_sbrk_stat(DataSeg *ds, unsigned long *calls, unsigned long *nsec)
+{
+  if (calls) *calls = ds->sbrk_calls;
+  if (nsec)  *nsec  = ds->sbrk_nsec;
+}
+
+
+void ds_sbrk_stat(unsigned long *calls, unsigned long *nsec)
+{
+  ds_seg_sbrk_stat(&ds_default_seg, calls, nsec);
+}
+
+
+void ds_seg_map_stat(DataSeg *ds, size_t *regions, size_t *bytes)
+{
+  if (regions) *regions = ds->map_regions;
+  if (bytes)   *bytes   = ds->map_bytes;
+}
+
+
+void ds_map_stat(size_t *regions, size_t *bytes)
+{
+  ds_seg_map_stat(&ds_default_seg, regions, bytes);
+}
+
+
+void ds_seg_peak_stat(DataSeg *ds, size_t *peak, unsigned long *expansions)
+{
+  if (peak)       *peak       = ds->peak;
+  if (expansions) *expansions = ds->expansions;
+}
+
+
+void ds_peak_stat(size_t *peak, unsigned long *expansions)
+{
+  ds_seg_peak_stat(&ds_default_seg, peak, expansions);
+}
+
+
+void ds_setloglevel(int level)
+{
+  ds_loglevel = level;
+}
@@ -36,6 +36,11 @@
 
 #include <unistd.h>
 
+#define DS_MAP_OVERHEAD 32                   ///< bytes at the start of a region used by ds_seg_mmap()
+
+/// @brief handle of a simulated data segment
+typedef struct __dataseg DataSeg;
+
 /// @brief initialize simulated data segment. Allocates & locks memory pages in RAM to minimize
 ///        performance variance.
 /// @param max_heap_size maximum possible size of heap data segment
@@ -62,6 +67,102 @@ int ds_getpagesize(void);
 /// @param[out] end   largest possible address of user-space heap
 void ds_heap_stat(void **start, void **brk, void **end);
 
+/// @brief retrieve the number of bytes of the heap area and of the mapped regions that are
+///        currently resident in physical memory
+/// @retval resident bytes
+size_t ds_resident(void);
+
+/// @brief retrieve the number of ds_sbrk() calls that moved the break and the time spent in them
+/// @param[out] calls number of calls with a non-zero increment
+/// @param[out] nsec  total time of these calls in nanoseconds
+void ds_sbrk_stat(unsigned long *calls, unsigned long *nsec);
+
+/// @brief retrieve statistics about the regions mapped by the default data segment
+/// @param[out] regions number of currently mapped regions
+/// @param[out] bytes   total size of currently mapped regions
+void ds_map_stat(size_t *regions, size_t *bytes);
+
+/// @brief retrieve the largest footprint of the default data segment, i.e., the size of the heap
+///        area plus the size of the mapped regions, and the number of calls that enlarged it
+///        (ds_sbrk() with a positive increment, ds_seg_mmap(), growing ds_seg_mremap())
+/// @param[out] peak       largest footprint in bytes
+/// @param[out] expansions number of expansions
+void ds_peak_stat(size_t *peak, unsigned long *expansions);
+
+/// @brief retrieve the handle of the default data segment (set up by ds_allocate())
+/// @retval handle of default data segment
+DataSeg* ds_default(void);
+
+/// @brief create an additional, independent data segment
+/// @param max_heap_size maximum possible size of heap data segment
+/// @retval handle of the new data segment
+/// @retval NULL if the memory cannot be mapped
+DataSeg* ds_create(size_t max_heap_size);
+
+/// @brief release a data segment created by ds_create() and all regions mapped by it
+/// @param ds data segment
+void ds_destroy(DataSeg *ds);
+
+/// @brief ds_sbrk() on data segment @a ds
+void* ds_seg_sbrk(DataSeg *ds, intptr_t increment);
+
+/// @brief ds_getpagesize() on data segment @a ds
+int ds_seg_getpagesize(DataSeg *ds);
+
+/// @brief ds_heap_stat() on data segment @a ds
+void ds_seg_heap_stat(DataSeg *ds, void **start, void **brk, void **end);
+
+/// @brief ds_resident() on data segment @a ds
+size_t ds_seg_resident(DataSeg *ds);
+
+/// @brief ds_sbrk_stat() on data segment @a ds
+void ds_seg_sbrk_stat(DataSeg *ds, unsigned long *calls, unsigned long *nsec);
+
+/// @brief ds_map_stat() on data segment @a ds
+void ds_seg_map_stat(DataSeg *ds, size_t *regions, size_t *bytes);
+
+/// @brief ds_peak_stat() on data segment @a ds
+void ds_seg_peak_stat(DataSeg *ds, size_t *peak, unsigned long *expansions);
+
+/// @brief release the physical memory of the whole pages in [addr, addr+size). The address range
+///        remains valid; the released pages read as zero when they are accessed the next time.
+/// @param ds data segment
+/// @param addr start of range
+/// @param size size of range in bytes
+/// @retval 0 on success
+/// @retval -1 on error. errno is set by madvise()
+int ds_seg_discard(DataSeg *ds, void *addr, size_t size);
+
+/// @brief map a separate region of memory outside of the heap data segment. Used for large
+///        blocks that should be returned to the system as soon as they are freed. The region is
+///        page-aligned; its first DS_MAP_OVERHEAD bytes are used to keep track of the region.
+///        The region belongs to @a ds and is released with it.
+/// @param ds data segment
+/// @param size usable size of region in bytes
+/// @retval pointer to the usable part of the region (DS_MAP_OVERHEAD bytes after its start)
+/// @retval (void*)-1 on error. errno is set by mmap()
+void* ds_seg_mmap(DataSeg *ds, size_t size);
+
+/// @brief release a region obtained by ds_seg_mmap()
+/// @param ds data segment
+/// @param addr pointer returned by ds_seg_mmap() or ds_seg_mremap()
+/// @retval 0 on success
+/// @retval -1 on error. errno is set by munmap()
+int ds_seg_munmap(DataSeg *ds, void *addr);
+
+/// @brief retrieve the data segment that mapped a region
+/// @param addr pointer returned by ds_seg_mmap() or ds_seg_mremap()
+/// @retval handle of the data segment
+DataSeg* ds_region_owner(void *addr);
+
+/// @brief resize a region obtained by ds_seg_mmap(). The region may move.
+/// @param ds data segment
+/// @param addr pointer returned by ds_seg_mmap() or ds_seg_mremap()
+/// @param size new usable size of region in bytes
+/// @retval pointer to the usable part of the resized region on success
+/// @retval (void*)-1 on error. errno is set by mremap()
+void* ds_seg_mremap(DataSeg *ds, void *addr, size_t size);
+
 /// @brief set log level
 /// @brief level log level (0: no logging, 1: info; 2: verbose)
 void ds_setloglevel(int level);
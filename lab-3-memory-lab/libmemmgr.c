@@ -0,0 +1,300 @@
+//--------------------------------------------------------------------------------------------------
+// System Programming                       Memory Lab                                   Fall 2020
+//
+/// @file
+/// @brief LD_PRELOAD library that runs unmodified programs on the dynamic memory manager
+//--------------------------------------------------------------------------------------------------
+
+// Memory manager preload library
+// ==============================
+// libmemmgr.so interposes the C library's allocation functions (malloc, calloc, realloc, free,
+// posix_memalign, memalign, aligned_alloc, valloc, pvalloc) and maps them onto the memory
+// manager. Programs do not need to be recompiled:
+//
+//   $ MM_POLICY=bestfit MM_STATS=1 LD_PRELOAD=./libmemmgr.so ../lab-2-io-lab/dirtree /usr
+//
+// The C library and the dynamic loader allocate memory before main() runs, so the heap is set up
+// by the first allocation rather than in __libc_start_main. __libc_start_main is intercepted
+// (as in libintrospect.c) to record the start time and to register the report printed at exit.
+// The heap is always in thread-safe mode so that multi-threaded programs work unchanged.
+//
+// Environment variables:
+//   MM_POLICY   firstfit|nextfit|bestfit|segfit|   allocation policy (default segfit)
+//               buddy
+//   MM_DATASEG  <size>                             size of the data segment (default 1 GB)
+//   MM_STATS    1                                  print call counts, run time, the heap
+//                                                  footprint and fragmentation (mm_stats()) to
+//                                                  stderr when the program exits
+//   MM_EVENTS   <file>                             record the calls in a ring buffer of
+//                                                  TRACE_SIZE events (see mm_settrace()) and
+//                                                  write it to <file> when the program exits;
+//                                                  decode it with mm_tracedump
+//
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dataseg.h"
+#include "memmgr.h"
+
+/// @name global variables
+/// @{
+
+static int              initialized = 0;              ///< heap set up
+static AllocationPolicy policy = ap_SegregatedFit;    ///< allocation policy
+static const char      *policy_name = "segfit";       ///< name of allocation policy
+static struct timespec  start_point;                  ///< process start time
+static int              report_fd = -1;               ///< copy of stderr for the report
+static const char      *trace_file = NULL;            ///< file of the event trace
+
+static unsigned long    nmalloc;                      ///< number of allocations
+static unsigned long    nfree;                        ///< number of frees
+static unsigned long    nrealloc;                     ///< number of reallocations
+/// @}
+
+
+/// @name Macro definitions
+/// @{
+
+#define DATASEG_SIZE      (1UL << 30)                 ///< default size of the data segment
+#define TRACE_SIZE        (1UL << 20)                 ///< number of events kept by the trace
+#define COUNT(c)          __atomic_fetch_add(&(c), 1, __ATOMIC_RELAXED)
+/// @}
+
+
+/// @brief Prints an error message and terminates the process. Does not return. Must not allocate.
+/// @param fmt printf format string
+/// @param ... variadic parameters for @a fmt
+__attribute__((noreturn))
+static void PANIC(const char *fmt, ...)
+{
+  fprintf(stderr, "[PANIC] ");
+
+  va_list va;
+  va_start(va, fmt);
+  vfprintf(stderr, fmt, va);
+  va_end(va);
+
+  fprintf(stderr, "\n");
+
+  _exit(EXIT_FAILURE);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/// @name heap setup and report
+/// @{
+
+/// @brief Set up the data segment and the heap as configured by the environment. Called by the
+///        first allocation; the process is still single-threaded at that point.
+static void init_heap(void)
+{
+  const char *p = getenv("MM_POLICY");
+  if (p != NULL) {
+    if (strcmp(p, "firstfit") == 0) policy = ap_FirstFit;
+    else if (strcmp(p, "nextfit") == 0) policy = ap_NextFit;
+    else if (strcmp(p, "bestfit") == 0) policy = ap_BestFit;
+    else if (strcmp(p, "segfit") == 0) policy = ap_SegregatedFit;
+    else if (strcmp(p, "buddy") == 0) policy = ap_Buddy;
+    else PANIC("Invalid allocation policy '%s' in MM_POLICY", p);
+    policy_name = p;
+  }
+
+  size_t size = DATASEG_SIZE;
+  const char *s = getenv("MM_DATASEG");
+  if (s != NULL) size = strtoul(s, NULL, 0);
+
+  ds_allocate(size);
+  mm_init(policy);
+  mm_setthreadsafe(1);
+
+  // the trace buffer must not come from the heap that it records
+  const char *t = getenv("MM_EVENTS");
+  if (t != NULL) {
+    struct mm_event *buf = mmap(NULL, TRACE_SIZE * sizeof(*buf), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) PANIC("Cannot map the trace buffer");
+    mm_settrace(buf, TRACE_SIZE);
+    trace_file = t;
+  }
+
+  initialized = 1;
+}
+
+#define INIT()            do { if (!initialized) init_heap(); } while (0)
+
+/// @brief Print call counts, run time and heap footprint. Registered with atexit(). Writes to a
+///        copy of stderr because programs may close stderr in their own exit handlers.
+static void report(void)
+{
+  struct timespec end_point;
+  clock_gettime(CLOCK_MONOTONIC, &end_point);
+  double t = (end_point.tv_sec - start_point.tv_sec) +
+             (end_point.tv_nsec - start_point.tv_nsec) / 1e9;
+
+  void *start, *brk;
+  size_t regions, bytes;
+  unsigned long calls, nsec;
+  ds_heap_stat(&start, &brk, NULL);
+  ds_map_stat(&regions, &bytes);
+  ds_sbrk_stat(&calls, &nsec);
+  struct mm_stats st;
+  mm_stats(&st);
+
+  dprintf(report_fd, "\n[libmemmgr] policy %s\n"
+                     "  run time:         %.6f sec\n"
+                     "  malloc:           %lu\n"
+                     "  realloc:          %lu\n"
+                     "  free:             %lu\n"
+                     "  heap size:        %lu bytes\n"
+                     "  mapped blocks:    %lu (%lu bytes)\n"
+                     "  resident:         %lu bytes\n"
+                     "  sbrk calls:       %lu (%lu ns)\n"
+                     "  free blocks:      %lu (%lu bytes, largest %lu bytes)\n"
+                     "  fragmentation:    %.2f%% external, %.2f%% internal\n",
+          policy_name, t, nmalloc, nrealloc, nfree, (size_t)(brk - start), regions, bytes,
+          ds_resident(), calls, nsec, st.free_blocks, st.free_bytes, st.largest_free,
+          100.0 * st.external_frag, 100.0 * st.internal_frag);
+}
+
+/// @brief Write the event trace to MM_EVENTS. Registered with atexit().
+static void dump_trace(void)
+{
+  int fd = open(trace_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if ((fd < 0) || (mm_trace_dump(fd) < 0)) {
+    dprintf(STDERR_FILENO, "[libmemmgr] cannot write trace '%s'\n", trace_file);
+  }
+  if (fd >= 0) close(fd);
+}
+
+/// @}
+
+
+//--------------------------------------------------------------------------------------------------
+/// @name allocation function intercepts
+/// @{
+
+/// @brief malloc intercept. See malloc(3)
+void* malloc(size_t size)
+{
+  INIT();
+  COUNT(nmalloc);
+  void *ptr = mm_malloc(size);
+  if (ptr == NULL) errno = ENOMEM;
+  return ptr;
+}
+
+/// @brief calloc intercept. See calloc(3)
+void* calloc(size_t nelem, size_t size)
+{
+  INIT();
+  COUNT(nmalloc);
+  if ((size != 0) && (nelem > (size_t)-1 / size)) {       // nelem * size overflows
+    errno = ENOMEM;
+    return NULL;
+  }
+  void *ptr = mm_calloc(nelem, size);
+  if (ptr == NULL) errno = ENOMEM;
+  return ptr;
+}
+
+/// @brief realloc intercept. See realloc(3)
+void* realloc(void *ptr, size_t size)
+{
+  INIT();
+  COUNT(nrealloc);
+  void *res = mm_realloc(ptr, size);
+  if ((res == NULL) && (size > 0)) errno = ENOMEM;
+  return res;
+}
+
+/// @brief free intercept. See free(3)
+void free(void *ptr)
+{
+  if (ptr == NULL) return;
+  COUNT(nfree);
+  mm_free(ptr);
+}
+
+/// @brief posix_memalign intercept. See posix_memalign(3)
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  INIT();
+  if ((alignment < sizeof(void*)) || (alignment & (alignment - 1))) return EINVAL;
+
+  COUNT(nmalloc);
+  void *ptr = mm_memalign(alignment, size);
+  if (ptr == NULL) return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+/// @brief memalign intercept. See memalign(3)
+void* memalign(size_t alignment, size_t size)
+{
+  INIT();
+  COUNT(nmalloc);
+  void *ptr = mm_memalign(alignment, size);
+  if (ptr == NULL) errno = alignment & (alignment - 1) ? EINVAL : ENOMEM;
+  return ptr;
+}
+
+/// @brief aligned_alloc intercept. See aligned_alloc(3)
+void* aligned_alloc(size_t alignment, size_t size)
+{
+  return memalign(alignment, size);
+}
+
+/// @brief valloc intercept. See valloc(3)
+void* valloc(size_t size)
+{
+  return memalign(getpagesize(), size);
+}
+
+/// @brief pvalloc intercept. See pvalloc(3)
+void* pvalloc(size_t size)
+{
+  size_t ps = getpagesize();
+  return memalign(ps, (size + ps - 1) / ps * ps);
+}
+
+/// @}
+
+
+//--------------------------------------------------------------------------------------------------
+/// @name intercept of program beginning
+/// @{
+
+/// @brief Intercept of CRT's start routine
+int __libc_start_main(int (*main)(int, char **, char **), int argc, char **argv,
+        void (*init) (void), void (*fini) (void), void (*rtld_fini) (void), void (*stack_end))
+{
+  // find address of original (non-intercepted) function
+  typeof(&__libc_start_main) __libc_start_main_orig = dlsym(RTLD_NEXT, "__libc_start_main");
+  if (__libc_start_main_orig == NULL) PANIC("Cannot find '__libc_start_main'");
+
+  INIT();
+
+  // record process start time and print the report at exit
+  clock_gettime(CLOCK_MONOTONIC, &start_point);
+  const char *s = getenv("MM_STATS");
+  if ((s != NULL) && (strcmp(s, "0") != 0)) {
+    report_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    if (report_fd >= 0) atexit(report);
+  }
+  if (trace_file != NULL) atexit(dump_trace);
+
+  // call original __libc_start_main
+  return __libc_start_main_orig(main, argc, argv, init, fini, rtld_fini, stack_end);
+}
+
+/// @}
@@ -0,0 +1,488 @@
+//--------------------------------------------------------------------------------------------------
+// System Programming                       Memory Lab                                   Fall 2020
+//
+/// @file
+/// @brief LD_PRELOAD library that records the allocations of a program as a mm_replay script
+//--------------------------------------------------------------------------------------------------
+
+// Allocation trace recorder
+// =========================
+// libmmrecord.so interposes malloc, calloc, realloc, free and the aligned allocation functions,
+// forwards them to the C library's allocator and writes every call as an action of a script for
+// mm_replay (tests/*.dmas):
+//
+//   $ MM_TRACE=ls.dmas LD_PRELOAD=./libmmrecord.so ls -l /usr
+//   $ ./mm_replay -p segfit ls.dmas
+//
+// Pointers are mapped to block ids with a hash table; the ids of freed blocks are reused so that
+// the slot table of mm_replay stays as small as the number of live blocks. The aligned allocation
+// functions are recorded as plain allocations since scripts have no aligned action. Calls of all
+// threads are recorded in the order in which they return. Blocks that are still allocated when
+// the program exits are not freed in the script.
+//
+// The recorder must not allocate memory itself: the C library's allocator is called through its
+// __libc_* entry points (dlsym() allocates), the hash table and the id stack are mapped with
+// mmap(), and the script is formatted into a static buffer that is written with write().
+//
+// Environment variables:
+//   MM_TRACE    <file>                             script to write (default mmtrace.%p.dmas).
+//                                                  '%p' is replaced by the process id so that
+//                                                  programs started with exec() do not overwrite
+//                                                  the script of their parent. Children created
+//                                                  by fork() are not recorded.
+//   MM_DATASEG  <size>                             size of the data segment in the script
+//                                                  (default 1 GB)
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/// @name the C library's allocator
+/// @{
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nelem, size_t size);
+extern void* __libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+extern void* __libc_memalign(size_t alignment, size_t size);
+/// @}
+
+
+/// @brief recorder state
+typedef enum {
+  s_Off,                          ///< not yet initialized
+  s_Recording,                    ///< writing the script
+  s_Closed,                       ///< script completed or recording impossible
+} State;
+
+/// @brief hash table entry mapping a pointer to a block id
+typedef struct {
+  void *ptr;                      ///< pointer or NULL for an empty entry
+  unsigned long id;               ///< block id
+  size_t size;                    ///< requested size
+} Entry;
+
+
+/// @name global variables
+/// @{
+
+static State            state = s_Off;                ///< recorder state
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER; ///< protects everything below
+static __thread int     busy;                         ///< thread is inside the recorder
+static int              fd = -1;                      ///< script file
+
+static char             buf[65536];                   ///< output buffer
+static size_t           buflen;                       ///< bytes in buf
+
+static Entry            *table;                       ///< pointer -> id hash table
+static size_t           tablesize;                    ///< number of entries (power of two)
+static size_t           used;                         ///< number of used entries
+
+static unsigned long    *ids;                         ///< stack of free ids
+static size_t           nids, maxids;                 ///< number of free ids, capacity of ids
+static unsigned long    next_id;                      ///< smallest id never used
+
+static unsigned long    nactions;                     ///< number of recorded actions
+static size_t           live, peak;                   ///< live payload bytes, largest value
+/// @}
+
+
+/// @name Macro definitions
+/// @{
+
+#define DATASEG_SIZE      (1UL << 30)                 ///< default size of the data segment
+#define TABLE_INIT        (1UL << 16)                 ///< initial number of hash table entries
+#define HASH(p)           ((((unsigned long)(p) >> 4) * 0x9e3779b97f4a7c15UL) >> 20)
+/// @}
+
+
+//--------------------------------------------------------------------------------------------------
+/// @name script output
+/// @{
+
+/// @brief write the buffered script to the file
+static void flush(void)
+{
+  size_t done = 0;
+  while (done < buflen) {
+    ssize_t n = write(fd, buf + done, buflen - done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      state = s_Closed;                               // give up, but keep the program running
+      break;
+    }
+    done += n;
+  }
+  buflen = 0;
+}
+
+/// @brief append a string to the script
+/// @param s string
+static void put_str(const char *s)
+{
+  size_t len = strlen(s);
+  if (buflen + len > sizeof(buf)) flush();
+  if (len > sizeof(buf)) len = sizeof(buf);
+  memcpy(buf + buflen, s, len);
+  buflen += len;
+}
+
+/// @brief append a number to the script
+/// @param v number
+/// @param hex print in hexadecimal (with 0x prefix) instead of decimal
+static void put_num(unsigned long v, int hex)
+{
+  char tmp[24], *p = tmp + sizeof(tmp);
+  *--p = '\0';
+  do { *--p = "0123456789abcdef"[v % (hex ? 16 : 10)]; v /= hex ? 16 : 10; } while (v > 0);
+  if (hex) { *--p = 'x'; *--p = '0'; }
+  put_str(p);
+}
+
+/// @brief append an action "<a> <v1> [<v2> [<v3>]]" to the script
+/// @param a action
+/// @param n number of values
+/// @param v1, v2, v3 values
+static void put_action(const char *a, int n, unsigned long v1, unsigned long v2, unsigned long v3)
+{
+  put_str(a);
+  put_str(" "); put_num(v1, 0);
+  if (n > 1) { put_str(" "); put_num(v2, 0); }
+  if (n > 2) { put_str(" "); put_num(v3, 0); }
+  put_str("\n");
+  nactions++;
+}
+
+/// @brief complete the script. Registered with atexit().
+static void finish(void)
+{
+  pthread_mutex_lock(&lock);
+  if (state == s_Recording) {
+    put_str("stop\nstat\n\n# "); put_num(nactions, 0);
+    put_str(" actions, peak live payload "); put_num(peak, 0);
+    put_str(" bytes, "); put_num(used, 0);
+    put_str(" blocks not freed\n");
+    flush();
+    close(fd);
+    state = s_Closed;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/// @brief acquire the lock before fork() so that the child does not inherit it locked
+static void lock_all(void)
+{
+  pthread_mutex_lock(&lock);
+}
+
+/// @brief release the lock in the parent after fork()
+static void unlock_all(void)
+{
+  pthread_mutex_unlock(&lock);
+}
+
+/// @brief stop recording in a child created by fork(). Its script would repeat the parent's.
+static void forked(void)
+{
+  pthread_mutex_init(&lock, NULL);
+  buflen = 0;
+  fd = -1;
+  state = s_Closed;
+}
+
+/// @}
+
+
+//--------------------------------------------------------------------------------------------------
+/// @name pointer to id mapping
+/// @{
+
+/// @brief map anonymous memory
+/// @param size number of bytes
+/// @retval pointer to zeroed memory or NULL
+static void* map(size_t size)
+{
+  void *p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/// @brief insert a pointer into the hash table, doubling the table when it becomes half full
+/// @param ptr pointer
+/// @param id block id
+/// @param size requested size
+/// @retval 0 on success, -1 if the table cannot grow
+static int insert(void *ptr, unsigned long id, size_t size)
+{
+  if (2*(used + 1) > tablesize) {
+    size_t n = tablesize ? 2*tablesize : TABLE_INIT;
+    Entry *t = map(n*sizeof(Entry));
+    if (t == NULL) return -1;
+
+    for (size_t i = 0; i < tablesize; i++) {
+      if (table[i].ptr == NULL) continue;
+      size_t j = HASH(table[i].ptr) & (n - 1);
+      while (t[j].ptr != NULL) j = (j + 1) & (n - 1);
+      t[j] = table[i];
+    }
+    if (table != NULL) munmap(table, tablesize*sizeof(Entry));
+    table = t;
+    tablesize = n;
+  }
+
+  size_t i = HASH(ptr) & (tablesize - 1);
+  while (table[i].ptr != NULL) i = (i + 1) & (tablesize - 1);
+  table[i] = (Entry){ ptr, id, size };
+  used++;
+  live += size;
+  if (live > peak) peak = live;
+  return 0;
+}
+
+/// @brief remove a pointer from the hash table
+/// @param ptr pointer
+/// @param[out] id block id of @a ptr
+/// @retval 1 if @a ptr was found, 0 otherwise
+static int remove_ptr(void *ptr, unsigned long *id)
+{
+  if (used == 0) return 0;
+
+  size_t mask = tablesize - 1, i = HASH(ptr) & mask;
+  while (table[i].ptr != ptr) {
+    if (table[i].ptr == NULL) return 0;
+    i = (i + 1) & mask;
+  }
+  *id = table[i].id;
+  used--;
+  live -= table[i].size;
+
+  // shift the following entries of the cluster back so that lookups do not stop at a hole
+  for (size_t j = (i + 1) & mask; table[j].ptr != NULL; j = (j + 1) & mask) {
+    size_t h = HASH(table[j].ptr) & mask;
+    if (((j - h) & mask) >= ((j - i) & mask)) {       // entry j may move to i
+      table[i] = table[j];
+      i = j;
+    }
+  }
+  table[i].ptr = NULL;
+  return 1;
+}
+
+/// @brief get an unused block id
+/// @retval block id
+static unsigned long get_id(void)
+{
+  return nids > 0 ? ids[--nids] : next_id++;
+}
+
+/// @brief return the id of a freed block
+/// @param id block id
+static void put_id(unsigned long id)
+{
+  if (nids == maxids) {
+    size_t n = maxids ? 2*maxids : 4096;
+    unsigned long *s = map(n*sizeof(unsigned long));
+    if (s == NULL) return;                            // the id is lost, which is harmless
+    if (ids != NULL) {
+      memcpy(s, ids, nids*sizeof(unsigned long));
+      munmap(ids, maxids*sizeof(unsigned long));
+    }
+    ids = s;
+    maxids = n;
+  }
+  ids[nids++] = id;
+}
+
+/// @}
+
+
+//--------------------------------------------------------------------------------------------------
+/// @name recording
+/// @{
+
+/// @brief open the script and write its header. Called with the lock held.
+static void start(void)
+{
+  const char *name = getenv("MM_TRACE");
+  const char *s = getenv("MM_DATASEG");
+  char path[4096];
+  size_t len = 0;
+
+  state = s_Closed;
+  if (name == NULL) name = "mmtrace.%p.dmas";
+
+  // substitute the process id for %p
+  for (const char *p = name; (*p != '\0') && (len < sizeof(path) - 24); p++) {
+    if ((p[0] == '%') && (p[1] == 'p')) {
+      char tmp[24], *t = tmp + sizeof(tmp);
+      unsigned long pid = getpid();
+      *--t = '\0';
+      do { *--t = '0' + pid % 10; pid /= 10; } while (pid > 0);
+      while (*t != '\0') path[len++] = *t++;
+      p++;
+    } else {
+      path[len++] = *p;
+    }
+  }
+  path[len] = '\0';
+
+  fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (fd < 0) return;
+
+  state = s_Recording;
+  put_str("#\n# Recorded by libmmrecord.so: ");
+  put_str(program_invocation_name != NULL ? program_invocation_name : "?");
+  put_str("\n#\n\ndataseg ");
+  put_num(s != NULL ? strtoul(s, NULL, 0) : DATASEG_SIZE, 1);
+  put_str("\nheap segfit\n\nmode performance\n\nstart\n");
+
+  atexit(finish);
+  pthread_atfork(lock_all, unlock_all, forked);
+}
+
+/// @brief enter the recorder. Fails for calls made while the current thread is recording, e.g.,
+///        allocations of the C library on behalf of atexit().
+/// @retval 1 if the call is to be recorded (the lock is held), 0 otherwise
+static int enter(void)
+{
+  if ((state == s_Closed) || busy) return 0;
+
+  busy = 1;
+  pthread_mutex_lock(&lock);
+  if (state == s_Off) start();
+  if (state == s_Recording) return 1;
+
+  pthread_mutex_unlock(&lock);
+  busy = 0;
+  return 0;
+}
+
+/// @brief leave the recorder
+static void leave(void)
+{
+  pthread_mutex_unlock(&lock);
+  busy = 0;
+}
+
+/// @brief record an allocation
+/// @param ptr allocated block (NULL if the allocation failed)
+/// @param zero block allocated by calloc()
+/// @param nelem number of elements (calloc only)
+/// @param size size in bytes
+static void record_alloc(void *ptr, int zero, size_t nelem, size_t size)
+{
+  if ((ptr == NULL) || !enter()) return;
+
+  unsigned long id = get_id();
+  if (insert(ptr, id, zero ? nelem*size : size) == 0) {
+    if (zero) put_action("c", 3, id, nelem, size);
+    else put_action("m", 2, id, size, 0);
+  } else {
+    put_id(id);
+  }
+  leave();
+}
+
+/// @}
+
+
+//--------------------------------------------------------------------------------------------------
+/// @name allocation function intercepts
+/// @{
+
+/// @brief malloc intercept. See malloc(3)
+void* malloc(size_t size)
+{
+  void *ptr = __libc_malloc(size);
+  record_alloc(ptr, 0, 0, size);
+  return ptr;
+}
+
+/// @brief calloc intercept. See calloc(3)
+void* calloc(size_t nelem, size_t size)
+{
+  void *ptr = __libc_calloc(nelem, size);
+  record_alloc(ptr, 1, nelem, size);
+  return ptr;
+}
+
+/// @brief realloc intercept. See realloc(3)
+void* realloc(void *ptr, size_t size)
+{
+  if (ptr == NULL) return malloc(size);
+
+  void *res = __libc_realloc(ptr, size);
+  if (((res == NULL) && (size > 0)) || !enter()) return res;  // failed: ptr is unchanged
+
+  unsigned long id;
+  if (remove_ptr(ptr, &id)) {
+    put_action("r", 2, id, size, 0);
+    if ((res == NULL) || (insert(res, id, size) != 0)) put_id(id);  // realloc(ptr, 0) freed ptr
+    leave();
+  } else {
+    leave();
+    record_alloc(res, 0, 0, size);                    // block allocated before recording began
+  }
+  return res;
+}
+
+/// @brief free intercept. See free(3)
+void free(void *ptr)
+{
+  if (ptr == NULL) return;
+
+  if (enter()) {
+    unsigned long id;
+    if (remove_ptr(ptr, &id)) {
+      put_action("f", 1, id, 0, 0);
+      put_id(id);
+    }
+    leave();
+  }
+  __libc_free(ptr);
+}
+
+/// @brief posix_memalign intercept. See posix_memalign(3)
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  if ((alignment < sizeof(void*)) || (alignment & (alignment - 1))) return EINVAL;
+
+  void *ptr = __libc_memalign(alignment, size);
+  if (ptr == NULL) return ENOMEM;
+  record_alloc(ptr, 0, 0, size);
+  *memptr = ptr;
+  return 0;
+}
+
+/// @brief memalign intercept. See memalign(3)
+void* memalign(size_t alignment, size_t size)
+{
+  void *ptr = __libc_memalign(alignment, size);
+  record_alloc(ptr, 0, 0, size);
+  return ptr;
+}
+
+/// @brief aligned_alloc intercept. See aligned_alloc(3)
+void* aligned_alloc(size_t alignment, size_t size)
+{
+  return memalign(alignment, size);
+}
+
+/// @brief valloc intercept. See valloc(3)
+void* valloc(size_t size)
+{
+  return memalign(getpagesize(), size);
+}
+
+/// @brief pvalloc intercept. See pvalloc(3)
+void* pvalloc(size_t size)
+{
+  size_t ps = getpagesize();
+  return memalign(ps, (size + ps - 1) / ps * ps);
+}
+
+/// @}
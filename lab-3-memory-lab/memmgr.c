@@ -17,11 +17,47 @@
 // The data segment for the heap is provided by the dataseg module. A 'word' in the heap is
 // eight bytes.
 //
-// Implicit free list:
+// Explicit free list:
 // -------------------
 // - minimal block size: 32 bytes (header +footer + 2 data words)
 // - h,f: header/footer of free block
-// - H,F: header/footer of allocated block
+// - H: header of allocated block. Allocated blocks have no footer; the payload extends to the end
+//   of the block.
+// - free blocks store the links of a doubly-linked free list in their first two payload words
+//
+//         free block                          allocated block
+//         +---+------+------+ ... +---+       +---+-----------------------------+
+//         | h | prev | next |     | f |       | H |           payload           |
+//         +---+------+------+ ... +---+       +---+-----------------------------+
+//
+// - besides the allocated bit, every header holds a prev-allocated bit that tells whether the
+//   preceding block is allocated. The footer of the preceding block (and thus PREV_BLOCK) is only
+//   consulted if that block is free.
+//
+// - first fit keeps the free list sorted by address so that it still returns the lowest-addressed
+//   fitting block. Inserting a block walks the list from the position of the last removal.
+// - next fit does not depend on the order and inserts freed blocks at the head of the list (LIFO)
+//   in constant time. The allocation policies only visit free blocks.
+//
+// Best fit:
+// ---------
+// - free blocks of at least 2*BS bytes are kept in a red-black tree ordered by (size, address).
+//   The tree node (left, right, parent, color) is stored in the first four payload words.
+// - free blocks of BS bytes are too small to hold a tree node. They are kept in a separate list
+//   and used for exact fits of minimal blocks.
+// - the smallest block >= the requested size is found in O(log n) by descending the tree.
+//
+// Segregated fit (TLSF):
+// ----------------------
+// - free blocks are kept in LIFO lists (bins) per size class. A size class is given by a first-
+//   level index (the power of two of the size) and a second-level index that linearly divides
+//   each power-of-two range into SL_COUNT classes. Sizes below SMALL_SIZE map to first level 0
+//   and are divided in BS-sized steps.
+// - a bitmap of non-empty first-level ranges and one bitmap of non-empty bins per first-level
+//   range allow finding a fitting bin with two find-first-set operations, i.e., malloc and free
+//   run in constant time independent of the number of blocks in the heap.
+// - the requested size is rounded up to the next size class before the search so that every
+//   block in the selected bin fits (good fit instead of best fit).
 //
 // - state after initialization
 //
@@ -31,14 +67,208 @@
 //               |   |   |                                         |       |
 //               v   v   v                                         v       v
 //               +---+---+-----------------------------------------+---+---+
-//               |???| F | h :                                 : f | H |???|
+//               |???| H | h :                                 : f | H |???|
 //               +---+---+-----------------------------------------+---+---+
 //                       ^                                         ^
 //                       |                                         |
 //               32-byte aligned                           32-byte aligned
 //
+// Buddy system:
+// -------------
+// - ap_Buddy splits the heap into blocks of power-of-two sizes that are aligned to their size
+//   relative to heap_start. The buddy of a block of size s at offset o is the block at offset
+//   o ^ s; two free buddies of equal size merge into the block of twice the size. Merging thus
+//   finds its neighbour by address, so free blocks have no footer and the prev-allocated bits
+//   are not maintained; a free takes at most log2(heap size / BS) merge steps.
+// - free blocks are kept in LIFO lists per order (size BS << order) with a bitmap of non-empty
+//   lists; malloc takes the head of the first non-empty list that fits (one find-first-set) and
+//   halves the block until it has the rounded-up size.
+// - requests are rounded up to a power of two, i.e., up to half of a block can be unused. The
+//   slabs are not used; the smallest requests get BS-byte blocks. Batches are served block by
+//   block. mm_realloc halves a block in place or grows it by absorbing its free upper buddies.
+// - heap_start lies BS bytes in front of a page boundary, so the payload of an aligned request
+//   (BS bytes into a block of at least the alignment) is aligned up to the page size. Larger
+//   alignments fail.
+// - the heap grows by whole aligned blocks (the new area is split into the largest aligned blocks
+//   and merged with free buddies) and is not trimmed; mm_trim() discards the pages inside free
+//   blocks only.
+//
+// Slab front end:
+// ---------------
+// - requests of up to SLAB_MAX bytes are served from runs. A run is an allocated block of
+//   PAGESIZE bytes that starts at a page boundary and is divided into equally-sized slots of
+//   one size class (multiples of SLAB_ALIGN bytes).
+//
+//         page boundary
+//         |
+//         v
+//         +---+------------------------+------+------+------+ ... +------+
+//         | H | run header (Slab)      | slot | slot | slot |     | slot |
+//         +---+------------------------+------+------+------+ ... +------+
+//
+// - free slots are kept in a LIFO list per run; slots that have never been used are handed out
+//   by bumping an index. Runs with free slots are linked into a list per size class.
+// - a bitmap with one bit per page of the data segment marks the pages holding runs; mm_free uses
+//   it to tell slots from regular payloads. The bitmap itself lives in an allocated block that is
+//   reserved at initialization.
+// - small mm_malloc/mm_free calls do not touch any boundary tags. A run that becomes empty is
+//   returned to the general heap unless it is the last run with free slots of its size class.
+//
+// Trimming:
+// ---------
+// - when a free leaves a free block at the end of the heap that exceeds the trim threshold (see
+//   mm_settrimthreshold) by more than the current growth step, the break is lowered so that one
+//   growth step of the block remains. Keeping a pad and trimming only well above it avoids growing
+//   and shrinking the heap over and over when the program allocates and frees around the break.
+// - mm_trim() releases as much as possible: it shrinks the free tail to a minimal block and gives
+//   the whole pages inside interior free blocks back to the system with ds_discard(). The header,
+//   the free index links, and the footer of a free block are never discarded.
+//
+// Zeroed memory:
+// ---------------
+// - a bitmap with one bit per page of the data segment records pages that are known to hold only
+//   zeroes: pages obtained from ds_sbrk() above the previous break and pages released by mm_trim().
+//   mm_calloc clears only the payload pages whose bit is not set; mapped blocks are fresh regions
+//   and are not cleared at all, slab slots are always cleared.
+// - a set bit is meaningful only while the page lies in the interior of a free block. The bits
+//   are cleared when an allocated block is freed or shrunk and where boundary tags are written into
+//   a free block, so allocated blocks may carry stale bits until they are freed again.
+//
+// Heap growth:
+// ------------
+// - every ds_sbrk() call that moves the break also changes the memory protection of the data
+//   segment. expand_heap therefore grows the heap by more than the missing amount: by the larger
+//   of an eighth of the current heap size and the growth step, within the limits set by
+//   mm_setgrowth. The growth step doubles with every expansion, so that allocation-heavy phases
+//   need few expansions, and is halved whenever the heap is trimmed.
+//
+// Mapped blocks:
+// --------------
+// - requests larger than the mmap threshold (default MMAP_THRESHOLD, see mm_setmmapthreshold) are
+//   not served from the heap. Each such block lives in a separate region obtained by ds_mmap() and
+//   is returned to the system as soon as it is freed; it thus neither fragments the heap nor pins
+//   the heap break. The block header carries the MAPPED flag; its size is the usable size of the
+//   region. mm_realloc resizes mapped blocks with ds_mremap() instead of copying the payload.
+//
+//         page boundary
+//         |
+//         v
+//         +---------------------+---+-------------------------------------+
+//         | ds_mmap region info | H |               payload               |
+//         +---------------------+---+-------------------------------------+
+//          DS_MAP_OVERHEAD bytes
+//
+// Heap contexts:
+// --------------
+// - the complete state of a heap (data segment, heap bounds, policy functions, free index, slab
+//   runs) lives in a mm_heap_t context that is passed to every internal function. The mm_*()
+//   functions operate on the default heap on the data segment of ds_allocate(); mm_heap_create()
+//   creates further heaps, each on a data segment of its own (ds_create()).
+// - the tuning parameters (mmap and trim thresholds, growth limits, log level) apply to all heaps.
+//
+// Thread-safe mode:
+// -----------------
+// - a heap switched to thread-safe mode (mm_heap_setthreadsafe) is protected by a mutex. To keep
+//   the threads from serializing on it, every thread has a cache of free blocks per size class:
+//   the slab classes and the block sizes up to TC_BLOCK_MAX. mm_malloc and mm_free of these sizes
+//   are served from the cache without taking the lock. A cache miss refills the class with a batch
+//   of blocks from the heap, a full class returns half of its blocks to the heap; both take the
+//   lock once per batch.
+// - cached blocks remain allocated as far as the heap is concerned. The cache of a thread belongs
+//   to the first thread-safe heap it uses and is flushed when the thread exits. Each heap keeps a
+//   list of its caches; destroying or re-initializing the heap drops them without a flush.
+//
+// Remote frees:
+// -------------
+// - all heaps are registered; the heap of a block is found by its address (data segment or the
+//   owner of a mapped region). The registry is read without a lock: every entry holds a copy of
+//   the data segment bounds and a sequence number that writers make odd while they change the
+//   entry, so readers retry instead of waiting. The owner of a single-threaded heap is read and
+//   written atomically. A block of another heap, or of a single-threaded heap owned by
+//   another thread (the last thread that allocated from it), is appended to a lock-free multi-
+//   producer/single-consumer queue of the owning heap. The queue is linked through the first
+//   payload word. Appending is a single atomic exchange, i.e., the freeing thread never waits.
+// - the owner drains the queue on its next allocation (under the heap lock in thread-safe mode)
+//   and frees the blocks with heap_free, i.e., they are coalesced as usual.
+// - in thread-safe mode, a free that finds the heap lock taken queues the block as well.
+//
+// Aligned allocation:
+// -------------------
+// - payloads are TYPE_SIZE bytes into 32-byte aligned blocks and thus never 16-byte aligned.
+//   mm_memalign moves the payload to BS bytes into the block and places the block such that the
+//   payload is aligned; the leading free space is split off as a free block. The word in front
+//   of the payload holds ALIGN_TAG (size 0, allocated), which no block header can hold, so free
+//   and realloc find the block header BS bytes in front of the payload.
+// - requests of up to SLAB_MAX bytes with an alignment of up to 16 bytes are served by the slabs.
+//
+// Batches:
+// --------
+// - mm_malloc_batch carves consecutive blocks of one size from a single free block (the first
+//   that holds the whole batch, else any that holds one block, else a heap extension) and links
+//   the remainder back once. mm_free_batch sorts the payloads by address, merges runs of
+//   adjacent blocks into one block and frees each run with a single coalesce.
+//
+// Arenas:
+// -------
+// - an arena takes chunks (ARENA_CHUNK bytes by default) from its heap and bump-allocates from
+//   them without boundary tags. A chunk is an allocated block with the ARENA bit set; its first
+//   payload word links the chunks of the arena. The arena itself lives in the first chunk.
+// - requests above a quarter chunk get a chunk of their own. Reset returns all chunks but the
+//   first to the heap, destroy all chunks, each under a single acquisition of the heap lock.
+//
+// Statistics:
+// -----------
+// - mm_stats() reports occupancy and fragmentation without walking the heap. Every insertion into
+//   and removal from the free index goes through index_insert/index_remove, which maintain the
+//   number and bytes of free blocks and a histogram of free block sizes (power-of-two classes).
+//   Allocated blocks are counted where they are placed and freed; the allocated bytes follow from
+//   the heap size. The largest free block is looked up in the free index when the statistics are
+//   read (first and next fit walk the free list).
+// - internal fragmentation is the share of the granted bytes (block, slot, or region size) that
+//   the requests did not ask for, accumulated over all allocations served by the heap. Requests
+//   served by a thread cache count with the size of their cache class.
+//
+// Integrity checks:
+// -----------------
+// - the bits above CANARY_SHIFT of every boundary tag hold a canary derived from the block size.
+//   PACK writes it, so every header, footer, and sentinel carries one; SIZE ignores it. A tag that
+//   was overwritten, e.g., by a payload overflow of the preceding block, fails TAG_OK with high
+//   probability.
+// - with checks enabled (mm_setcheck, or CHECK_LEVEL at compile time), mm_free verifies the header
+//   of the block and that the following block has the prev-allocated bit set, and coalesce
+//   verifies the tags of the neighbours it merges with. These are a few loads of words that
+//   freeing touches anyway. A block that fails is not freed (it leaks), a neighbour that fails is
+//   not merged.
+// - the walker (CHECK_WALK blocks per operation) checks the heap incrementally: every allocation
+//   and free of a heap block (not of a slot) verifies the next few blocks and continues where the
+//   last one stopped. When blocks are merged, CHECK_MERGE moves its position back to the start of
+//   the merged block. The walker stops at the first corrupt block. One block per operation costs
+//   a few percent of throughput; every further block costs about as much again.
+// - errors are recorded per heap in a ring of MM_ERRORS records (see mm_errors), not printed.
+//   Blocks in thread caches and slots are not checked.
+//
+// Logging and tracing:
+// --------------------
+// - LOG tests the log level inline, so a disabled message costs a predictable branch and its
+//   arguments are not evaluated. Messages above LOG_MAX are not compiled in.
+// - TRACE records an event in the ring buffer of mm_settrace. It is called by the mm_heap_*()
+//   functions, i.e., also for blocks served by a thread cache, and when the heap area grows or
+//   shrinks or corruption is detected. A thread claims TRACE_CHUNK slots with one atomic add
+//   and fills them without synchronization; mm_trace_dump skips slots that were claimed but not
+//   filled. With TRACE_EVENTS=0 the hooks are not compiled in.
+//
+// Policy dispatch:
+// ----------------
+// - the allocation policy is selected in mm_init; every search for a free block and every change
+//   to the free index calls the policy's functions through h->get_block, h->link_block, and
+//   h->unlink_block. GET_BLOCK, LINK_BLOCK, and UNLINK_BLOCK hide these calls.
+// - compiled with FIXED_POLICY=<ap>, the three macros call the functions of policy <ap> directly,
+//   so the compiler can inline them into malloc and free. Such a build replaces every other policy
+//   by its own in heap_init and prints a warning. 'make policies' builds mm_driver-<policy> and mm_replay-<policy> from these
+//   objects to compare them with the runtime-dispatch build.
+//
 // place sentinel half block to make algorithm easier when coalescing
-// - allocation policies: first, next, best fit
+// - allocation policies: first, next, best, segregated fit, buddy system
 // - block splitting: always at 32-byte boundaries
 // - immediate coalescing upon free
 //
@@ -46,42 +276,79 @@
 
 #include <assert.h>
 #include <error.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dataseg.h"
 #include "memmgr.h"
 
-void mm_check(void);
-
 
-static void *ds_heap_start = NULL;                     ///< physical start of data segment
-static void *ds_heap_brk   = NULL;                     ///< physical end of data segment
-static void *heap_start    = NULL;                     ///< logical start of heap
-static void *heap_end      = NULL;                     ///< logical end of heap
-static void *next_block    = NULL;                     ///< next block used by next-fit policy
 static int  PAGESIZE       = 0;                        ///< memory system page size
-static int  mm_initialized = 0;                        ///< initialized flag (yes: 1, otherwise 0)
 static int  mm_loglevel    = 0;                        ///< log level (0: off; 1: info; 2: verbose)
 
-static void* (*get_block)(size_t) = NULL; //< function pointer
-                    // it can point to any function that returns void*
-
 
 #define MAX(a, b)          ((a) > (b) ? (a) : (b))     ///< MAX function
+#define MIN(a, b)          ((a) < (b) ? (a) : (b))     ///< MIN function
 
 #define TYPE               unsigned long               ///< word type of heap - 8 bytes
 #define TYPE_SIZE          sizeof(TYPE)                ///< size of word type
 
 #define ALLOC              1                           ///< block allocated flag
 #define FREE               0                           ///< block free flag
-#define STATUS_MASK        ((TYPE)(0x7))               ///< mask to retrieve flagsfrom header/footer
-#define SIZE_MASK          (~STATUS_MASK)              ///< mask to retrieve size from header/footer
+#define PREV_ALLOC         2                           ///< preceding block allocated flag
+#define SLAB               4                           ///< block is a slab run
+#define MAPPED             8                           ///< block lives in a separate mapped region
+#define ARENA              16                          ///< block is an arena chunk
+#define STATUS_MASK        ((TYPE)(0x1f))              ///< mask to retrieve flagsfrom header/footer
+#define CANARY_SHIFT       48                          ///< boundary tag bits above hold the canary
+#define CANARY_MASK        (~(TYPE)0 << CANARY_SHIFT)  ///< mask to retrieve canary from header/footer
+#define SIZE_MASK          (~(STATUS_MASK | CANARY_MASK)) ///< mask to retrieve size from header/footer
 
 #define CHUNKSIZE          (1*(1 << 12))               ///< size by which heap is extended
+#define MMAP_THRESHOLD     (128*1024)                  ///< default size above which blocks are mapped
+#define TRIM_THRESHOLD     (128*1024)                  ///< default size of free tail that triggers trimming
+#define GROWTH_MIN         CHUNKSIZE                   ///< default minimal heap extension
+#define GROWTH_MAX         (4*1024*1024)               ///< default maximal heap extension
+#define GROWTH_SHIFT       3                           ///< heap grows by at least size >> GROWTH_SHIFT
+#define TCACHE_MAX         64                          ///< default number of cached blocks per class
+#define TRACE_CHUNK        64                          ///< trace slots claimed by a thread at once
+#ifndef CHECK_LEVEL
+#define CHECK_LEVEL        0                           ///< default integrity checks (see mm_setcheck)
+#endif
+#ifndef CHECK_WALK
+#define CHECK_WALK         0                           ///< default blocks checked per operation
+#endif
+#ifndef LOG_MAX
+#define LOG_MAX            2                           ///< highest log level compiled in (0: none)
+#endif
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS       1                           ///< compile in the event trace (mm_settrace)
+#endif
+static size_t mmap_threshold = MMAP_THRESHOLD;         ///< requests above are served by ds_mmap()
+static size_t trim_threshold = TRIM_THRESHOLD;         ///< free tails above are returned by free
+static size_t growth_min     = GROWTH_MIN;             ///< minimal heap extension
+static size_t growth_max     = GROWTH_MAX;             ///< maximal heap extension
+static unsigned int tcache_max = TCACHE_MAX;           ///< cached blocks per class and thread
+static int          check_level = CHECK_LEVEL;         ///< check tags on free and coalesce
+static unsigned int check_walk = CHECK_WALK;           ///< blocks checked per operation by the walker
+
+static struct mm_event *trace_buf = NULL;              ///< ring buffer of the trace (NULL: off)
+static unsigned long   trace_mask;                     ///< number of records in trace_buf - 1
+static unsigned long   trace_next;                     ///< number of slots claimed so far
+static unsigned long   trace_gen;                      ///< incremented by every mm_settrace()
+static unsigned long   trace_start;                    ///< timestamp when tracing began
+static struct timespec trace_start_ts;                 ///< time when tracing began
+static unsigned int    trace_threads;                  ///< number of threads that recorded events
+static __thread unsigned int trace_thread;             ///< number of the calling thread (0: none)
+static __thread unsigned long trace_pos;               ///< next slot claimed by the calling thread
+static __thread unsigned long trace_end;               ///< end of the slots claimed by the thread
+static __thread unsigned long trace_tgen;              ///< trace_gen of the claimed slots
 
 #define BS                 32                          ///< minimal block size. Must be a power of 2
 #define BS_MASK            (~(BS-1))                   ///< alignment mask
@@ -91,16 +358,29 @@ static void* (*get_block)(size_t) = NULL; //< function pointer
 
 #define PREV_PTR(p)        ((p)-TYPE_SIZE)             ///< get pointer to word preceeding p
 
-#define PACK(size,status)  ((size) | (status))         ///< pack size & status into boundary tag
+#define CANARY(size)       (((size) * 0x9e3779b97f4a7c15UL) & CANARY_MASK) ///< canary of a size
+#define PACK(size,status)  ((size) | (status) | CANARY(size)) ///< pack size & status into boundary tag
+#define TAG_OK(v)          (((v) & CANARY_MASK) == CANARY(SIZE(v))) ///< canary of tag matches its size
 #define SIZE(v)            (v & SIZE_MASK)             ///< extract size from boundary tag
 #define STATUS(v)          (v & STATUS_MASK)           ///< extract status from boundary tag
 
 #define GET(p)             (*(TYPE*)(p))               ///< read word at *p
 #define GET_SIZE(p)        (SIZE(GET(p)))              ///< extract size from header/footer
 #define GET_STATUS(p)      (STATUS(GET(p)))            ///< extract status from header/footer
+#define GET_ALLOC(p)       (GET(p) & ALLOC)            ///< extract allocated bit from header/footer
+#define GET_PREV_ALLOC(p)  (GET(p) & PREV_ALLOC)       ///< extract prev-allocated bit from header
 
 #define PUT(p, v)           (*((TYPE*)(p)) = (v))       ///< write value v to dereference pointer *p
 
+// the header of an allocated block is read without the heap lock by the thread cache (see
+// tc_class_of). The lock holder changes the prev-allocated bit of the block following the one it
+// frees or allocates; these words are read and written atomically. The holder is the only writer,
+// so a load and a store suffice.
+#define LOAD_TAG(p)        __atomic_load_n((TYPE*)(p), __ATOMIC_RELAXED)       ///< atomic read
+#define STORE_TAG(p, v)    __atomic_store_n((TYPE*)(p), (v), __ATOMIC_RELAXED) ///< atomic write
+#define SET_PREV_ALLOC(p)  STORE_TAG(p, LOAD_TAG(p) | PREV_ALLOC)  ///< mark preceding block allocated
+#define CLR_PREV_ALLOC(p)  STORE_TAG(p, LOAD_TAG(p) & ~PREV_ALLOC) ///< mark preceding block free
+
 #define ROUND_UP(w)       (((w)+BS-1)/BS*BS)
 #define ROUND_DOWN(w)     ((w)/BS*BS)
 
@@ -108,11 +388,256 @@ static void* (*get_block)(size_t) = NULL; //< function pointer
 #define NEXT_BLOCK(p)     ((p) + GET_SIZE(p))
 #define PREV_BLOCK(p)     ((p) - GET_SIZE(((p)-TYPE_SIZE)))
 
+#define PREV_FREE(p)      (*(void**)((p) + TYPE_SIZE))    // prev link of a block in the free list
+#define NEXT_FREE(p)      (*(void**)((p) + 2*TYPE_SIZE))  // next link of a block in the free list
+
+#define SL_SHIFT          4                            ///< log2 of number of second-level classes
+#define SL_COUNT          (1 << SL_SHIFT)              ///< number of second-level classes
+#define SMALL_SHIFT       9                            ///< log2(BS * SL_COUNT)
+#define SMALL_SIZE        (1 << SMALL_SHIFT)           ///< sizes below are kept in first level 0
+#define FL_COUNT          32                           ///< number of first-level classes
+
+#define FLS(w)            (63 - __builtin_clzl(w))     // index of most significant set bit
+#define FFS(w)            (__builtin_ctzl(w))          // index of least significant set bit
+
+#define BUDDY_ORDERS      43                           ///< block orders (BS << order fits SIZE_MASK)
+#define BUDDY_SIZE(size)  ((size) <= BS ? (size_t)BS : 2UL << FLS((size) - 1))
+                                                       // round up to a buddy block size
+#define BUDDY_ORDER(size) (FLS(size) - FLS(BS))        // order of a buddy block size
+#define BUDDY(h, p, size) ((h)->heap_start + (((p) - (h)->heap_start) ^ (size)))
+                                                       // buddy of a block of given size
+#define BUDDY_ALIGNED(h, p, size) ((((size) & ((size) - 1)) == 0) && \
+                                   ((((p) - (h)->heap_start) & ((size) - 1)) == 0))
+                                                       // block is a power of two aligned to its size
+
+#define RB_LEFT(p)        (*(void**)((p) + TYPE_SIZE))    // left child of a tree node
+#define RB_RIGHT(p)       (*(void**)((p) + 2*TYPE_SIZE))  // right child of a tree node
+#define RB_PARENT(p)      (*(void**)((p) + 3*TYPE_SIZE))  // parent of a tree node
+#define RB_COLOR(p)       (*(TYPE*)((p) + 4*TYPE_SIZE))   // color of a tree node
+#define RED               1                            ///< red tree node
+#define BLACK             0                            ///< black tree node
+
+#define RB_NIL            ((void*)h->rb_nil_node)      ///< sentinel leaf pointer
+
+#define SLAB_ALIGN        16                           ///< slot size granularity and alignment
+#define SLAB_MAX          256                          ///< largest request served by the slabs
+#define SLAB_CLASSES      (SLAB_MAX / SLAB_ALIGN)      ///< number of slab size classes
+#define SLAB_CLASS(size)  (((size) + SLAB_ALIGN - 1) / SLAB_ALIGN - ((size) > 0))
+                                                       // size class of a small request
+#define SLOT_SIZE(cls)    (((cls) + 1) * SLAB_ALIGN)   // slot size of size class
+
+/// @brief header of a slab run. Overlays the run block starting with its boundary tag.
+typedef struct __slab {
+  TYPE           hdr;             ///< boundary tag of the run block
+  struct __slab  *prev, *next;    ///< prev/next run with free slots of the same size class
+  void           *free;           ///< list of free slots
+  unsigned int   cls;             ///< size class
+  unsigned int   nfree;           ///< number of free slots
+  unsigned int   nslots;          ///< number of slots
+  unsigned int   unused;          ///< index of the first slot never handed out
+} Slab;
+
+static int  PAGESHIFT      = 0;                        ///< log2(PAGESIZE)
+
+#define PAGE_IDX(p)       ((WORD(p) - WORD(h->ds_heap_start)) >> PAGESHIFT)
+                                                       // index of page containing p
+#define PAGE_OF(p)        PTR(WORD(p) & ~(TYPE)(PAGESIZE-1))
+                                                       // start of page containing p
+#define MAP_BLOCKSIZE(size) ((TYPE_SIZE + (size) + DS_MAP_OVERHEAD + PAGESIZE - 1) / PAGESIZE * \
+                           PAGESIZE - DS_MAP_OVERHEAD) // usable size of region of mapped block
+#define IS_SLOT(p)        (((p) > h->heap_start) && ((p) < HEAP_END(h)) && \
+                           (__atomic_load_n(&h->slab_map[PAGE_IDX(p) >> 3], __ATOMIC_ACQUIRE) & \
+                            (1 << (PAGE_IDX(p) & 7)))) // p points into a slab run (also used without
+                                                       // the heap lock; see tc_class_of)
+#define HEAP_END(h)       __atomic_load_n(&(h)->heap_end, __ATOMIC_ACQUIRE)
+#define SET_HEAP_END(h, p) __atomic_store_n(&(h)->heap_end, (p), __ATOMIC_RELEASE)
+#define ZERO_PAGE(p)      (h->zero_map[PAGE_IDX(p) >> 3] & (1 << (PAGE_IDX(p) & 7)))
+                                                       // page of p is known to be zero
+
+#define TC_BLOCK_MAX      1024                         ///< largest block kept in the thread caches
+#define TC_CLASSES        (SLAB_CLASSES + TC_BLOCK_MAX / BS)
+                                                       // number of thread cache classes
+#define TC_BLOCK_CLASS(bs) (SLAB_CLASSES + (bs) / BS - 1)
+                                                       // thread cache class of a block size
+#define TC_BUDDY_CLASS(bs) ((bs) <= SLAB_MAX + TYPE_SIZE ? ((bs) - TYPE_SIZE) / SLAB_ALIGN - 1 : \
+                            TC_BLOCK_CLASS(bs))
+                                                       // thread cache class of a buddy block size
+#define TC_SIZE(cls)      ((cls) < SLAB_CLASSES ? SLOT_SIZE(cls) : \
+                           ((cls) - SLAB_CLASSES + 1) * BS - TYPE_SIZE)
+                                                       // request size served by a cache class
+
+#define STATS_CLASS(size) MIN(FLS(size) - FLS(BS), MM_STATS_CLASSES - 1)
+                                                       // free block histogram class of a size
+#define GRANT(h, size, bytes) ((h)->stats.requested += (size), (h)->stats.granted += (bytes))
+                                                       // account a request served by the heap
+#define CHECK_MERGE(h, lo, hi) do { if (((h)->check_next > (void*)(lo)) && \
+                                        ((h)->check_next < (void*)(hi))) (h)->check_next = (lo); \
+                               } while (0)             // keep the walker on a block boundary when
+                                                       // the blocks in [lo, hi) are merged
+#define WALK_STOPPED      PTR(-1)                      // walker found a corrupt block
+
+#if !defined(FIXED_POLICY)                             // policy selected by mm_init
+#define GET_BLOCK(h, size)     ((h)->get_block((h), (size)))
+#define LINK_BLOCK(h, block)   ((h)->link_block((h), (block)))
+#define UNLINK_BLOCK(h, block) ((h)->unlink_block((h), (block)))
+#elif FIXED_POLICY == 0                                // ap_FirstFit
+#define GET_BLOCK(h, size)     ff_get_free_block((h), (size))
+#define LINK_BLOCK(h, block)   insert_free((h), (block))
+#define UNLINK_BLOCK(h, block) unlink_free((h), (block))
+#elif FIXED_POLICY == 1                                // ap_NextFit
+#define GET_BLOCK(h, size)     nf_get_free_block((h), (size))
+#define LINK_BLOCK(h, block)   push_free((h), (block))
+#define UNLINK_BLOCK(h, block) unlink_free((h), (block))
+#elif FIXED_POLICY == 2                                // ap_BestFit
+#define GET_BLOCK(h, size)     bf_get_free_block((h), (size))
+#define LINK_BLOCK(h, block)   bf_link((h), (block))
+#define UNLINK_BLOCK(h, block) bf_unlink((h), (block))
+#elif FIXED_POLICY == 3                                // ap_SegregatedFit
+#define GET_BLOCK(h, size)     sf_get_free_block((h), (size))
+#define LINK_BLOCK(h, block)   seg_link((h), (block))
+#define UNLINK_BLOCK(h, block) seg_unlink((h), (block))
+#elif FIXED_POLICY == 4                                // ap_Buddy
+#define GET_BLOCK(h, size)     bd_get_free_block((h), (size))
+#define LINK_BLOCK(h, block)   bd_link((h), (block))
+#define UNLINK_BLOCK(h, block) bd_unlink((h), (block))
+#else
+#error "FIXED_POLICY must be the value of an AllocationPolicy (0-4)"
+#endif
+
+#if !defined(FIXED_POLICY)
+#define IS_BUDDY(h)            ((h)->policy == ap_Buddy) // heap is a buddy system
+#else
+#define IS_BUDDY(h)            (FIXED_POLICY == 4)
+#endif
+
+#define FREE_HEAD(h)      (IS_BUDDY(h) ? 3*TYPE_SIZE : 2*BS) // header and free index links (up to a
+                                                       // tree node) at the start of a free block
+#define FREE_TAIL(h)      (IS_BUDDY(h) ? 0 : TYPE_SIZE)  // footer at the end of a free block
+
+#define MAX_HEAPS         64                           ///< maximal number of heaps
+#define IN_HEAP(h, p)     (((void*)(p) >= (h)->ds_heap_start) && ((void*)(p) < (h)->ds_heap_end))
+                                                       // p points into the data segment of heap h
+#define HEAP_OWNER(h)     __atomic_load_n(&(h)->owner, __ATOMIC_ACQUIRE)
+                                                       // owner of a single-threaded heap; read
+                                                       // by other threads when they free
+#define REMOTE_STUB(h)    ((void*)&(h)->remote_stub)   // stub node of the remote-free queue
+#define NEXT_REMOTE(p)    (*(void**)(p))               // link of a payload in the remote-free queue
+
+#define ALIGN_TAG         PACK(0, ALLOC)               ///< word in front of an aligned payload
+#define IS_ALIGNED_PAYLOAD(p) (GET((p) - TYPE_SIZE) == ALIGN_TAG)
+                                                       // p was returned by mm_memalign; its block
+                                                       // starts BS bytes in front of it
+#define ALIGNED_PAYLOAD(p) ((p) - BS + TYPE_SIZE)      // regular payload of an aligned payload
+
+#define ARENA_ALIGN       16                           ///< alignment of arena allocations
+#define ARENA_CHUNK       (64*1024)                    ///< default size of an arena chunk
+#define CHUNK_HDR         TYPE_SIZE                    ///< chunk link; aligns arena data to 16 bytes
+#define ROUND_ARENA(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+                                                       // round up to arena alignment
+
+/// @brief arena. Lives in the first chunk of the arena, after the chunk link.
+struct mm_arena {
+  mm_heap_t *heap;                                     ///< heap the chunks are taken from
+  void      *chunks;                                   ///< first chunk (payload, holds the arena)
+  void      *cur;                                      ///< next free byte of the current chunk
+  void      *end;                                      ///< end of the current chunk
+  size_t    chunksize;                                 ///< size of a regular chunk
+};
+
+/// @brief heap context. Holds the complete state of one heap; every heap has its own data segment.
+struct mm_heap {
+  DataSeg *ds;                                         ///< data segment of the heap
+  void *ds_heap_start;                                 ///< physical start of data segment
+  void *ds_heap_brk;                                   ///< physical end of data segment
+  void *ds_heap_end;                                   ///< largest possible break of data segment
+  void *heap_start;                                    ///< logical start of heap
+  void *heap_end;                                      ///< logical end of heap
+  AllocationPolicy policy;                             ///< allocation policy
+  int  initialized;                                    ///< initialized flag (yes: 1, otherwise 0)
+  size_t grow_step;                                    ///< current growth step
+
+  void* (*get_block)(mm_heap_t*, size_t);              ///< find a free block with the policy
+  void (*link_block)(mm_heap_t*, void*);               ///< insert a free block into the free index
+  void (*unlink_block)(mm_heap_t*, void*);             ///< remove a free block from the free index
+
+  void *next_block;                                    ///< next block used by next-fit policy
+  void *free_list;                                     ///< first block of the explicit free list
+  void *free_hint;                                     ///< free list block preceding the last removal
+
+  void *bins[FL_COUNT][SL_COUNT];                      ///< segregated free lists (TLSF bins)
+  unsigned long fl_bitmap;                             ///< non-empty first-level classes
+  unsigned long sl_bitmap[FL_COUNT];                   ///< non-empty bins per first-level class
+
+  TYPE rb_nil_node[5];                                 ///< sentinel leaf of the best-fit tree
+  void *rb_root;                                       ///< root of the best-fit tree
+  void *small_list;                                    ///< free blocks of size BS (best fit)
+
+  void *orders[BUDDY_ORDERS];                          ///< free lists per block order (buddy)
+  unsigned long order_map;                             ///< non-empty free lists (buddy)
+
+  Slab *slabs[SLAB_CLASSES];                           ///< runs with free slots per size class
+  unsigned char *slab_map;                             ///< one bit per page: page holds a run
+  unsigned char *zero_map;                             ///< one bit per page: page is known to be zero
+
+  int  threaded;                                       ///< thread-safe mode (yes: 1, otherwise 0)
+  pthread_mutex_t lock;                                ///< protects the heap in thread-safe mode
+  pthread_t owner;                                     ///< thread that allocates from the heap
+  struct __tcache *caches;                             ///< thread caches of the heap (tcache_lock)
+
+  void *remote_head;                                   ///< last payload of the remote-free queue
+  void *remote_tail;                                   ///< next payload to drain
+  void *remote_stub;                                   ///< link of the stub node of the queue
+
+  struct mm_stats stats;                               ///< incrementally maintained statistics
+
+  void *check_next;                                    ///< next block checked by the walker
+  unsigned long nerrors;                               ///< number of detected errors
+  struct mm_error errors[MM_ERRORS];                   ///< most recent errors (ring buffer)
+};
+
+#define LOCK(h)           do { if ((h)->threaded) pthread_mutex_lock(&(h)->lock); } while (0)
+#define UNLOCK(h)         do { if ((h)->threaded) pthread_mutex_unlock(&(h)->lock); } while (0)
+
+/// @brief per-thread cache of free blocks of one heap
+typedef struct __tcache {
+  mm_heap_t    *heap;                                  ///< heap the cached blocks belong to
+  struct __tcache *next;                               ///< next cache of the same heap
+  void         *bins[TC_CLASSES];                      ///< cached payloads per class (LIFO)
+  unsigned int count[TC_CLASSES];                      ///< number of cached payloads per class
+} TCache;
+
+static __thread TCache tcache;                         ///< cache of the calling thread
+static pthread_key_t  tcache_key;                      ///< flushes the cache when a thread exits
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT; ///< creates tcache_key once
+static pthread_mutex_t tcache_lock = PTHREAD_MUTEX_INITIALIZER; ///< protects the cache lists
+
+/// @brief entry of the heap registry. Entries are read without a lock (see heap_of); writers
+///        make @a seq odd while they change the entry.
+typedef struct __heap_entry {
+  unsigned long seq;                                   ///< sequence number (odd: being changed)
+  mm_heap_t    *heap;                                  ///< registered heap (NULL: unused entry)
+  void         *start;                                 ///< start of the data segment of the heap
+  void         *end;                                   ///< end of the data segment of the heap
+  DataSeg      *ds;                                    ///< data segment (owner of mapped regions)
+} HeapEntry;
+
+static mm_heap_t default_heap;                         ///< heap of the mm_*() functions
+static HeapEntry heaps[MAX_HEAPS];                     ///< registered heaps (owners of blocks)
+static pthread_mutex_t heaps_lock = PTHREAD_MUTEX_INITIALIZER; ///< serializes writers of heaps[]
+
 // add more macros as needed
 
 /// @brief print a log message if level <= mm_loglevel. The variadic argument is a printf format
-///        string followed by its parametrs
-#define LOG(level, ...) mm_log(level, __VA_ARGS__)
+///        string followed by its parametrs. The level is tested inline before the arguments are
+///        evaluated; levels above LOG_MAX are removed by the compiler.
+#define LOG(level, ...) \
+  do { if (((level) <= LOG_MAX) && __builtin_expect((level) <= mm_loglevel, 0)) \
+         mm_log(level, __VA_ARGS__); } while (0)
+
+/// @brief record an event in the trace if tracing is enabled. See TraceEvent for the arguments.
+#define TRACE(type, ptr, arg, size) \
+  do { if (TRACE_EVENTS && __builtin_expect(trace_buf != NULL, 0)) \
+         trace_event(type, ptr, (unsigned long)(arg), size); } while (0)
 
 /// @brief print a log message. Do not call directly; use LOG() instead
 /// @param level log level of message.
@@ -132,6 +657,44 @@ static void mm_log(int level, ...)
   fprintf(stdout, "\n");
 }
 
+/// @brief timestamp of trace events. The time stamp counter on x86, else nanoseconds.
+static inline unsigned long trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000UL + t.tv_nsec;
+#endif
+}
+
+/// @brief append an event to the trace. Do not call directly; use TRACE() instead. Every thread
+///        claims TRACE_CHUNK slots of the ring at a time with one atomic add and fills them
+///        without synchronization; slots that are claimed but not yet filled have a zero
+///        timestamp.
+static void trace_event(TraceEvent type, void *ptr, unsigned long arg, size_t size)
+{
+  struct mm_event *buf = __atomic_load_n(&trace_buf, __ATOMIC_ACQUIRE);
+  if(buf == NULL) return;                                         // stopped concurrently
+
+  if((trace_pos == trace_end) || (trace_tgen != trace_gen)){
+    if(trace_thread == 0) trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+    trace_pos = __atomic_fetch_add(&trace_next, TRACE_CHUNK, __ATOMIC_RELAXED);
+    trace_end = trace_pos + TRACE_CHUNK;
+    trace_tgen = trace_gen;
+    for(unsigned long i = trace_pos; i < trace_end; i++) buf[i & trace_mask].time = 0;
+  }
+
+  struct mm_event *e = &buf[trace_pos++ & trace_mask];
+  e->time = trace_clock();
+  e->ptr = ptr;
+  e->arg = arg;
+  e->size = size;
+  e->thread = trace_thread;
+  e->type = type;
+}
+
 
 /// @brief print error message and terminate process. The variadic argument is a printf format
 ///        string followed by its parameters
@@ -156,222 +719,908 @@ static void mm_panic(const char *func, ...)
   exit(EXIT_FAILURE);
 }
 
-static void* ff_get_free_block(size_t);
-static void* nf_get_free_block(size_t);
-static void* bf_get_free_block(size_t);
+/// @brief remove a free block from the free list
+/// @param block header of the free block
+static void unlink_free(mm_heap_t *h, void *block)
+{
+  void *prev = PREV_FREE(block);
+  void *next = NEXT_FREE(block);
 
-/// @brief initialize the heap
-/// @param ap allocation policy
+  if (prev != NULL) NEXT_FREE(prev) = next;
+  else h->free_list = next;
+  if (next != NULL) PREV_FREE(next) = prev;
 
-void mm_init(AllocationPolicy ap)
+  h->free_hint = prev;                                          // blocks re-inserted around here
+  if (h->next_block == block) h->next_block = next;             // keep next-fit rover on the list
+}
+
+/// @brief insert a free block into the address-ordered free list. The search starts at the
+///        list position of the last removal if possible, so that re-inserting a split or
+///        coalesced block does not walk the list.
+/// @param block header of the free block
+static void insert_free(mm_heap_t *h, void *block)
 {
-  LOG(1, "mm_init(%d)", ap);
+  void *prev = NULL;
+  void *next = h->free_list;
+
+  if ((h->free_hint != NULL) && (h->free_hint < block)) {
+    prev = h->free_hint;
+    next = NEXT_FREE(prev);
+  }
+
+  while ((next != NULL) && (next < block)) {
+    prev = next;
+    next = NEXT_FREE(next);
+  }
+
+  PREV_FREE(block) = prev;
+  NEXT_FREE(block) = next;
+  if (prev != NULL) NEXT_FREE(prev) = block;
+  else h->free_list = block;
+  if (next != NULL) PREV_FREE(next) = block;
+}
+
+/// @brief insert a free block at the head of the free list (LIFO). Next fit does not depend on the
+///        order of the list, so freeing does not search for the list position.
+/// @param block header of the free block
+static void push_free(mm_heap_t *h, void *block)
+{
+  void *next = h->free_list;
+
+  PREV_FREE(block) = NULL;
+  NEXT_FREE(block) = next;
+  if (next != NULL) PREV_FREE(next) = block;
+  h->free_list = block;
+}
+
+/// @brief compute the TLSF bin of a block size
+/// @param size block size
+/// @param[out] fl first-level index
+/// @param[out] sl second-level index
+static void seg_mapping(size_t size, int *fl, int *sl)
+{
+  if (size < SMALL_SIZE) {
+    *fl = 0;
+    *sl = size / BS;
+  } else {
+    int msb = FLS(size);
+    *fl = msb - SMALL_SHIFT + 1;
+    *sl = (size >> (msb - SL_SHIFT)) - SL_COUNT;
+  }
+}
+
+/// @brief remove a free block from its TLSF bin
+/// @param block header of the free block
+static void seg_unlink(mm_heap_t *h, void *block)
+{
+  int fl, sl;
+  seg_mapping(GET_SIZE(block), &fl, &sl);
+
+  void *prev = PREV_FREE(block);
+  void *next = NEXT_FREE(block);
+
+  if (prev != NULL) NEXT_FREE(prev) = next;
+  else h->bins[fl][sl] = next;
+  if (next != NULL) PREV_FREE(next) = prev;
+
+  if (h->bins[fl][sl] == NULL) {                                // bin became empty
+    h->sl_bitmap[fl] &= ~(1UL << sl);
+    if (h->sl_bitmap[fl] == 0) h->fl_bitmap &= ~(1UL << fl);
+  }
+}
+
+/// @brief insert a free block at the head of its TLSF bin
+/// @param block header of the free block
+static void seg_link(mm_heap_t *h, void *block)
+{
+  int fl, sl;
+  seg_mapping(GET_SIZE(block), &fl, &sl);
+
+  void *next = h->bins[fl][sl];
+  PREV_FREE(block) = NULL;
+  NEXT_FREE(block) = next;
+  if (next != NULL) PREV_FREE(next) = block;
+  h->bins[fl][sl] = block;
+
+  h->sl_bitmap[fl] |= 1UL << sl;
+  h->fl_bitmap |= 1UL << fl;
+}
+
+/// @brief order of blocks in the best-fit tree: by size, then by address
+/// @param a header of block a
+/// @param b header of block b
+/// @retval 1 if @a a is ordered before @a b
+/// @retval 0 otherwise
+static int rb_less(void *a, void *b)
+{
+  return (GET_SIZE(a) < GET_SIZE(b)) || ((GET_SIZE(a) == GET_SIZE(b)) && (a < b));
+}
+
+/// @brief rotate the subtree at @a x to the left
+/// @param x tree node
+static void rb_rotate_left(mm_heap_t *h, void *x)
+{
+  void *y = RB_RIGHT(x);
+
+  RB_RIGHT(x) = RB_LEFT(y);
+  if (RB_LEFT(y) != RB_NIL) RB_PARENT(RB_LEFT(y)) = x;
+  RB_PARENT(y) = RB_PARENT(x);
+  if (RB_PARENT(x) == RB_NIL) h->rb_root = y;
+  else if (x == RB_LEFT(RB_PARENT(x))) RB_LEFT(RB_PARENT(x)) = y;
+  else RB_RIGHT(RB_PARENT(x)) = y;
+  RB_LEFT(y) = x;
+  RB_PARENT(x) = y;
+}
+
+/// @brief rotate the subtree at @a x to the right
+/// @param x tree node
+static void rb_rotate_right(mm_heap_t *h, void *x)
+{
+  void *y = RB_LEFT(x);
+
+  RB_LEFT(x) = RB_RIGHT(y);
+  if (RB_RIGHT(y) != RB_NIL) RB_PARENT(RB_RIGHT(y)) = x;
+  RB_PARENT(y) = RB_PARENT(x);
+  if (RB_PARENT(x) == RB_NIL) h->rb_root = y;
+  else if (x == RB_RIGHT(RB_PARENT(x))) RB_RIGHT(RB_PARENT(x)) = y;
+  else RB_LEFT(RB_PARENT(x)) = y;
+  RB_RIGHT(y) = x;
+  RB_PARENT(x) = y;
+}
+
+/// @brief insert a free block into the best-fit tree
+/// @param z header of the free block
+static void rb_insert(mm_heap_t *h, void *z)
+{
+  void *y = RB_NIL;
+  void *x = h->rb_root;
+
+  while (x != RB_NIL) {
+    y = x;
+    x = rb_less(z, x) ? RB_LEFT(x) : RB_RIGHT(x);
+  }
+
+  RB_PARENT(z) = y;
+  if (y == RB_NIL) h->rb_root = z;
+  else if (rb_less(z, y)) RB_LEFT(y) = z;
+  else RB_RIGHT(y) = z;
+  RB_LEFT(z) = RB_RIGHT(z) = RB_NIL;
+  RB_COLOR(z) = RED;
+
+  // restore the red-black properties
+  while (RB_COLOR(RB_PARENT(z)) == RED) {
+    void *p = RB_PARENT(z);
+    void *g = RB_PARENT(p);
+
+    if (p == RB_LEFT(g)) {
+      y = RB_RIGHT(g);
+      if (RB_COLOR(y) == RED) {
+        RB_COLOR(p) = RB_COLOR(y) = BLACK;
+        RB_COLOR(g) = RED;
+        z = g;
+      } else {
+        if (z == RB_RIGHT(p)) {
+          z = p;
+          rb_rotate_left(h, z);
+        }
+        RB_COLOR(RB_PARENT(z)) = BLACK;
+        RB_COLOR(g) = RED;
+        rb_rotate_right(h, g);
+      }
+    } else {
+      y = RB_LEFT(g);
+      if (RB_COLOR(y) == RED) {
+        RB_COLOR(p) = RB_COLOR(y) = BLACK;
+        RB_COLOR(g) = RED;
+        z = g;
+      } else {
+        if (z == RB_LEFT(p)) {
+          z = p;
+          rb_rotate_right(h, z);
+        }
+        RB_COLOR(RB_PARENT(z)) = BLACK;
+        RB_COLOR(g) = RED;
+        rb_rotate_left(h, g);
+      }
+    }
+  }
+  RB_COLOR(h->rb_root) = BLACK;
+}
+
+/// @brief replace the subtree rooted at @a u by the subtree rooted at @a v
+/// @param u tree node
+/// @param v tree node
+static void rb_transplant(mm_heap_t *h, void *u, void *v)
+{
+  if (RB_PARENT(u) == RB_NIL) h->rb_root = v;
+  else if (u == RB_LEFT(RB_PARENT(u))) RB_LEFT(RB_PARENT(u)) = v;
+  else RB_RIGHT(RB_PARENT(u)) = v;
+  RB_PARENT(v) = RB_PARENT(u);
+}
+
+/// @brief remove a free block from the best-fit tree
+/// @param z header of the free block
+static void rb_delete(mm_heap_t *h, void *z)
+{
+  void *x, *y = z;
+  TYPE color = RB_COLOR(y);
+
+  if (RB_LEFT(z) == RB_NIL) {
+    x = RB_RIGHT(z);
+    rb_transplant(h, z, x);
+  } else if (RB_RIGHT(z) == RB_NIL) {
+    x = RB_LEFT(z);
+    rb_transplant(h, z, x);
+  } else {
+    y = RB_RIGHT(z);                                            // successor of z
+    while (RB_LEFT(y) != RB_NIL) y = RB_LEFT(y);
+    color = RB_COLOR(y);
+    x = RB_RIGHT(y);
+    if (RB_PARENT(y) == z) {
+      RB_PARENT(x) = y;
+    } else {
+      rb_transplant(h, y, x);
+      RB_RIGHT(y) = RB_RIGHT(z);
+      RB_PARENT(RB_RIGHT(y)) = y;
+    }
+    rb_transplant(h, z, y);
+    RB_LEFT(y) = RB_LEFT(z);
+    RB_PARENT(RB_LEFT(y)) = y;
+    RB_COLOR(y) = RB_COLOR(z);
+  }
+
+  if (color == RED) return;
+
+  // restore the red-black properties
+  while ((x != h->rb_root) && (RB_COLOR(x) == BLACK)) {
+    void *p = RB_PARENT(x);
+    void *w;
+
+    if (x == RB_LEFT(p)) {
+      w = RB_RIGHT(p);
+      if (RB_COLOR(w) == RED) {
+        RB_COLOR(w) = BLACK;
+        RB_COLOR(p) = RED;
+        rb_rotate_left(h, p);
+        w = RB_RIGHT(p);
+      }
+      if ((RB_COLOR(RB_LEFT(w)) == BLACK) && (RB_COLOR(RB_RIGHT(w)) == BLACK)) {
+        RB_COLOR(w) = RED;
+        x = p;
+      } else {
+        if (RB_COLOR(RB_RIGHT(w)) == BLACK) {
+          RB_COLOR(RB_LEFT(w)) = BLACK;
+          RB_COLOR(w) = RED;
+          rb_rotate_right(h, w);
+          w = RB_RIGHT(p);
+        }
+        RB_COLOR(w) = RB_COLOR(p);
+        RB_COLOR(p) = BLACK;
+        RB_COLOR(RB_RIGHT(w)) = BLACK;
+        rb_rotate_left(h, p);
+        x = h->rb_root;
+      }
+    } else {
+      w = RB_LEFT(p);
+      if (RB_COLOR(w) == RED) {
+        RB_COLOR(w) = BLACK;
+        RB_COLOR(p) = RED;
+        rb_rotate_right(h, p);
+        w = RB_LEFT(p);
+      }
+      if ((RB_COLOR(RB_RIGHT(w)) == BLACK) && (RB_COLOR(RB_LEFT(w)) == BLACK)) {
+        RB_COLOR(w) = RED;
+        x = p;
+      } else {
+        if (RB_COLOR(RB_LEFT(w)) == BLACK) {
+          RB_COLOR(RB_RIGHT(w)) = BLACK;
+          RB_COLOR(w) = RED;
+          rb_rotate_left(h, w);
+          w = RB_LEFT(p);
+        }
+        RB_COLOR(w) = RB_COLOR(p);
+        RB_COLOR(p) = BLACK;
+        RB_COLOR(RB_LEFT(w)) = BLACK;
+        rb_rotate_right(h, p);
+        x = h->rb_root;
+      }
+    }
+  }
+  RB_COLOR(x) = BLACK;
+}
+
+/// @brief insert a free block into the best-fit index (tree or list of minimal blocks)
+/// @param block header of the free block
+static void bf_link(mm_heap_t *h, void *block)
+{
+  if (GET_SIZE(block) > BS) {
+    rb_insert(h, block);
+  } else {
+    PREV_FREE(block) = NULL;
+    NEXT_FREE(block) = h->small_list;
+    if (h->small_list != NULL) PREV_FREE(h->small_list) = block;
+    h->small_list = block;
+  }
+}
+
+/// @brief remove a free block from the best-fit index
+/// @param block header of the free block
+static void bf_unlink(mm_heap_t *h, void *block)
+{
+  if (GET_SIZE(block) > BS) {
+    rb_delete(h, block);
+  } else {
+    void *prev = PREV_FREE(block);
+    void *next = NEXT_FREE(block);
+
+    if (prev != NULL) NEXT_FREE(prev) = next;
+    else h->small_list = next;
+    if (next != NULL) PREV_FREE(next) = prev;
+  }
+}
+
+/// @brief insert a free block at the head of the free list of its order (buddy system)
+/// @param block header of the free block
+static void bd_link(mm_heap_t *h, void *block)
+{
+  int order = BUDDY_ORDER(GET_SIZE(block));
+
+  void *next = h->orders[order];
+  PREV_FREE(block) = NULL;
+  NEXT_FREE(block) = next;
+  if (next != NULL) PREV_FREE(next) = block;
+  h->orders[order] = block;
+  h->order_map |= 1UL << order;
+}
+
+/// @brief remove a free block from the free list of its order (buddy system)
+/// @param block header of the free block
+static void bd_unlink(mm_heap_t *h, void *block)
+{
+  int order = BUDDY_ORDER(GET_SIZE(block));
+
+  void *prev = PREV_FREE(block);
+  void *next = NEXT_FREE(block);
+
+  if (prev != NULL) NEXT_FREE(prev) = next;
+  else h->orders[order] = next;
+  if (next != NULL) PREV_FREE(next) = prev;
+
+  if (h->orders[order] == NULL) h->order_map &= ~(1UL << order);
+}
+
+/// @brief insert a free block into the free index of the policy and count it as free
+/// @param block header of the free block
+static void index_insert(mm_heap_t *h, void *block)
+{
+  size_t size = GET_SIZE(block);
+  h->stats.free_blocks++;
+  h->stats.free_bytes += size;
+  h->stats.free_hist[STATS_CLASS(size)]++;
+  LINK_BLOCK(h, block);
+}
+
+/// @brief remove a free block from the free index of the policy and from the free counts
+/// @param block header of the free block
+static void index_remove(mm_heap_t *h, void *block)
+{
+  size_t size = GET_SIZE(block);
+  h->stats.free_blocks--;
+  h->stats.free_bytes -= size;
+  h->stats.free_hist[STATS_CLASS(size)]--;
+  UNLINK_BLOCK(h, block);
+}
+
+/// @brief mark the whole pages inside [@a from, @a to) as known to be zero. The range must lie
+///        inside a free block, clear of its header, free index links and footer. Nothing is
+///        tracked before heap_init has reserved the bitmap.
+/// @param from start of the range
+/// @param to end of the range
+static void zero_mark(mm_heap_t *h, void *from, void *to)
+{
+  if(h->zero_map == NULL) return;
+  for(void *p = PAGE_OF(from + PAGESIZE - 1); p + PAGESIZE <= to; p += PAGESIZE){
+    h->zero_map[PAGE_IDX(p) >> 3] |= 1 << (PAGE_IDX(p) & 7);
+  }
+}
+
+/// @brief forget that the pages overlapping [@a from, @a to) are zero, because they are about to
+///        be written or were handed out
+/// @param from start of the range
+/// @param to end of the range
+static void zero_clear(mm_heap_t *h, void *from, void *to)
+{
+  if(h->zero_map == NULL) return;
+  for(void *p = PAGE_OF(from); p < to; p += PAGESIZE){
+    h->zero_map[PAGE_IDX(p) >> 3] &= ~(1 << (PAGE_IDX(p) & 7));
+  }
+}
+
+/// @brief clear a payload that was just taken from a free block, except for the pages that are
+///        known to be zero. Runs of pages to clear are cleared with one memset.
+/// @param p payload
+/// @param n number of bytes to clear
+static void zero_fill(mm_heap_t *h, void *p, size_t n)
+{
+  void *end = p + n;
+  void *dirty = p;                                                  // start of the run to clear
+
+  while(p < end){
+    void *next = MIN(PAGE_OF(p) + PAGESIZE, end);
+    if(ZERO_PAGE(p)){
+      if(dirty < p) memset(dirty, 0, p - dirty);
+      dirty = next;
+    }
+    p = next;
+  }
+  if(dirty < end) memset(dirty, 0, end - dirty);
+}
+
+/// @brief record an error detected by the integrity checks
+/// @param kind kind of error
+/// @param block header of the affected block
+/// @param tag offending boundary tag
+/// @retval -1
+static int check_error(mm_heap_t *h, HeapError kind, void *block, TYPE tag)
+{
+  LOG(1, "    ERROR: heap corruption (%d) at %p, tag %lx", kind, block, tag);
+  TRACE(te_Error, block, kind, 0);
+
+  struct mm_error *e = &h->errors[h->nerrors++ % MM_ERRORS];
+  e->kind = kind;
+  e->block = block;
+  e->tag = tag;
+  return -1;
+}
+
+/// @brief check the header of a block that is about to be freed. The block must be allocated and
+///        the following block must know that its predecessor is allocated. A buddy block must be
+///        aligned to its size instead.
+/// @param block header of the block
+/// @retval 0 if the header is valid
+/// @retval -1 otherwise (the error is recorded)
+static int check_header(mm_heap_t *h, void *block)
+{
+  TYPE hdr = GET(block);
+  size_t size = SIZE(hdr);
+
+  if(!TAG_OK(hdr) || (size < BS) || (size & (BS-1))) return check_error(h, he_Header, block, hdr);
+  if((hdr & ALLOC) == FREE) return check_error(h, he_Free, block, hdr);
+  if(hdr & MAPPED) return 0;
+
+  if(block + size > h->heap_end) return check_error(h, he_Header, block, hdr);
+  if(IS_BUDDY(h)) return BUDDY_ALIGNED(h, block, size) ? 0 : check_error(h, he_Header, block, hdr);
+  if(!GET_PREV_ALLOC(block + size)) return check_error(h, he_Neighbour, block + size, GET(block + size));
+  return 0;
+}
+
+/// @brief check the neighbours of a free block before it is coalesced: the header of the
+///        following block and, if they are free, the footer of the following block and the footer
+///        and header of the preceding block
+/// @param block header of the free block
+/// @retval 0 if the tags agree
+/// @retval -1 otherwise (the error is recorded)
+static int check_neighbours(mm_heap_t *h, void *block)
+{
+  void *next = NEXT_BLOCK(block);
+  TYPE tag = GET(next);
+  size_t size = SIZE(tag);
+
+  if(!TAG_OK(tag) || (next + size > h->heap_end) || ((next < h->heap_end) && (size < BS))){
+    return check_error(h, he_Header, next, tag);
+  }
+  if(((tag & ALLOC) == FREE) && (GET(next + size - TYPE_SIZE) != (tag & ~(TYPE)PREV_ALLOC))){
+    return check_error(h, he_Footer, next, GET(next + size - TYPE_SIZE));
+  }
+
+  if(!GET_PREV_ALLOC(block)){
+    tag = GET(block - TYPE_SIZE);
+    size = SIZE(tag);
+    if(!TAG_OK(tag) || (tag & ALLOC) || (size < BS) || (block - size < h->heap_start)){
+      return check_error(h, he_Footer, block - size, tag);
+    }
+    if((GET(block - size) & ~(TYPE)PREV_ALLOC) != tag){
+      return check_error(h, he_Neighbour, block - size, GET(block - size));
+    }
+  }
+
+  return 0;
+}
+
+/// @brief check the next check_walk blocks of the heap, continuing where the last call stopped and
+///        wrapping around at the end of the heap. The walker stops at the first corrupt block.
+static void check_step(mm_heap_t *h)
+{
+  void *block = h->check_next;
+  if(block == WALK_STOPPED) return;
+  if((block < h->heap_start) || (block >= h->heap_end)) block = h->heap_start;
+
+  TYPE hdr = GET(block);
+  for(unsigned int i = 0; i < check_walk; i++){
+    size_t size = SIZE(hdr);
+    void *next = block + size;
+    int error = 0;
+
+    if(!TAG_OK(hdr) || (size < BS) || (size & (BS-1)) || (next > h->heap_end)){
+      error = check_error(h, he_Header, block, hdr);
+    } else if(IS_BUDDY(h)){                                           // no prev-allocated bits and footers
+      if(!BUDDY_ALIGNED(h, block, size)) error = check_error(h, he_Header, block, hdr);
+    } else if(((GET(next) & PREV_ALLOC) != 0) != ((hdr & ALLOC) != 0)){
+      error = check_error(h, he_Neighbour, next, GET(next));
+    } else if(((hdr & ALLOC) == FREE) && (GET(next - TYPE_SIZE) != (hdr & ~(TYPE)PREV_ALLOC))){
+      error = check_error(h, he_Footer, block, GET(next - TYPE_SIZE));
+    }
+
+    if(error){
+      h->check_next = WALK_STOPPED;
+      return;
+    }
+
+    block = next;                                                     // the header of the next block
+    if(block == h->heap_end) block = h->heap_start;                   // was read above
+    hdr = GET(block);
+  }
+
+  h->check_next = block;
+  __builtin_prefetch(block + SIZE(hdr));                              // header of the next step
+}
+
+static void* ff_get_free_block(mm_heap_t *h, size_t);
+static void* nf_get_free_block(mm_heap_t *h, size_t);
+static void* bf_get_free_block(mm_heap_t *h, size_t);
+static void* sf_get_free_block(mm_heap_t *h, size_t);
+static void* bd_get_free_block(mm_heap_t *h, size_t);
+static void bd_add_range(mm_heap_t *h, void *from, void *to, void *fresh);
+static void* alloc_block(mm_heap_t *h, size_t);
+static void heap_free(mm_heap_t *h, void*);
+static void remote_drain(mm_heap_t *h);
+static void tc_drop(mm_heap_t *h);
+
+/// @brief initialize a heap on a clean data segment
+/// @param h heap
+/// @param ds data segment of the heap
+/// @param ap allocation policy
+static void heap_init(mm_heap_t *h, DataSeg *ds, AllocationPolicy ap)
+{
+  LOG(1, "heap_init(%p, %d)", ds, ap);
+  tc_drop(h);                                   // caches hold blocks of the previous incarnation
+  memset(h, 0, sizeof(mm_heap_t));
+  h->ds = ds;
+  pthread_mutex_init(&h->lock, NULL);
+  h->owner = pthread_self();
+  h->remote_head = h->remote_tail = REMOTE_STUB(h);
+
   //set allocation policy
   char *apstr;
+  h->link_block = insert_free;
+  h->unlink_block = unlink_free;
+#ifdef FIXED_POLICY
+  if(ap != FIXED_POLICY){                       // like mm_replay -p: run the script on our policy
+    fprintf(stderr, "Warning: this build only supports allocation policy %d; "
+                    "using it instead of %d.\n", FIXED_POLICY, ap);
+    ap = FIXED_POLICY;
+  }
+#endif
   switch(ap){
-    case ap_FirstFit: get_block = ff_get_free_block; apstr = "first fit"; break;
-    case ap_NextFit: get_block = nf_get_free_block; apstr = "next fit"; break;
-    case ap_BestFit: get_block = bf_get_free_block; apstr = "best fit"; break;
+    case ap_FirstFit: h->get_block = ff_get_free_block; apstr = "first fit"; break;
+    case ap_NextFit: h->get_block = nf_get_free_block; apstr = "next fit";
+                     h->link_block = push_free; break;
+    case ap_BestFit: h->get_block = bf_get_free_block; apstr = "best fit";
+                     h->link_block = bf_link; h->unlink_block = bf_unlink; break;
+    case ap_SegregatedFit: h->get_block = sf_get_free_block; apstr = "segregated fit";
+                           h->link_block = seg_link; h->unlink_block = seg_unlink; break;
+    case ap_Buddy: h->get_block = bd_get_free_block; apstr = "buddy system";
+                   h->link_block = bd_link; h->unlink_block = bd_unlink; break;
     default: PANIC("invalid allocation policy.");
   }
+  h->policy = ap;
   LOG(2, "    allocation policy       %s\n", apstr);
 
-  ds_heap_stat(&ds_heap_start, &ds_heap_brk, NULL);
-  PAGESIZE = ds_getpagesize();
+  ds_seg_heap_stat(h->ds, &h->ds_heap_start, &h->ds_heap_brk, &h->ds_heap_end);
+  // all heaps share the page size. Only the first heap writes it; other threads may read it while
+  // later heaps are set up
+  int pagesize = ds_seg_getpagesize(h->ds);
+  if (PAGESIZE != pagesize) PAGESIZE = pagesize;
 
   LOG(1, "  ds_heap_start    %p\n"
          "  ds_heap_brk      %p\n"
          "  PAGESIZE         %d\n",
-         ds_heap_start, ds_heap_brk, PAGESIZE);
+         h->ds_heap_start, h->ds_heap_brk, PAGESIZE);
 
-  if (ds_heap_start == NULL) PANIC("Data segment not initialized.");
-  if (ds_heap_start != ds_heap_brk) PANIC("Heap not clean.");
+  if (h->ds_heap_start == NULL) PANIC("Data segment not initialized.");
+  if (h->ds_heap_start != h->ds_heap_brk) PANIC("Heap not clean.");
   if (PAGESIZE == 0) PANIC("Reported pagesize == 0.");
 
+  // compute location of heap_start (32 bytes from start of ds_heap_start). The buddy system
+  // places it BS bytes in front of a page boundary so that the payloads of aligned blocks
+  // (BS bytes into the block) are page-aligned.
+  h->heap_start = PTR((WORD(h->ds_heap_start) + TYPE_SIZE + BS - 1) / BS * BS); // 32-byte round up aligned
+  if(IS_BUDDY(h)) h->heap_start = PAGE_OF(h->heap_start + BS + PAGESIZE - 1) - BS;
+
   LOG(2, "Get first block of memory for heap"); 
-  if(ds_sbrk(CHUNKSIZE) == (void*)-1) PANIC("Cannot increase heap break.");     // increase heap by pre defined size 
-  ds_heap_brk = ds_sbrk(0);                                                     //get curr pointer of brk as ds_heap_brk
-  LOG(2, "Break is now at %p", ds_heap_brk);
-  
-  // compute location of heap_start/end (32 bytes from start/end of ds_heap_start.brk)
-  heap_start = PTR((WORD(ds_heap_start) + TYPE_SIZE + BS - 1) / BS * BS);       // 32-byte round up aligned
-  heap_end = PTR((WORD(ds_heap_brk) - TYPE_SIZE) / BS * BS);                    // 32-byte round down
+  size_t first = CHUNKSIZE + (IS_BUDDY(h) ? h->heap_start + BS - h->ds_heap_start : 0);
+  if(ds_seg_sbrk(h->ds, first) == (void*)-1) PANIC("Cannot increase heap break."); // increase heap by pre defined size 
+  h->ds_heap_brk = ds_seg_sbrk(h->ds, 0);                                       //get curr pointer of brk as ds_heap_brk
+  LOG(2, "Break is now at %p", h->ds_heap_brk);
+
+  // compute location of heap_end (32 bytes from end of ds_heap_brk)
+  SET_HEAP_END(h, PTR((WORD(h->ds_heap_brk) - TYPE_SIZE) / BS * BS));           // 32-byte round down
   LOG(2, "  heap_start at    %p\n"
          "  heap_end_at      %p\n",
-        heap_start, heap_end);
+        h->heap_start, h->heap_end);
 
   // write sentinel half blocks
   TYPE F = PACK(0,ALLOC);
-  PUT(heap_start - TYPE_SIZE, F);
+  PUT(h->heap_start - TYPE_SIZE, F);
   
   TYPE H = PACK(0,ALLOC);
-  PUT(heap_end, H);
+  PUT(h->heap_end, H);
 
-  //write free block
-  TYPE size = heap_end - heap_start;
-  TYPE bdrytag = PACK(size, FREE);
-  PUT(heap_start, bdrytag);
-  PUT(heap_end - TYPE_SIZE, bdrytag);
+  // the free index initially holds only the free heap area written below
+  h->free_list = h->free_hint = NULL;
+  h->rb_root = RB_NIL;
+  h->small_list = NULL;
+  memset(h->bins, 0, sizeof(h->bins));
+  memset(h->sl_bitmap, 0, sizeof(h->sl_bitmap));
+  h->fl_bitmap = 0;
 
-  next_block = heap_start;                                                      // initialize the global var for next fit
-  LOG(1, "next block is initialized to: %p", next_block);
+  //write free block
+  TYPE size = h->heap_end - h->heap_start;
+  if(IS_BUDDY(h)){
+    bd_add_range(h, h->heap_start, h->heap_end, h->heap_end);                   // power-of-two blocks
+  } else {
+    PUT(h->heap_start, PACK(size, FREE | PREV_ALLOC));                          // sentinel counts as allocated
+    PUT(h->heap_end - TYPE_SIZE, PACK(size, FREE));
+    index_insert(h, h->heap_start);
+  }
 
-  mm_initialized = 1;
+  h->next_block = h->heap_start;                                                // initialize the global var for next fit
+  h->grow_step = growth_min;
+  LOG(1, "next block is initialized to: %p", h->next_block);
+
+  h->initialized = 1;
+
+  // reserve the page bitmaps of the slab front end and of the zeroed pages (one bit per page of
+  // the data segment each)
+  if (PAGESHIFT != FFS((TYPE)PAGESIZE)) PAGESHIFT = FFS((TYPE)PAGESIZE);
+  size_t mapsize = ((PAGE_IDX(h->ds_heap_end) + 1) + 7) / 8;
+  void *map = alloc_block(h, ROUND_UP(TYPE_SIZE + 2*mapsize));
+  if (map == NULL) PANIC("Cannot allocate slab page map.");
+  h->slab_map = map + TYPE_SIZE;
+  h->zero_map = h->slab_map + mapsize;
+  memset(h->slab_map, 0, 2*mapsize);
+  memset(h->slabs, 0, sizeof(h->slabs));
 }
 
 /// @brief getting free block with first fit policy
 /// @param size requiring size of allocating block
-static void* ff_get_free_block(size_t size){
+static void* ff_get_free_block(mm_heap_t *h, size_t size){
   LOG(1, "ff_get_free_block(0x%lx (%lu))", size, size);
-  assert(mm_initialized);
+  assert(h->initialized);
   
-  // implementing first fit
-  void *block = heap_start;
-  size_t bsize, bstatus;
+  // implementing first fit: the free list is sorted by address
+  void *block = h->free_list;
+  size_t bsize;
 
   LOG(2, "  starting search at %p", block);
-  do{
-    bstatus = GET_STATUS(block);
+  while(block != NULL){                                                     // run through the free list
     bsize = GET_SIZE(block);
-    LOG(2, "    %p: size: %lx (%lu), status: %s",
-        block, bsize, bsize, bstatus == ALLOC ? "allocated" : "free");
+    LOG(2, "    %p: size: %lx (%lu)", block, bsize, bsize);
 
-    if((bstatus == FREE) && (bsize >= size)){                               // when FREE and fits size
+    if(bsize >= size){                                                      // when it fits size
       // found block
       LOG(2, "    --> match");
       return block;                                                         // returning appropriate free block
     }
-    block += bsize;                                                         // brings us to beginning of next block
-  } while (GET_SIZE(block) > 0);                                            // run through the heap until reach sentinel (size 0)
+    block = NEXT_FREE(block);                                               // brings us to next free block
+  }
   LOG(2, "    no suitable block found");                                    // when not block is found
   return NULL;
 }
 
 /// @brief getting free block with next fit policy
 /// @param size requiring size of allocating block
-static void* nf_get_free_block(size_t size){
+static void* nf_get_free_block(mm_heap_t *h, size_t size){
   LOG(1, "nf_get_free_block((0x%lx (%lu))",size, size);
-  assert(mm_initialized);
-  size_t bsize, bstatus;
-  void* block = next_block;                                 // initialize 'block' to the global car next_block
-  int cnt = 0;
-  while(1){
-    bstatus = GET_STATUS(block);  
-    bsize = GET_SIZE(block);
-    if(GET_SIZE(NEXT_BLOCK(block)) == 0) cnt++;             // cnt is used to check if block position loops around and comes back
+  assert(h->initialized);
+  if(h->next_block == NULL) h->next_block = h->free_list;   // rover fell off the end of the list
+  if(h->next_block == NULL) return NULL;                    // no free blocks at all
+
+  void* block = h->next_block;                              // start where the previous search left off
+  do{
+    if(GET_SIZE(block) >= size){                            // when it fits size
+      h->next_block = NEXT_FREE(block);                     // continue after this block next time
+      return block;
+    }
+    block = NEXT_FREE(block);
+    if(block == NULL) block = h->free_list;                 // wrap around to the beginning of the list
+  } while(block != h->next_block);                          // stop once we looped around all free blocks
 
-    if((bstatus == FREE) && (bsize >= size)){               // when FREE and fits size
-      if(block + bsize < heap_end){                         // if the next block address is valid
-        next_block = block + bsize;                         // set that to next_block
-      } else{
-        next_block = heap_start;                            // if next block is over heap, set the beginning of heap to next_block
-      }
-      return block;                                         // when this is an appropriate block
-    } 
-
-    LOG(1,"current cnt is: %d", cnt);
-    if(block + bsize < heap_end){                           // change the 'block' pointer depending on different cases
-      block += bsize;                               
-    }else {
-      block = heap_start;
-    } 
-    if(cnt == 2) break;                                     // when end of heap is reached twice, it assures that 
-                                                            // the block pointer looped around all possible blocks and came back
-  }
   LOG(1, "  no suitable block is found");
   return NULL;                                              // when finding block fails
 }
 
 /// @brief getting free block with best fit policy
 /// @param size requiring size of allocating block
-static void* bf_get_free_block(size_t size){
+static void* bf_get_free_block(mm_heap_t *h, size_t size){
   LOG(1, "bf_get_free_block((0x%lx (%lu))",size, size);
-  assert(mm_initialized);
-  size_t bsize, bstatus;
-  void *block = heap_start;
-  size_t minsize = 0;                                               // keeps the minimum size larger than 'size'
-  void *minblock = NULL;                                            // keeps the pointer to such a block
-  
-  while(1){
-    if((GET_STATUS(block) ==FREE) && (GET_SIZE(block)>= size)) {
-      minsize = GET_SIZE(block);
-      minblock = block;
-      break;
-    }                                                               // initialized minsize and minblock to first FREE block
-    block += GET_SIZE(block);
-    if(GET_SIZE(block) == 0) break;                                 // when it reaches end of heap
-  } // find the first free block
+  assert(h->initialized);
 
-  do{
-    bstatus = GET_STATUS(block);
-    bsize = GET_SIZE(block);
+  if((size <= BS) && (h->small_list != NULL)) return h->small_list; // exact fit for minimal blocks
 
-    if((bstatus == FREE) && (bsize >= size)){                       // if block is FREE, and fits size
-      if(bsize < minsize){                                          // if that block's size is smaller than previous minsize
-        minsize = bsize;                                            // update min block
-        minblock = block;
-      }
+  void *block = h->rb_root;
+  void *minblock = NULL;                                            // keeps the smallest fitting block
+
+  while(block != RB_NIL){                                           // descend to the smallest block >= size
+    if(GET_SIZE(block) >= size){
+      minblock = block;
+      block = RB_LEFT(block);
+    } else {
+      block = RB_RIGHT(block);
     }
-    block += bsize;                                                 // brings us to beginning of next block
-  } while (GET_SIZE(block) != 0);                                   // run through the heap until reach sentinel (size 0)
+  }
 
-                                                                    // run through entire implicit free list, 
-                                                                    // take block that matches the smallest possible size
   return minblock;
 }
 
+/// @brief getting free block with segregated fit (TLSF) policy in constant time
+/// @param size requiring size of allocating block
+static void* sf_get_free_block(mm_heap_t *h, size_t size){
+  LOG(1, "sf_get_free_block((0x%lx (%lu))",size, size);
+  assert(h->initialized);
+  int fl, sl;
+
+  // round up to the next size class so that any block in the bin fits
+  if(size >= SMALL_SIZE) size += (1UL << (FLS(size) - SL_SHIFT)) - 1;
+  seg_mapping(size, &fl, &sl);
+  if(fl >= FL_COUNT) return NULL;
+
+  unsigned long map = h->sl_bitmap[fl] & (~0UL << sl);              // non-empty bins in this range
+  if(map == 0){
+    map = (fl + 1 < FL_COUNT) ? h->fl_bitmap & (~0UL << (fl + 1)) : 0; // any larger range
+    if(map == 0) return NULL;
+    fl = FFS(map);
+    map = h->sl_bitmap[fl];
+  }
+  sl = FFS(map);
+
+  LOG(2, "    bin (%d, %d): %p", fl, sl, h->bins[fl][sl]);
+  return h->bins[fl][sl];
+}
+
+/// @brief getting free block with the buddy system: the head of the first non-empty free list of
+///        the order of the size or above
+/// @param size requiring size of allocating block
+static void* bd_get_free_block(mm_heap_t *h, size_t size){
+  LOG(1, "bd_get_free_block((0x%lx (%lu))",size, size);
+  assert(h->initialized);
+
+  int order = BUDDY_ORDER(BUDDY_SIZE(size));
+  if(order >= BUDDY_ORDERS) return NULL;
+
+  unsigned long map = h->order_map & (~0UL << order);               // non-empty lists that fit
+  if(map == 0) return NULL;
 
-/// @brief coalescing blocks upon free()
+  LOG(2, "    order %d: %p", FFS(map), h->orders[FFS(map)]);
+  return h->orders[FFS(map)];
+}
+
+/// @brief coalescing blocks upon free(). The block must be marked free but not be in the free
+///        list; the coalesced block is (re-)inserted into the free list.
 /// @param block the pointer to the block that need to be coalesced
-static void* coalesce(void *block){
+/// @retval void* header of the coalesced free block
+static void* coalesce(mm_heap_t *h, void *block){
   // input is given by pointer to header
   LOG(1, "coalesce(%p)", block);
 
-  assert(mm_initialized);
-  assert(GET_STATUS(block) == FREE);
+  assert(h->initialized);
+  assert(GET_ALLOC(block) == FREE);
 
   TYPE size = GET_SIZE(block);
   void *hdr = block;
-  void *ftr = block + size - TYPE_SIZE; 
+  void *next = NEXT_BLOCK(block);
+  int next_free = GET_ALLOC(next) == FREE;
+  int prev_free = !GET_PREV_ALLOC(block);                  // prev footer only valid if it is free
+
+  if(check_level && (check_neighbours(h, block) != 0)) next_free = prev_free = 0; // do not merge
 
   // can we coalesce with the following block
-  if(GET_STATUS(NEXT_BLOCK(block)) == FREE){
+  if(next_free){
     LOG(2, "    coalescing with suceeding block");
-
-    //size of coalesced block : size of block +  size of following block
-    size += GET_SIZE(NEXT_BLOCK(block));  // gives new size of block coalesced
-    ftr = hdr + size - TYPE_SIZE;
+    size += GET_SIZE(next);               // gives new size of block coalesced
   }
 
-  if(size > GET_SIZE(block)){
-    PUT(hdr, PACK(size, FREE));
-    PUT(ftr, PACK(size, FREE));
-  }
   // can we coalesce with the previous block
-  if(GET_STATUS(block-TYPE_SIZE) == FREE){
+  if(prev_free){
     LOG(1, "    coalescing with previous block");
-
-    //size of coalesced block : size of block +  size of previous block
-    size += GET_SIZE(PREV_BLOCK(block));  // gives new size of block coalesced
     hdr = PREV_BLOCK(block);              // header is just the previous block itself
+    size += GET_SIZE(hdr);
+  }
+
+  // remove the neighbours from the free index and insert the coalesced block
+  CHECK_MERGE(h, hdr, hdr + size);
+  if(next_free) index_remove(h, next);
+  if(prev_free) index_remove(h, hdr);
+
+  // the coalesced block is preceded by an allocated block and followed by one
+  PUT(hdr, PACK(size, FREE | PREV_ALLOC));
+  PUT(hdr + size - TYPE_SIZE, PACK(size, FREE));
+  CLR_PREV_ALLOC(hdr + size);
+  index_insert(h, hdr);
+  return hdr;
+}
+
+/// @brief merge a free buddy block with its buddy as long as the buddy is a free block of the same
+///        size, and insert the result into the free index. The buddy is found by its address; free
+///        buddy blocks need no footer.
+/// @param block header of the free block (not in the free index)
+/// @retval void* header of the merged free block
+static void* bd_coalesce(mm_heap_t *h, void *block){
+  LOG(1, "bd_coalesce(%p)", block);
+
+  assert(GET_ALLOC(block) == FREE);
+
+  size_t size = GET_SIZE(block);
+  while(1){
+    void *buddy = BUDDY(h, block, size);
+    // the buddy is allocated, split, or lies beyond the end of the heap
+    if((buddy + size > h->heap_end) || (GET(buddy) != PACK(size, FREE))) break;
+
+    LOG(2, "    merging with buddy %p", buddy);
+    index_remove(h, buddy);
+    block = MIN(block, buddy);
+    size *= 2;
+    PUT(block, PACK(size, FREE));
+  }
 
+  CHECK_MERGE(h, block, block + size);
+  index_insert(h, block);
+  return block;
+}
+
+/// @brief add the free area [@a from, @a to) at the end of a buddy heap as the largest blocks
+///        that are aligned to their size, merging them with free buddies
+/// @param from start of the area
+/// @param to end of the area (heap_end)
+/// @param fresh the memory from here on is zero
+static void bd_add_range(mm_heap_t *h, void *from, void *to, void *fresh)
+{
+  void *block;
+  size_t size;
+
+  // the blocks are tagged allocated first so that merging never reads a header not yet written
+  for(block = from; block < to; block += size){
+    size_t offset = block - h->heap_start;
+    size = 1UL << FLS((size_t)(to - block));
+    if(offset != 0) size = MIN(size, offset & -offset);
+    PUT(block, PACK(size, ALLOC));
+    zero_mark(h, MAX(fresh, block + FREE_HEAD(h)), block + size);
   }
 
-  if(size > GET_SIZE(block)){
-    PUT(hdr, PACK(size, FREE));
-    PUT(ftr, PACK(size, FREE));
+  for(block = from; block < to; block += size){
+    size = GET_SIZE(block);
+    PUT(block, PACK(size, FREE));
+    bd_coalesce(h, block);
   }
-  return hdr;
 }
 
 /// @brief expanding heap
 /// @param blocksize blocksize of block that needs to be allocated
-void* expand_heap(size_t blocksize){ //doxygen
+/// @retval void* header of the free block at the end of the heap (in the free list); with the
+///               buddy system, of a free block of at least @a blocksize bytes
+/// @retval NULL if the data segment cannot be grown
+static void* expand_heap(mm_heap_t *h, size_t blocksize){
   LOG(1, "expand_heap()");
   TYPE size;
-  if(GET_STATUS(heap_end - TYPE_SIZE) == FREE){
-    LOG(1, "prev size: %lx", GET_SIZE(heap_end - TYPE_SIZE));
-    size = blocksize - GET_SIZE(heap_end - TYPE_SIZE);
+  if(IS_BUDDY(h)){
+    // the new area must hold a block of blocksize bytes that is aligned to its size
+    size_t used = h->heap_end - h->heap_start;
+    size = (used + blocksize - 1) / blocksize * blocksize + blocksize - used;
+  } else if(!GET_PREV_ALLOC(h->heap_end)){
+    LOG(1, "prev size: %lx", GET_SIZE(h->heap_end - TYPE_SIZE));
+    // segregated fit only searches bins that fit entirely; the last block may already be enough
+    if(GET_SIZE(h->heap_end - TYPE_SIZE) >= blocksize) return PREV_BLOCK(h->heap_end);
+    size = blocksize - GET_SIZE(h->heap_end - TYPE_SIZE);
   } else { size = blocksize; }
   // old_heap_end      new_heap_end
   // ,                  ,
@@ -381,61 +1630,102 @@ void* expand_heap(size_t blocksize){ //doxygen
   //     ^                  ^
   //   ds_old_brk         ds_new_brk
   // they above is a grid for the situation below
-  int ps = ds_getpagesize();
+  int ps = ds_seg_getpagesize(h->ds);
   size = (size + ps - 1) / ps * ps;
-  void *ds_old_brk = ds_sbrk(size); 
-  void *ds_new_brk = ds_sbrk(0);   
-  void *old_heap_end = heap_end;
+
+  // grow by more than necessary to save future expansions
+  size_t step = MAX((size_t)(h->heap_end - h->heap_start) >> GROWTH_SHIFT, h->grow_step);
+  step = MIN(MAX(step, growth_min), growth_max);
+  step = (step + ps - 1) / ps * ps;
+  h->grow_step = MIN(2*h->grow_step, growth_max);
+  LOG(2, "  growing by %lx bytes (%lx needed)", MAX(size, step), size);
+
+  if(ds_seg_sbrk(h->ds, MAX(size, step)) == (void*)-1){
+    if((step <= size) || (ds_seg_sbrk(h->ds, size) == (void*)-1)) return NULL; // retry without the extra
+  }
+  void *ds_new_brk = ds_seg_sbrk(h->ds, 0);   
+  void *ds_old_brk = h->ds_heap_brk;          // pages from here on have never been written or
+  void *old_heap_end = h->heap_end;           // were discarded when the break was lowered
   void *new_heap_end = PTR((WORD(ds_new_brk) - TYPE_SIZE) / BS * BS);
+  size = new_heap_end - old_heap_end;
+
+  if(IS_BUDDY(h)){
+    PUT(new_heap_end, PACK(0, ALLOC));
+    SET_HEAP_END(h, new_heap_end);
+    h->ds_heap_brk = ds_new_brk;
+    h->stats.expansions++;
+
+    bd_add_range(h, old_heap_end, new_heap_end, ds_old_brk);
+    TRACE(te_Expand, old_heap_end, 0, size);
+    return GET_BLOCK(h, blocksize);
+  }
   
-  // make footer and header for new large free block
-  PUT(old_heap_end, PACK(size, FREE));
+  // make footer and header for new large free block. The old end sentinel knows whether the
+  // last block is allocated.
+  PUT(old_heap_end, PACK(size, FREE | GET_PREV_ALLOC(old_heap_end)));
   PUT(new_heap_end - TYPE_SIZE, PACK(size, FREE));
   
   // make new sentinel
   PUT(new_heap_end, PACK(0, ALLOC));
 
-  heap_end = new_heap_end;
-  ds_heap_brk = ds_new_brk;
+  SET_HEAP_END(h, new_heap_end);
+  h->ds_heap_brk = ds_new_brk;
+  h->stats.expansions++;
 
-  void *free_hdr = coalesce(old_heap_end);    // call coalesce for the new large free block
+  void *free_hdr = coalesce(h, old_heap_end); // call coalesce for the new large free block
+  zero_mark(h, MAX(ds_old_brk, free_hdr + FREE_HEAD(h)), new_heap_end - FREE_TAIL(h));
+  TRACE(te_Expand, free_hdr, 0, size);
   
   return free_hdr;                            // return the header of new large free block
 }
 
-void* mm_malloc(size_t size)
-{
-  LOG(1, "mm_malloc(0x%lx) (%lu in decimal)", size, size);
+/// @brief shrink the heap if the last block is free so that at most @a keep bytes of it remain
+/// @param keep minimal size of the last block after trimming (at least BS)
+/// @retval number of bytes returned to the data segment
+static size_t trim_heap(mm_heap_t *h, size_t keep){
+  if(IS_BUDDY(h)) return 0;                                 // the buddy heap only grows
+  if(GET_PREV_ALLOC(h->heap_end)) return 0;                 // last block is allocated
 
-  assert(mm_initialized);
-  
-  //figure out how big the needed block is
-  //internally, 32 block size, align, put header and footer at end
-  
-  // compute the block size
-  size_t blocksize = ROUND_UP(TYPE_SIZE + size + TYPE_SIZE);  // round up the size that needs to be allocated
-  LOG(1, "  blocksize:      %lx (%lu)", blocksize, blocksize);
+  void *block = PREV_BLOCK(h->heap_end);
+  size_t bsize = GET_SIZE(block);
+  if(bsize <= keep) return 0;
 
-  // find free block
-  void *block = get_block(blocksize); // declare a new function
-  LOG(2, "    got free block: %p", block);
-  
+  // the break moves in whole pages so that heap_end remains BS-aligned
+  size_t size = (bsize - keep) / PAGESIZE * PAGESIZE;
+  if(size == 0) return 0;
+  LOG(1, "trim_heap(): releasing %lx of %lx bytes", size, bsize);
 
-  if(block == NULL){  // NULL is returned if block could not be found
-    // no free block is big enough --> need to expand heap
-    //IDEA FOR EXPANDING THE HEAP:
-    //we have sentinel at end. just expand the heap and put the new free block there
-    //in the place of unknown leftover part
-    //call coalesce on that block, merge it with two small free block there
-    //when we expand heap, need to write new footer
-    //when expand heap by increasing ds_heap_brk, make the end sentinel and stuff again
-    //do the thing done at the beginning in mm_init()
-    block = expand_heap(blocksize); // well implemented!!
-    
+  index_remove(h, block);
+  if(ds_seg_sbrk(h->ds, -(intptr_t)size) == (void*)-1){
+    index_insert(h, block);
+    return 0;
   }
 
-  //split block when the return value is not NULL
+  h->ds_heap_brk = ds_seg_sbrk(h->ds, 0);
+  zero_clear(h, h->heap_end - size - TYPE_SIZE, h->heap_end + TYPE_SIZE); // new footer and sentinel
+  SET_HEAP_END(h, h->heap_end - size);
+  h->grow_step = MAX(h->grow_step / 2, growth_min);
+  h->stats.trims++;
+  TRACE(te_Trim, h->ds_heap_brk, 0, size);
+  bsize -= size;
+
+  PUT(block, PACK(bsize, FREE | GET_PREV_ALLOC(block)));
+  PUT(h->heap_end - TYPE_SIZE, PACK(bsize, FREE));
+  PUT(h->heap_end, PACK(0, ALLOC));                         // end sentinel, preceded by a free block
+  index_insert(h, block);
+
+  return size;
+}
+
+/// @brief allocate the free block @a block (which is in the free index) and split off the unused
+///        tail
+/// @param block header of free block of at least @a blocksize bytes
+/// @param blocksize size of allocated block
+/// @retval void* header of the allocated block
+static void* place(mm_heap_t *h, void *block, size_t blocksize)
+{
   size_t bsize = GET_SIZE(block);
+  index_remove(h, block);
   if(blocksize < bsize){
     // ---------------------------------------------------------
     // |h|                                                   |f|
@@ -444,69 +1734,652 @@ void* mm_malloc(size_t size)
     //                  blocksize
     // after splitting;
     // ---------------------------------------------------------
-    // |h|     alloc    |f|h|       split free block        |f|
+    // |H|     alloc      |h|       split free block        |f|
     // ---------------------------------------------------------
 
-    void *next_block = block + blocksize;
-    size_t next_size = bsize - blocksize;
+    void *split = block + blocksize;
+    size_t split_size = bsize - blocksize;
     
-    PUT(next_block, PACK(next_size, FREE));                           // header of next block
-    PUT(next_block + next_size - TYPE_SIZE, PACK(next_size, FREE));   // footer of next block
+    zero_clear(h, split, split + FREE_HEAD(h));                       // tags are written there
+    PUT(split, PACK(split_size, FREE | PREV_ALLOC));                  // header of next block
+    PUT(split + split_size - TYPE_SIZE, PACK(split_size, FREE));      // footer of next block
+    index_insert(h, split);                                           // split block back into free index
+  } else {
+    SET_PREV_ALLOC(block + bsize);                                    // following block now has allocated prev
+  }
+  PUT(block, PACK(blocksize, ALLOC | GET_PREV_ALLOC(block)));
+  h->stats.alloc_blocks++;
+
+  return block;
+}
+
+/// @brief allocate the free buddy block @a block (which is in the free index) and halve it until
+///        it has @a blocksize bytes. The upper halves become free blocks.
+/// @param block header of free block of at least @a blocksize bytes
+/// @param blocksize size of allocated block (power of two)
+/// @retval void* header of the allocated block
+static void* bd_place(mm_heap_t *h, void *block, size_t blocksize)
+{
+  size_t bsize = GET_SIZE(block);
+  index_remove(h, block);
+  while(bsize > blocksize){
+    bsize /= 2;
+    zero_clear(h, block + bsize, block + bsize + FREE_HEAD(h));
+    PUT(block + bsize, PACK(bsize, FREE));                            // buddy of the lower half
+    index_insert(h, block + bsize);
+  }
+  PUT(block, PACK(bsize, ALLOC));
+  h->stats.alloc_blocks++;
+
+  return block;
+}
+
+/// @brief allocate a block of @a blocksize bytes with the current allocation policy, expanding
+///        the heap if necessary. The buddy system rounds @a blocksize up to a power of two.
+/// @param blocksize block size (multiple of BS)
+/// @retval void* header of the allocated block
+/// @retval NULL if the heap cannot be expanded
+static void* alloc_block(mm_heap_t *h, size_t blocksize)
+{
+  if(check_walk > 0) check_step(h);
+  if(IS_BUDDY(h)) blocksize = BUDDY_SIZE(blocksize);
+
+  // find free block
+  void *block = GET_BLOCK(h, blocksize);
+  LOG(2, "    got free block: %p", block);
+
+  if(block == NULL){  // NULL is returned if block could not be found
+    // no free block is big enough --> need to expand heap
+    //IDEA FOR EXPANDING THE HEAP:
+    //we have sentinel at end. just expand the heap and put the new free block there
+    //in the place of unknown leftover part
+    //call coalesce on that block, merge it with two small free block there
+    //when we expand heap, need to write new footer
+    //when expand heap by increasing ds_heap_brk, make the end sentinel and stuff again
+    //do the thing done at the beginning in mm_init()
+    block = expand_heap(h, blocksize); // well implemented!!
+    if(block == NULL) return NULL;
+  }
+
+  return IS_BUDDY(h) ? bd_place(h, block, blocksize) : place(h, block, blocksize);
+}
+
+/// @brief allocate a block of @a blocksize bytes such that the position @a offset bytes into the
+///        block is a multiple of @a align. The free space in front of the block is split off as a
+///        free block.
+/// @param blocksize block size (multiple of BS)
+/// @param align alignment (power of two, multiple of BS)
+/// @param offset aligned position in the block (multiple of BS, smaller than @a align)
+/// @retval void* header of the allocated block
+/// @retval NULL if the heap cannot be expanded
+static void* alloc_aligned_block(mm_heap_t *h, size_t blocksize, size_t align, size_t offset)
+{
+  size_t size = blocksize + align - BS;                               // always contains aligned block
+
+  void *block = GET_BLOCK(h, size);
+  if(block == NULL) block = expand_heap(h, size);
+  if(block == NULL) return NULL;
+
+  void *aligned = PTR(((WORD(block) + offset + align - 1) & ~(TYPE)(align - 1)) - offset);
+  if(aligned > block){
+    size_t bsize = GET_SIZE(block);
+    size_t lead = aligned - block;
+
+    index_remove(h, block);
+    zero_clear(h, aligned - TYPE_SIZE, aligned + FREE_HEAD(h));
+    PUT(block, PACK(lead, FREE | GET_PREV_ALLOC(block)));
+    PUT(aligned - TYPE_SIZE, PACK(lead, FREE));
+    PUT(aligned, PACK(bsize - lead, FREE));
+    PUT(aligned + bsize - lead - TYPE_SIZE, PACK(bsize - lead, FREE));
+    index_insert(h, block);
+    index_insert(h, aligned);
+  }
+
+  return place(h, aligned, blocksize);
+}
+
+/// @brief free an allocated block and coalesce it with its free neighbours
+/// @param block header of allocated block
+static void free_block(mm_heap_t *h, void *block)
+{
+  if(check_walk > 0) check_step(h);
+
+  TYPE size = GET_SIZE(block);
+  h->stats.alloc_blocks--;
+  zero_clear(h, block, block + size);           // the payload may have been written
+  if(IS_BUDDY(h)){                              // no footer; the heap is not trimmed
+    PUT(block, PACK(size, FREE));
+    bd_coalesce(h, block);
+    return;
+  }
+
+  PUT(block, PACK(size, FREE | GET_PREV_ALLOC(block)));
+  PUT(block+size - TYPE_SIZE, PACK(size, FREE));
+
+  block = coalesce(h, block);                   // merges with free neighbours and links into free list
+
+  // give a large free tail back to the data segment
+  if((NEXT_BLOCK(block) == h->heap_end) && (GET_SIZE(block) > trim_threshold + h->grow_step)){
+    trim_heap(h, h->grow_step);
+  }
+}
+
+/// @brief get a new run for size class @a cls from the general heap
+/// @param cls size class
+/// @retval Slab* new run with all slots free
+/// @retval NULL if the heap cannot be expanded
+static Slab* slab_new(mm_heap_t *h, unsigned int cls)
+{
+  void *block = alloc_aligned_block(h, PAGESIZE, PAGESIZE, 0);
+  if(block == NULL) return NULL;
+  LOG(2, "    new slab run for %d-byte slots at %p", SLOT_SIZE(cls), block);
+
+  Slab *run = block;
+  run->hdr |= SLAB;
+  run->prev = run->next = NULL;
+  run->free = NULL;
+  run->cls = cls;
+  run->nslots = run->nfree = (PAGESIZE - sizeof(Slab)) / SLOT_SIZE(cls);
+  run->unused = 0;
+
+  size_t idx = PAGE_IDX(block);
+  __atomic_fetch_or(&h->slab_map[idx >> 3], 1 << (idx & 7), __ATOMIC_RELEASE);
+
+  return run;
+}
+
+/// @brief allocate a slot for a request of @a size <= SLAB_MAX bytes
+/// @param size requested size
+/// @retval void* slot
+/// @retval NULL if the heap cannot be expanded
+static void* slab_alloc(mm_heap_t *h, size_t size)
+{
+  unsigned int cls = SLAB_CLASS(size);
+  Slab *run = h->slabs[cls];
+
+  if(run == NULL){
+    run = slab_new(h, cls);
+    if(run == NULL) return NULL;
+    h->slabs[cls] = run;
+  }
+
+  void *slot = run->free;
+  if(slot != NULL) run->free = *(void**)slot;                         // reuse freed slot
+  else slot = (void*)run + sizeof(Slab) + run->unused++ * SLOT_SIZE(cls);
+
+  if(--run->nfree == 0){                                              // run is full
+    h->slabs[cls] = run->next;
+    if(run->next != NULL) run->next->prev = NULL;
+  }
+
+  GRANT(h, size, SLOT_SIZE(cls));
+  return slot;
+}
+
+/// @brief free a slot. Empty runs are returned to the general heap.
+/// @param slot slot
+static void slab_free(mm_heap_t *h, void *slot)
+{
+  Slab *run = PAGE_OF(slot);
+  unsigned int cls = run->cls;
+
+  *(void**)slot = run->free;
+  run->free = slot;
+
+  if(run->nfree++ == 0){                                              // run was full
+    run->prev = NULL;
+    run->next = h->slabs[cls];
+    if(run->next != NULL) run->next->prev = run;
+    h->slabs[cls] = run;
+  }
+
+  if((run->nfree == run->nslots) && ((run->prev != NULL) || (run->next != NULL))){
+    LOG(2, "    releasing empty slab run %p", run);
+    if(run->prev != NULL) run->prev->next = run->next;
+    else h->slabs[cls] = run->next;
+    if(run->next != NULL) run->next->prev = run->prev;
+
+    size_t idx = PAGE_IDX(run);
+    __atomic_fetch_and(&h->slab_map[idx >> 3], ~(1 << (idx & 7)), __ATOMIC_RELEASE);
+    run->hdr &= ~SLAB;
+    free_block(h, run);
   }
-  PUT(block, PACK(blocksize, ALLOC));
-  PUT(block + blocksize - TYPE_SIZE, PACK(blocksize, ALLOC));
+}
+
+/// @brief allocate a block in a separate mapped region
+/// @param size requested size in bytes
+/// @retval pointer to payload on success
+/// @retval NULL if the region cannot be mapped
+static void* map_alloc(mm_heap_t *h, size_t size)
+{
+  void *block = ds_seg_mmap(h->ds, TYPE_SIZE + size);
+  if(block == (void*)-1) return NULL;
+
+  size_t blocksize = MAP_BLOCKSIZE(size);
+  LOG(2, "    mapped block %p, size %lx", block, blocksize);
+  PUT(block, PACK(blocksize, ALLOC | MAPPED));
+  GRANT(h, size, blocksize);
+
+  return block + TYPE_SIZE;
+}
+
+/// @brief resize a mapped block. The block may move.
+/// @param block header of the mapped block
+/// @param size requested size in bytes
+/// @retval pointer to payload on success
+/// @retval NULL if the region cannot be resized
+static void* map_realloc(mm_heap_t *h, void *block, size_t size)
+{
+  block = ds_seg_mremap(h->ds, block, TYPE_SIZE + size);
+  if(block == (void*)-1) return NULL;
+
+  size_t blocksize = MAP_BLOCKSIZE(size);
+  LOG(2, "    remapped block %p, size %lx", block, blocksize);
+  PUT(block, PACK(blocksize, ALLOC | MAPPED));
+  GRANT(h, size, blocksize);
+
+  return block + TYPE_SIZE;
+}
+
+/// @brief mm_heap_malloc() without locking and thread cache
+static void* heap_malloc(mm_heap_t *h, size_t size)
+{
+  LOG(1, "mm_malloc(0x%lx) (%lu in decimal)", size, size);
+
+  assert(h->initialized);
+  remote_drain(h);                                                // blocks freed by other threads
   
+  //figure out how big the needed block is
+  //internally, 32 block size, align, put header and footer at end
+  
+  if((size <= SLAB_MAX) && !IS_BUDDY(h)) return slab_alloc(h, size); // small requests are served by the slabs
+  if(size > mmap_threshold) return map_alloc(h, size);            // large requests get their own region
+
+  // compute the block size
+  size_t blocksize = ROUND_UP(TYPE_SIZE + size);              // round up the size that needs to be allocated
+  LOG(1, "  blocksize:      %lx (%lu)", blocksize, blocksize);
+
+  void *block = alloc_block(h, blocksize);
+  if(block == NULL) return NULL;
+
+  GRANT(h, size, GET_SIZE(block));
   return block + TYPE_SIZE;                                           // returning the block to payload
 }
 
-void* mm_calloc(size_t nmemb, size_t size)
+/// @brief mm_heap_calloc() without locking and thread cache
+static void* heap_calloc(mm_heap_t *h, size_t nmemb, size_t size)
 {
   LOG(1, "mm_calloc(0x%lx, 0x%lx)", nmemb, size);
 
-  assert(mm_initialized);
+  assert(h->initialized);
 
   //
-  // calloc is simply malloc() followed by memset()
+  // calloc is malloc() followed by memset(). Slots are reused without tracking, mapped regions are
+  // fresh and thus zero, and heap blocks skip the pages that are known to be zero.
   //
-  void *payload = mm_malloc(nmemb * size);
+  size_t bytes = nmemb * size;
+  void *payload = heap_malloc(h, bytes);
+  if (payload == NULL) return NULL;
 
-  if (payload != NULL) memset(payload, 0, nmemb * size);
+  if (IS_SLOT(payload)) memset(payload, 0, bytes);
+  else if (!(GET(payload - TYPE_SIZE) & MAPPED)) zero_fill(h, payload, bytes);
 
   return payload;
 }
 
-void* mm_realloc(void *ptr, size_t size)
+/// @brief mm_heap_memalign() without locking and thread cache
+static void* heap_memalign(mm_heap_t *h, size_t align, size_t size)
+{
+  LOG(1, "mm_memalign(0x%lx, 0x%lx)", align, size);
+
+  assert(h->initialized);
+
+  if((align == 0) || (align & (align - 1))) return NULL;              // not a power of two
+
+  if(align <= TYPE_SIZE) return heap_malloc(h, size);                 // every payload is 8-byte aligned
+
+  remote_drain(h);
+  if((align <= SLAB_ALIGN) && (size <= SLAB_MAX) && !IS_BUDDY(h)) return slab_alloc(h, size); // slots are 16-byte aligned
+
+  // the payload is moved from TYPE_SIZE to BS bytes into a block that is placed such that the
+  // payload is aligned. The word in front of the payload is tagged so that free and realloc find
+  // the block header. Aligned blocks always live in the heap, even above the mmap threshold.
+  align = MAX(align, BS);
+  size_t blocksize = ROUND_UP(BS + MAX(size, 1));                     // payload must lie in the block
+  LOG(1, "  blocksize:      %lx (%lu)", blocksize, blocksize);
+
+  void *block;
+  if(IS_BUDDY(h)){
+    // BS bytes into a buddy block of at least align bytes is aligned up to the page size
+    if(align > (size_t)PAGESIZE) return NULL;
+    block = alloc_block(h, MAX(blocksize, align));
+  } else {
+    block = alloc_aligned_block(h, blocksize, align, BS);
+  }
+  if(block == NULL) return NULL;
+
+  GRANT(h, size, GET_SIZE(block));
+  PUT(block + BS - TYPE_SIZE, ALIGN_TAG);
+  return block + BS;
+}
+
+/// @brief mm_heap_realloc() of a buddy block: halve the block in place, grow it in place by
+///        absorbing its free upper buddies, or move it
+/// @param block header of an allocated buddy block
+/// @param size new size of the payload (not 0)
+static void* bd_realloc(mm_heap_t *h, void *block, size_t size)
+{
+  void *ptr = block + TYPE_SIZE;
+  size_t bsize = GET_SIZE(block);
+  size_t blocksize = BUDDY_SIZE(ROUND_UP(TYPE_SIZE + size));
+  LOG(1, "  blocksize:      %lx (%lu) -> %lx (%lu)", bsize, bsize, blocksize, blocksize);
+
+  if(blocksize > bsize){
+    // the block must be the lower buddy of every order up to the new size, the upper buddies free
+    size_t s;
+    for(s = bsize; s < blocksize; s *= 2){
+      void *buddy = BUDDY(h, block, s);
+      if((buddy < block) || (buddy + s > h->heap_end) || (GET(buddy) != PACK(s, FREE))) break;
+    }
+
+    if(s >= blocksize){
+      LOG(2, "    growing in place");
+      for(s = bsize; s < blocksize; s *= 2) index_remove(h, block + s);
+      bsize = blocksize;
+      PUT(block, PACK(bsize, ALLOC));
+      CHECK_MERGE(h, block, block + bsize);
+    }
+  }
+
+  if(blocksize <= bsize){
+    // shrink in place: the upper halves cannot merge, their buddies are allocated
+    zero_clear(h, block + blocksize, block + bsize);
+    while(bsize > blocksize){
+      bsize /= 2;
+      PUT(block + bsize, PACK(bsize, FREE));
+      index_insert(h, block + bsize);
+    }
+    PUT(block, PACK(bsize, ALLOC));
+    GRANT(h, size, bsize);
+    return ptr;
+  }
+
+  // cannot resize in place: move the payload to a new block
+  LOG(2, "    moving block");
+  void *payload = heap_malloc(h, size);
+  if(payload == NULL) return NULL;
+
+  memcpy(payload, ptr, bsize - TYPE_SIZE);                            // old payload is smaller
+  heap_free(h, ptr);
+
+  return payload;
+}
+
+/// @brief mm_heap_realloc() without locking
+static void* heap_realloc(mm_heap_t *h, void *ptr, size_t size)
 {
   LOG(1, "mm_realloc(%p, 0x%lx)", ptr, size);
 
-  assert(mm_initialized);
+  assert(h->initialized);
 
-  //
-  // TODO (optional)
-  //
+  if(ptr == NULL) return heap_malloc(h, size);                     // realloc(NULL, size) == malloc
+  if(size == 0){                                                      // realloc(ptr, 0) == free
+    heap_free(h, ptr);
+    return NULL;
+  }
 
-  return NULL;
+  if(!IS_SLOT(ptr) && IS_ALIGNED_PAYLOAD(ptr)){                       // the result need not be aligned
+    size_t old_size = GET_SIZE(ptr - BS) - BS;
+    void *payload = heap_malloc(h, size);
+    if(payload == NULL) return NULL;
+    memcpy(payload, ptr, MIN(size, old_size));
+    heap_free(h, ptr);
+    return payload;
+  }
+
+  if(IS_SLOT(ptr)){                                                   // slots fit requests up to their size
+    size_t slot_size = SLOT_SIZE(((Slab*)PAGE_OF(ptr))->cls);
+    if(size <= slot_size){
+      GRANT(h, size, slot_size);
+      return ptr;
+    }
+
+    void *payload = heap_malloc(h, size);
+    if(payload == NULL) return NULL;
+    memcpy(payload, ptr, slot_size);
+    slab_free(h, ptr);
+    return payload;
+  }
+
+  void *block = ptr - TYPE_SIZE;                                      // header of given block
+  if(GET_ALLOC(block) != ALLOC){
+    LOG(1, "    WARNING: realloc of free block");
+    return NULL;
+  }
+
+  if(GET(block) & MAPPED){                                            // mapped blocks are remapped while
+    if(size > mmap_threshold) return map_realloc(h, block, size);     // they stay above the threshold
+
+    void *payload = heap_malloc(h, size);
+    if(payload == NULL) return NULL;
+    memcpy(payload, ptr, size);                                       // new size is below the threshold
+    ds_seg_munmap(h->ds, block);
+    return payload;
+  }
+
+  if(IS_BUDDY(h)) return bd_realloc(h, block, size);
+
+  size_t bsize = GET_SIZE(block);
+  size_t blocksize = ROUND_UP(TYPE_SIZE + size);
+  LOG(1, "  blocksize:      %lx (%lu) -> %lx (%lu)", bsize, bsize, blocksize, blocksize);
+
+  if(blocksize > bsize){
+    void *next = NEXT_BLOCK(block);
+
+    // the block (or the free block following it) borders the end of the heap: grow the heap so
+    // that the following free block is large enough
+    if((next == h->heap_end) ||
+       ((GET_ALLOC(next) == FREE) && (NEXT_BLOCK(next) == h->heap_end) &&
+        (bsize + GET_SIZE(next) < blocksize))){
+      LOG(2, "    extending heap");
+      if(expand_heap(h, blocksize - bsize) == NULL) return NULL;
+      next = NEXT_BLOCK(block);
+    }
+
+    // grow in place by absorbing the following free block
+    if((GET_ALLOC(next) == FREE) && (bsize + GET_SIZE(next) >= blocksize)){
+      LOG(2, "    growing in place");
+      index_remove(h, next);
+      bsize += GET_SIZE(next);
+      PUT(block, PACK(bsize, ALLOC | GET_PREV_ALLOC(block)));
+      SET_PREV_ALLOC(block + bsize);
+      CHECK_MERGE(h, block, block + bsize);
+    }
+  }
+
+  if(blocksize <= bsize){
+    // shrink in place: split off the tail and return it to the free index
+    if(bsize - blocksize >= BS){
+      LOG(2, "    splitting off %lx bytes", bsize - blocksize);
+      void *tail = block + blocksize;
+      size_t tail_size = bsize - blocksize;
+
+      zero_clear(h, tail, tail + tail_size);                          // the payload may have been written
+      PUT(block, PACK(blocksize, ALLOC | GET_PREV_ALLOC(block)));
+      PUT(tail, PACK(tail_size, FREE | PREV_ALLOC));
+      PUT(tail + tail_size - TYPE_SIZE, PACK(tail_size, FREE));
+      coalesce(h, tail);                                              // tail may border a free block
+      bsize = blocksize;
+    }
+    GRANT(h, size, bsize);
+    return ptr;
+  }
+
+  // cannot resize in place: move the payload to a new block
+  LOG(2, "    moving block");
+  void *payload = heap_malloc(h, size);
+  if(payload == NULL) return NULL;
+
+  memcpy(payload, ptr, bsize - TYPE_SIZE);                            // old payload is smaller
+  heap_free(h, ptr);
+
+  return payload;
 }
 
-void mm_free(void *ptr)
+/// @brief mm_heap_free() without locking and thread cache
+static void heap_free(mm_heap_t *h, void *ptr)
 {
   LOG(1, "mm_free(%p)", ptr);
 
-  assert(mm_initialized);
+  assert(h->initialized);
+
+  if(ptr == NULL) return;
+
+  if(IS_SLOT(ptr)){                             // small block served by the slabs
+    slab_free(h, ptr);
+    return;
+  }
+  if(IS_ALIGNED_PAYLOAD(ptr)) ptr = ALIGNED_PAYLOAD(ptr);
 
   void *block = ptr - TYPE_SIZE;                // header of given block
-  if(GET_STATUS(block) != ALLOC) {              // if the block is already free
+  if(check_level && (check_header(h, block) != 0)) return; // corrupt blocks are not freed
+  if(GET_ALLOC(block) != ALLOC) {               // if the block is already free
     LOG(1, "    WARNING: double-free detected");
+    check_error(h, he_Free, block, GET(block));
     return;
   }
 
-  //mark as free
-  TYPE size = GET_SIZE(block);
-  PUT(block, PACK(size, FREE));
-  PUT(block+size - TYPE_SIZE, PACK(size, FREE));
+  if(GET(block) & MAPPED) {                     // large block in its own region
+    if(ds_seg_munmap(h->ds, block) != 0) LOG(1, "    WARNING: cannot unmap block");
+    return;
+  }
+
+  free_block(h, block);
+}
+
+/// @brief sort pointers by address (Shell sort; runs in place and does not allocate)
+/// @param ptrs pointers
+/// @param n number of pointers
+static void sort_ptrs(void **ptrs, size_t n)
+{
+  size_t gap = 1;
+  while(gap < n / 3) gap = 3*gap + 1;
+
+  for(; gap > 0; gap /= 3){
+    for(size_t i = gap; i < n; i++){
+      void *p = ptrs[i];
+      size_t j = i;
+      for(; (j >= gap) && (ptrs[j - gap] > p); j -= gap) ptrs[j] = ptrs[j - gap];
+      ptrs[j] = p;
+    }
+  }
+}
+
+/// @brief mm_heap_malloc_batch() without locking
+static size_t heap_malloc_batch(mm_heap_t *h, size_t size, size_t n, void **out)
+{
+  LOG(1, "mm_malloc_batch(0x%lx, %lu)", size, n);
+
+  assert(h->initialized);
+  remote_drain(h);
+
+  size_t done = 0;
+  if((size <= SLAB_MAX) || (size > mmap_threshold) || IS_BUDDY(h)){   // slots, regions and buddy
+    void* (*alloc)(mm_heap_t*, size_t) = IS_BUDDY(h) ? heap_malloc :   // blocks one by one
+                                         size <= SLAB_MAX ? slab_alloc : map_alloc;
+    while((done < n) && ((out[done] = alloc(h, size)) != NULL)) done++;
+    return done;
+  }
+
+  size_t blocksize = ROUND_UP(TYPE_SIZE + size);
+  while(done < n){
+    // a free block for the whole remainder, else any block that fits one, else grow the heap for
+    // the remainder or, near the end of the data segment, for one block
+    size_t want = (n - done) <= (size_t)-1 / blocksize ? (n - done) * blocksize : blocksize;
+    void *block = GET_BLOCK(h, want);
+    if(block == NULL) block = GET_BLOCK(h, blocksize);
+    if(block == NULL) block = expand_heap(h, want);
+    if((block == NULL) && (want > blocksize)) block = expand_heap(h, blocksize);
+    if(block == NULL) break;
+
+    // carve consecutive blocks from the front; the remainder is linked back as one free block
+    size_t bsize = GET_SIZE(block);
+    TYPE prev_alloc = GET_PREV_ALLOC(block);
+    index_remove(h, block);
+    while((done < n) && (bsize >= blocksize)){
+      PUT(block, PACK(blocksize, ALLOC | prev_alloc));
+      GRANT(h, size, blocksize);
+      h->stats.alloc_blocks++;
+      out[done++] = block + TYPE_SIZE;
+      block += blocksize;
+      bsize -= blocksize;
+      prev_alloc = PREV_ALLOC;
+    }
+
+    if(bsize > 0){
+      zero_clear(h, block, block + FREE_HEAD(h));
+      PUT(block, PACK(bsize, FREE | PREV_ALLOC));
+      PUT(block + bsize - TYPE_SIZE, PACK(bsize, FREE));
+      index_insert(h, block);
+    } else {
+      SET_PREV_ALLOC(block);
+    }
+  }
+
+  return done;
+}
 
-  //need to implement coalsescin
-  void *free_hdr = coalesce(block);
+/// @brief mm_heap_free_batch() without locking and remote frees. Adjacent blocks are merged into
+///        one allocated block first so that the free index is updated once per run of blocks.
+static void heap_free_batch(mm_heap_t *h, void **ptrs, size_t n)
+{
+  LOG(1, "mm_free_batch(%p, %lu)", ptrs, n);
+
+  assert(h->initialized);
+
+  if(IS_BUDDY(h)){                                                    // buddy blocks do not form runs
+    for(size_t i = 0; i < n; i++) heap_free(h, ptrs[i]);
+    return;
+  }
+
+  sort_ptrs(ptrs, n);
+
+  void *first = NULL;                                                 // current run of blocks
+  void *end = NULL;
+  for(size_t i = 0; i <= n; i++){
+    void *block = NULL;
+    if(i < n){
+      if(ptrs[i] == NULL) continue;
+      if((i > 0) && (ptrs[i] == ptrs[i-1])){
+        LOG(1, "    WARNING: double-free detected");
+        check_error(h, he_Free, ptrs[i] - TYPE_SIZE, GET(ptrs[i] - TYPE_SIZE));
+        continue;
+      }
+
+      // slots, mapped and free blocks are left to heap_free
+      void *ptr = ptrs[i];
+      if(!IS_SLOT(ptr)){
+        if(IS_ALIGNED_PAYLOAD(ptr)) ptr = ALIGNED_PAYLOAD(ptr);
+        block = ptr - TYPE_SIZE;
+        if((GET(block) & (ALLOC | MAPPED)) != ALLOC) block = NULL;
+        else if(check_level && (check_header(h, block) != 0)) continue; // corrupt blocks are not freed
+      }
+      if((block != NULL) && (block == end)){                          // extends the run
+        end += GET_SIZE(block);
+        h->stats.alloc_blocks--;                                      // merged into the run
+        continue;
+      }
+    }
+
+    if(first != NULL){
+      CHECK_MERGE(h, first, end);
+      PUT(first, PACK(end - first, ALLOC | GET_PREV_ALLOC(first)));
+      free_block(h, first);
+    }
+    first = block;
+    end = block != NULL ? block + GET_SIZE(block) : NULL;
+    if((i < n) && (block == NULL)) heap_free(h, ptrs[i]);
+  }
 }
 
 
@@ -516,52 +2389,1299 @@ void mm_setloglevel(int level)
 }
 
 
-void mm_check(void)
+void mm_setmmapthreshold(size_t size)
+{
+  mmap_threshold = size < SLAB_MAX ? SLAB_MAX : size;
+}
+
+
+void mm_settrimthreshold(size_t size)
 {
-  assert(mm_initialized);
+  trim_threshold = size;
+}
 
-  void *p;
 
-  printf("\n----------------------------------------- mm_check ----------------------------------------------\n");
-  printf("  ds_heap_start:          %p\n", ds_heap_start);
-  printf("  ds_heap_brk:            %p\n", ds_heap_brk);
-  printf("  heap_start:             %p\n", heap_start);
-  printf("  heap_end:               %p\n", heap_end);
-  printf("\n");
-  p = PREV_PTR(heap_start);
-  printf("  initial sentinel:       %p: size: %6lx, status: %lx\n", p, GET_SIZE(p), GET_STATUS(p));
-  p = heap_end;
-  printf("  end sentinel:           %p: size: %6lx, status: %lx\n", p, GET_SIZE(p), GET_STATUS(p));
-  printf("\n");
-  printf("  blocks:\n");
+void mm_setgrowth(size_t min, size_t max)
+{
+  growth_min = MAX(min, (size_t)CHUNKSIZE);
+  growth_max = MAX(max, growth_min);
+}
 
-  long errors = 0;
-  p = heap_start;
-  while (p < heap_end) {
-    TYPE hdr = GET(p);
-    TYPE size = SIZE(hdr);
-    TYPE status = STATUS(hdr);
-    printf("    %p: size: %6lx, status: %lx\n", p, size, status);
 
-    void *fp = p + size - TYPE_SIZE;
-    TYPE ftr = GET(fp);
-    TYPE fsize = SIZE(ftr);
-    TYPE fstatus = STATUS(ftr);
+void mm_setcheck(int enable, unsigned int walk)
+{
+  check_level = enable != 0;
+  check_walk = walk;
+}
+
 
-    if ((size != fsize) || (status != fstatus)) {
-      errors++;
-      printf("    --> ERROR: footer at %p with different properties: size: %lx, status: %lx\n", 
-             fp, fsize, fstatus);
+void mm_settrace(struct mm_event *buf, size_t n)
+{
+  if((buf == NULL) || (n == 0)){
+    __atomic_store_n(&trace_buf, NULL, __ATOMIC_RELEASE);
+    return;
+  }
+
+  unsigned long size = TRACE_CHUNK;
+  while(2*size <= n) size *= 2;
+  if(size > n) PANIC("trace buffer must hold at least %d events.", TRACE_CHUNK);
+
+  // zero timestamps mark empty slots; clearing the buffer also maps its pages in advance
+  memset(buf, 0, size * sizeof(*buf));
+  trace_mask = size - 1;
+  trace_next = 0;
+  trace_gen++;
+  clock_gettime(CLOCK_MONOTONIC, &trace_start_ts);
+  trace_start = trace_clock();
+  __atomic_store_n(&trace_buf, buf, __ATOMIC_RELEASE);
+}
+
+
+/// @brief write all of a buffer to a file
+/// @retval 0 on success
+/// @retval -1 on error
+static int write_all(int fd, const void *buf, size_t size)
+{
+  while(size > 0){
+    ssize_t res = write(fd, buf, size);
+    if(res < 0) return -1;
+    buf += res;
+    size -= res;
+  }
+  return 0;
+}
+
+long mm_trace_dump(int fd)
+{
+  struct mm_event *buf = trace_buf;
+  if(buf == NULL) return -1;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  unsigned long ticks = trace_clock() - trace_start;
+
+  // the ring holds the last trace_mask+1 claimed slots; older ones were overwritten. The slots
+  // are in the order they were claimed, the events of different threads are not sorted by time.
+  unsigned long total = trace_next;
+  unsigned long n = MIN(total, trace_mask + 1);
+  unsigned long first = total - n;
+
+  unsigned long events = 0;
+  for(unsigned long i = first; i < total; i++) events += buf[i & trace_mask].time != 0;
+
+  struct mm_trace_header hdr = {
+    .events = events,
+    .lost   = total - n,
+    .start  = trace_start,
+    .ticks  = ticks,
+    .nsec   = (now.tv_sec - trace_start_ts.tv_sec) * 1000000000UL
+              + now.tv_nsec - trace_start_ts.tv_nsec,
+  };
+  memcpy(hdr.magic, MM_TRACE_MAGIC, sizeof(hdr.magic));
+
+  if(write_all(fd, &hdr, sizeof(hdr)) != 0) return -1;
+
+  // write the runs of filled slots. A run ends at an empty slot and at the end of the ring.
+  unsigned long run = 0;                                          // filled slots before slot i
+  for(unsigned long i = first; i <= total; i++){
+    int filled = (i < total) && (buf[i & trace_mask].time != 0);
+    if((run > 0) && (!filled || ((i & trace_mask) == 0))){
+      if(write_all(fd, &buf[(i - run) & trace_mask], run * sizeof(*buf)) != 0) return -1;
+      run = 0;
     }
+    run += filled;
+  }
 
-    p = p + size;
-    if (size == 0) {
-      printf("    WARNING: size 0 detected, aborting traversal.\n");
-      break;
+  return events;
+}
+
+
+/// @brief mm_heap_trim() without locking
+static size_t heap_trim(mm_heap_t *h)
+{
+  LOG(1, "mm_trim()");
+
+  assert(h->initialized);
+  remote_drain(h);
+
+  size_t released = trim_heap(h, BS);
+
+  // release the interior pages of the remaining free blocks. The first words hold the header and
+  // the free index links (up to a tree node), the last word the footer. Discarded pages read as
+  // zero.
+  for(void *block = h->heap_start; block < h->heap_end; block = NEXT_BLOCK(block)){
+    if(GET_ALLOC(block) == FREE){
+      void *from = PAGE_OF(block + FREE_HEAD(h) + PAGESIZE - 1);
+      void *to   = PAGE_OF(block + GET_SIZE(block) - FREE_TAIL(h));
+      if((from < to) && (ds_seg_discard(h->ds, from, to - from) == 0)){
+        released += to - from;
+        zero_mark(h, from, to);
+      }
     }
   }
 
-  printf("\n");
-  if ((p == heap_end) && (errors == 0)) printf("  Block structure coherent.\n");
-  printf("-------------------------------------------------------------------------------------------------\n");
+  LOG(1, "  released %lx bytes", released);
+  return released;
+}
+
+
+/// @brief find the size of the largest free block. Best fit, segregated fit and the buddy system
+///        look it up in their index; first and next fit walk the free list (but not the heap).
+/// @retval size of the largest free block
+/// @retval 0 if there are no free blocks
+static size_t largest_free(mm_heap_t *h)
+{
+  size_t largest = 0;
+  void *block;
+
+  switch(h->policy){
+    case ap_BestFit:                                                  // rightmost tree node
+      for(block = h->rb_root; block != RB_NIL; block = RB_RIGHT(block)) largest = GET_SIZE(block);
+      if((largest == 0) && (h->small_list != NULL)) largest = BS;
+      break;
+
+    case ap_SegregatedFit:                                            // highest non-empty bin
+      if(h->fl_bitmap != 0){
+        int fl = FLS(h->fl_bitmap);
+        block = h->bins[fl][FLS(h->sl_bitmap[fl])];
+        for(; block != NULL; block = NEXT_FREE(block)) largest = MAX(largest, GET_SIZE(block));
+      }
+      break;
+
+    case ap_Buddy:                                                    // highest non-empty order
+      if(h->order_map != 0) largest = (size_t)BS << FLS(h->order_map);
+      break;
+
+    default:
+      for(block = h->free_list; block != NULL; block = NEXT_FREE(block)){
+        largest = MAX(largest, GET_SIZE(block));
+      }
+  }
+
+  return largest;
+}
+
+/// @brief mm_heap_stats() without locking
+static void heap_stats(mm_heap_t *h, struct mm_stats *st)
+{
+  assert(h->initialized);
+
+  *st = h->stats;
+  st->heap_size = h->heap_end - h->heap_start;
+  st->alloc_bytes = st->heap_size - st->free_bytes;
+  st->largest_free = largest_free(h);
+  st->external_frag = st->free_bytes > 0 ? 1.0 - (double)st->largest_free / st->free_bytes : 0.0;
+  st->internal_frag = st->granted > 0 ? 1.0 - (double)st->requested / st->granted : 0.0;
+  ds_seg_map_stat(h->ds, &st->mapped_blocks, &st->mapped_bytes);
+}
+
+
+/// @brief dump and check the free list (sorted by address for first fit)
+/// @param nfree number of free blocks found in the heap
+/// @retval number of errors found
+static long check_free_list(mm_heap_t *h, long nfree)
+{
+  long errors = 0;
+
+  printf("  free list:\n");
+
+  void *prev = NULL;
+  long nlist = 0;
+  void *fb = h->free_list;
+  while ((fb != NULL) && (nlist <= nfree)) {
+    printf("    %p: size: %6lx\n", fb, GET_SIZE(fb));
+    nlist++;
+
+    if ((fb < h->heap_start) || (fb >= h->heap_end) || (GET_ALLOC(fb) != FREE)) {
+      errors++;
+      printf("    --> ERROR: %p is not a free block in the heap\n", fb);
+      break;
+    }
+    if (PREV_FREE(fb) != prev) {
+      errors++;
+      printf("    --> ERROR: prev link %p does not match predecessor %p\n", PREV_FREE(fb), prev);
+    }
+    if ((h->policy == ap_FirstFit) && (prev != NULL) && (prev >= fb)) {
+      errors++;
+      printf("    --> ERROR: free list not sorted by address\n");
+    }
+    if (GET_ALLOC(NEXT_BLOCK(fb)) == FREE) {
+      errors++;
+      printf("    --> ERROR: adjacent free blocks not coalesced\n");
+    }
+
+    prev = fb;
+    fb = NEXT_FREE(fb);
+  }
+
+  if (nlist != nfree) {
+    errors++;
+    printf("    --> ERROR: free list holds %ld blocks, heap contains %ld free blocks\n",
+           nlist, nfree);
+  }
+
+  return errors;
+}
+
+/// @brief dump and check the TLSF bins and bitmaps
+/// @param nfree number of free blocks found in the heap
+/// @retval number of errors found
+static long check_bins(mm_heap_t *h, long nfree)
+{
+  long errors = 0;
+  long nlist = 0;
+
+  printf("  bins:\n");
+  for (int fl = 0; fl < FL_COUNT; fl++) {
+    if (((h->fl_bitmap >> fl) & 1) != (h->sl_bitmap[fl] != 0)) {
+      errors++;
+      printf("    --> ERROR: first-level bitmap inconsistent for class %d\n", fl);
+    }
+
+    for (int sl = 0; sl < SL_COUNT; sl++) {
+      if (((h->sl_bitmap[fl] >> sl) & 1) != (h->bins[fl][sl] != NULL)) {
+        errors++;
+        printf("    --> ERROR: second-level bitmap inconsistent for bin (%d, %d)\n", fl, sl);
+      }
+
+      void *prev = NULL;
+      void *fb = h->bins[fl][sl];
+      while ((fb != NULL) && (nlist <= nfree)) {
+        int bfl, bsl;
+        printf("    (%2d, %2d) %p: size: %6lx\n", fl, sl, fb, GET_SIZE(fb));
+        nlist++;
+
+        if ((fb < h->heap_start) || (fb >= h->heap_end) || (GET_ALLOC(fb) != FREE)) {
+          errors++;
+          printf("    --> ERROR: %p is not a free block in the heap\n", fb);
+          break;
+        }
+        seg_mapping(GET_SIZE(fb), &bfl, &bsl);
+        if ((bfl != fl) || (bsl != sl)) {
+          errors++;
+          printf("    --> ERROR: block belongs to bin (%d, %d)\n", bfl, bsl);
+        }
+        if (PREV_FREE(fb) != prev) {
+          errors++;
+          printf("    --> ERROR: prev link %p does not match predecessor %p\n", PREV_FREE(fb), prev);
+        }
+
+        prev = fb;
+        fb = NEXT_FREE(fb);
+      }
+    }
+  }
+
+  if (nlist != nfree) {
+    errors++;
+    printf("    --> ERROR: bins hold %ld blocks, heap contains %ld free blocks\n", nlist, nfree);
+  }
+
+  return errors;
+}
+
+/// @brief dump and check the free lists of the buddy orders and their bitmap
+/// @param nfree number of free blocks found in the heap
+/// @retval number of errors found
+static long check_orders(mm_heap_t *h, long nfree)
+{
+  long errors = 0;
+  long nlist = 0;
+
+  printf("  orders:\n");
+  for (int order = 0; order < BUDDY_ORDERS; order++) {
+    if (((h->order_map >> order) & 1) != (h->orders[order] != NULL)) {
+      errors++;
+      printf("    --> ERROR: bitmap inconsistent for order %d\n", order);
+    }
+
+    void *prev = NULL;
+    void *fb = h->orders[order];
+    while ((fb != NULL) && (nlist <= nfree)) {
+      size_t size = GET_SIZE(fb);
+      printf("    (%2d) %p: size: %6lx\n", order, fb, size);
+      nlist++;
+
+      if ((fb < h->heap_start) || (fb >= h->heap_end) || (GET_ALLOC(fb) != FREE)) {
+        errors++;
+        printf("    --> ERROR: %p is not a free block in the heap\n", fb);
+        break;
+      }
+      if (size != (size_t)BS << order) {
+        errors++;
+        printf("    --> ERROR: block belongs to order %d\n", BUDDY_ORDER(size));
+      }
+      if (PREV_FREE(fb) != prev) {
+        errors++;
+        printf("    --> ERROR: prev link %p does not match predecessor %p\n", PREV_FREE(fb), prev);
+      }
+      void *buddy = BUDDY(h, fb, size);
+      if ((buddy + size <= h->heap_end) && (GET(buddy) == GET(fb))) {
+        errors++;
+        printf("    --> ERROR: free buddies not merged\n");
+      }
+
+      prev = fb;
+      fb = NEXT_FREE(fb);
+    }
+  }
+
+  if (nlist != nfree) {
+    errors++;
+    printf("    --> ERROR: orders hold %ld blocks, heap contains %ld free blocks\n", nlist, nfree);
+  }
+
+  return errors;
+}
+
+/// @brief check the best-fit subtree rooted at @a node
+/// @param node root of subtree
+/// @param[in/out] prev previous node in in-order traversal
+/// @param[in/out] count number of visited nodes
+/// @param[in/out] errors number of errors
+/// @retval black height of the subtree
+static int check_subtree(mm_heap_t *h, void *node, void **prev, long *count, long *errors)
+{
+  if (node == RB_NIL) return 1;
+
+  if ((node < h->heap_start) || (node >= h->heap_end) || (GET_ALLOC(node) != FREE) ||
+      (GET_SIZE(node) <= BS)) {
+    (*errors)++;
+    printf("    --> ERROR: %p is not a free block in the heap\n", node);
+    return 0;
+  }
+
+  int lh = check_subtree(h, RB_LEFT(node), prev, count, errors);
+
+  printf("    %p: size: %6lx, %s\n", node, GET_SIZE(node), RB_COLOR(node) == RED ? "red" : "black");
+  (*count)++;
+  if ((*prev != NULL) && !rb_less(*prev, node)) {
+    (*errors)++;
+    printf("    --> ERROR: tree not ordered by size and address\n");
+  }
+  *prev = node;
+
+  int rh = check_subtree(h, RB_RIGHT(node), prev, count, errors);
+
+  if (((RB_LEFT(node) != RB_NIL) && (RB_PARENT(RB_LEFT(node)) != node)) ||
+      ((RB_RIGHT(node) != RB_NIL) && (RB_PARENT(RB_RIGHT(node)) != node))) {
+    (*errors)++;
+    printf("    --> ERROR: parent link of child of %p broken\n", node);
+  }
+  if ((RB_COLOR(node) == RED) &&
+      ((RB_COLOR(RB_LEFT(node)) == RED) || (RB_COLOR(RB_RIGHT(node)) == RED))) {
+    (*errors)++;
+    printf("    --> ERROR: red node %p has a red child\n", node);
+  }
+  if (lh != rh) {
+    (*errors)++;
+    printf("    --> ERROR: black heights %d/%d differ at %p\n", lh, rh, node);
+  }
+
+  return lh + (RB_COLOR(node) == BLACK);
+}
+
+/// @brief dump and check the best-fit tree and the list of minimal free blocks
+/// @param nfree number of free blocks found in the heap
+/// @retval number of errors found
+static long check_tree(mm_heap_t *h, long nfree)
+{
+  long errors = 0;
+  long nlist = 0;
+  void *prev = NULL;
+
+  printf("  free tree:\n");
+  if ((h->rb_root != RB_NIL) && ((RB_PARENT(h->rb_root) != RB_NIL) || (RB_COLOR(h->rb_root) != BLACK))) {
+    errors++;
+    printf("    --> ERROR: invalid root %p\n", h->rb_root);
+  }
+  check_subtree(h, h->rb_root, &prev, &nlist, &errors);
+
+  printf("  minimal free blocks:\n");
+  prev = NULL;
+  void *fb = h->small_list;
+  while ((fb != NULL) && (nlist <= nfree)) {
+    printf("    %p: size: %6lx\n", fb, GET_SIZE(fb));
+    nlist++;
+
+    if ((fb < h->heap_start) || (fb >= h->heap_end) || (GET_ALLOC(fb) != FREE) || (GET_SIZE(fb) != BS)) {
+      errors++;
+      printf("    --> ERROR: %p is not a minimal free block in the heap\n", fb);
+      break;
+    }
+    if (PREV_FREE(fb) != prev) {
+      errors++;
+      printf("    --> ERROR: prev link %p does not match predecessor %p\n", PREV_FREE(fb), prev);
+    }
+
+    prev = fb;
+    fb = NEXT_FREE(fb);
+  }
+
+  if (nlist != nfree) {
+    errors++;
+    printf("    --> ERROR: tree and list hold %ld blocks, heap contains %ld free blocks\n",
+           nlist, nfree);
+  }
+
+  return errors;
+}
+
+
+/// @brief mm_heap_check() without locking
+static void heap_check(mm_heap_t *h)
+{
+  assert(h->initialized);
+  remote_drain(h);
+
+  void *p;
+
+  printf("\n----------------------------------------- mm_check ----------------------------------------------\n");
+  printf("  ds_heap_start:          %p\n", h->ds_heap_start);
+  printf("  ds_heap_brk:            %p\n", h->ds_heap_brk);
+  printf("  heap_start:             %p\n", h->heap_start);
+  printf("  heap_end:               %p\n", h->heap_end);
+  size_t regions, bytes;
+  ds_seg_map_stat(h->ds, &regions, &bytes);
+  printf("  mapped blocks:          %lu (%lu bytes)\n", regions, bytes);
+  printf("  resident:               %lu bytes\n", ds_seg_resident(h->ds));
+  unsigned long calls, nsec;
+  ds_seg_sbrk_stat(h->ds, &calls, &nsec);
+  printf("  sbrk calls:             %lu (%lu ns)\n", calls, nsec);
+  printf("  growth step:            %lx\n", h->grow_step);
+  printf("  detected errors:        %lu\n", h->nerrors);
+  printf("\n");
+  p = PREV_PTR(h->heap_start);
+  printf("  initial sentinel:       %p: size: %6lx, status: %lx\n", p, GET_SIZE(p), GET_STATUS(p));
+  p = h->heap_end;
+  printf("  end sentinel:           %p: size: %6lx, status: %lx\n", p, GET_SIZE(p), GET_STATUS(p));
+  printf("\n");
+  printf("  blocks:\n");
+
+  long errors = 0;
+  long nfree = 0, nalloc = 0;
+  size_t free_bytes = 0, largest = 0;
+  size_t free_hist[MM_STATS_CLASSES] = { 0 };
+  TYPE prev_alloc = PREV_ALLOC;                         // initial sentinel is allocated
+  p = h->heap_start;
+  while (p < h->heap_end) {
+    TYPE hdr = GET(p);
+    TYPE size = SIZE(hdr);
+    TYPE status = STATUS(hdr);
+    printf("    %p: size: %6lx, status: %lx\n", p, size, status);
+    if ((size == 0) || (p + size > h->heap_end)) {
+      printf("    WARNING: invalid size detected, aborting traversal.\n");
+      break;
+    }
+
+    int mapped = (PAGE_OF(p) == p) && (h->slab_map[PAGE_IDX(p) >> 3] & (1 << (PAGE_IDX(p) & 7)));
+    if (hdr & SLAB) {
+      Slab *run = p;
+      printf("      slab run: %4d-byte slots, %u/%u free\n", SLOT_SIZE(run->cls), run->nfree,
+             run->nslots);
+      if ((size != PAGESIZE) || (run->cls >= SLAB_CLASSES) || (run->nfree > run->nslots)) {
+        errors++;
+        printf("    --> ERROR: invalid slab run\n");
+      }
+    }
+    if (hdr & ARENA) printf("      arena chunk\n");
+    if (mapped != ((hdr & SLAB) != 0)) {
+      errors++;
+      printf("    --> ERROR: slab page map does not match block status\n");
+    }
+
+    if (IS_BUDDY(h)) {                                  // no prev-allocated bits and footers
+      if (!BUDDY_ALIGNED(h, p, size)) {
+        errors++;
+        printf("    --> ERROR: buddy block not aligned to its size\n");
+      }
+    } else if ((hdr & PREV_ALLOC) != prev_alloc) {
+      errors++;
+      printf("    --> ERROR: prev-allocated bit does not match status of preceding block\n");
+    }
+    if (!TAG_OK(hdr)) {
+      errors++;
+      printf("    --> ERROR: invalid canary in header %lx\n", hdr);
+    }
+
+    // only free blocks have a footer (buddy blocks have none)
+    if ((hdr & ALLOC) == FREE) {
+      nfree++;
+      free_bytes += size;
+      largest = MAX(largest, size);
+      if (size >= BS) free_hist[STATS_CLASS(size)]++;
+
+      void *fp = p + size - TYPE_SIZE;
+      TYPE ftr = GET(fp);
+      TYPE fsize = SIZE(ftr);
+      TYPE fstatus = STATUS(ftr);
+
+      if (!IS_BUDDY(h) && ((size != fsize) || (fstatus != FREE) || !TAG_OK(ftr))) {
+        errors++;
+        printf("    --> ERROR: footer at %p with different properties: size: %lx, status: %lx\n",
+               fp, fsize, fstatus);
+      }
+
+      // pages known to be zero lie in the interior of the block and hold only zeroes
+      for (void *pg = PAGE_OF(p); pg < p + size; pg += PAGESIZE) {
+        if (!ZERO_PAGE(pg)) continue;
+        int inside = (pg >= p + FREE_HEAD(h)) && (pg + PAGESIZE <= p + size - FREE_TAIL(h));
+        int zero = inside && (*(char*)pg == 0) && (memcmp(pg, pg + 1, PAGESIZE - 1) == 0);
+        if (!zero) {
+          errors++;
+          printf("    --> ERROR: page %p is marked as zero but %s\n", pg,
+                 inside ? "holds data" : "overlaps the block tags");
+        }
+      }
+    } else {
+      nalloc++;
+    }
+    prev_alloc = (hdr & ALLOC) ? PREV_ALLOC : 0;
+
+    p = p + size;
+  }
+
+  if ((p == h->heap_end) && !IS_BUDDY(h) && (GET_PREV_ALLOC(h->heap_end) != prev_alloc)) {
+    errors++;
+    printf("    --> ERROR: prev-allocated bit of end sentinel does not match last block\n");
+  }
+
+  printf("\n");
+  if (h->policy == ap_Buddy) errors += check_orders(h, nfree);
+  else if (h->policy == ap_SegregatedFit) errors += check_bins(h, nfree);
+  else if (h->policy == ap_BestFit) errors += check_tree(h, nfree);
+  else errors += check_free_list(h, nfree);
+
+  // the incrementally maintained counters must match the heap
+  printf("\n");
+  printf("  allocated blocks:       %ld (counted: %lu)\n", nalloc, h->stats.alloc_blocks);
+  printf("  free blocks:            %ld (counted: %lu)\n", nfree, h->stats.free_blocks);
+  printf("  free bytes:             %lu (counted: %lu)\n", free_bytes, h->stats.free_bytes);
+  printf("  largest free block:     %lu (indexed: %lu)\n", largest, largest_free(h));
+  if ((nalloc != (long)h->stats.alloc_blocks) || (nfree != (long)h->stats.free_blocks) ||
+      (free_bytes != h->stats.free_bytes) || (largest != largest_free(h)) ||
+      memcmp(free_hist, h->stats.free_hist, sizeof(free_hist))) {
+    errors++;
+    printf("    --> ERROR: statistics do not match the heap\n");
+  }
+
+  printf("\n");
+  if ((p == h->heap_end) && (errors == 0)) printf("  Block structure coherent.\n");
+  printf("-------------------------------------------------------------------------------------------------\n");
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Remote frees
+//
+
+/// @brief set a registry entry. Called with heaps_lock held.
+/// @param e entry
+/// @param h heap (NULL: clear the entry)
+static void heap_entry_set(HeapEntry *e, mm_heap_t *h)
+{
+  // the release stores keep the odd sequence number ahead of the new contents
+  __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);         // odd: readers retry
+  __atomic_store_n(&e->heap, h, __ATOMIC_RELEASE);
+  __atomic_store_n(&e->start, h != NULL ? h->ds_heap_start : NULL, __ATOMIC_RELEASE);
+  __atomic_store_n(&e->end, h != NULL ? h->ds_heap_end : NULL, __ATOMIC_RELEASE);
+  __atomic_store_n(&e->ds, h != NULL ? h->ds : NULL, __ATOMIC_RELEASE);
+  __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+/// @brief register a heap so that its blocks can be found by other heaps
+/// @param h heap
+/// @retval 0 on success
+/// @retval -1 if MAX_HEAPS heaps are registered
+static int heap_register(mm_heap_t *h)
+{
+  int res = -1;
+
+  pthread_mutex_lock(&heaps_lock);
+  for(int i = 0; (res < 0) && (i < MAX_HEAPS); i++){              // re-initialized heap: the data
+    if(heaps[i].heap == h){ heap_entry_set(&heaps[i], h); res = 0; } // segment may have moved
+  }
+  for(int i = 0; (res < 0) && (i < MAX_HEAPS); i++){
+    if(heaps[i].heap == NULL){ heap_entry_set(&heaps[i], h); res = 0; }
+  }
+  pthread_mutex_unlock(&heaps_lock);
+
+  return res;
+}
+
+/// @brief remove a heap from the registry
+/// @param h heap
+static void heap_unregister(mm_heap_t *h)
+{
+  pthread_mutex_lock(&heaps_lock);
+  for(int i = 0; i < MAX_HEAPS; i++) if(heaps[i].heap == h) heap_entry_set(&heaps[i], NULL);
+  pthread_mutex_unlock(&heaps_lock);
+}
+
+/// @brief search the registry without a lock for the heap whose data segment contains @a ptr or,
+///        if @a ds is given, whose data segment is @a ds. Entries that change during the read
+///        are read again.
+/// @param ptr payload
+/// @param ds data segment or NULL
+/// @retval mm_heap_t* registered heap
+/// @retval NULL if no heap matches
+static mm_heap_t* heap_lookup(void *ptr, DataSeg *ds)
+{
+  for(int i = 0; i < MAX_HEAPS; i++){
+    HeapEntry *e = &heaps[i];
+    unsigned long seq;
+    mm_heap_t *heap;
+    int match;
+
+    // the acquire loads keep the second read of the sequence number behind the contents
+    do{
+      seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+      heap = __atomic_load_n(&e->heap, __ATOMIC_ACQUIRE);
+      match = ds != NULL ? __atomic_load_n(&e->ds, __ATOMIC_ACQUIRE) == ds :
+              (ptr >= __atomic_load_n(&e->start, __ATOMIC_ACQUIRE)) &&
+              (ptr < __atomic_load_n(&e->end, __ATOMIC_ACQUIRE));
+    } while((seq & 1) || (seq != __atomic_load_n(&e->seq, __ATOMIC_RELAXED)));
+
+    if((heap != NULL) && match) return heap;
+  }
+  return NULL;
+}
+
+/// @brief find the heap that owns a payload. Payloads of @a h are recognized without searching.
+///        Never blocks: the registry is read without a lock.
+/// @param h heap of the caller
+/// @param ptr payload
+/// @retval mm_heap_t* heap the payload was allocated from
+/// @retval NULL if the payload belongs to no heap
+static mm_heap_t* heap_of(mm_heap_t *h, void *ptr)
+{
+  if(IN_HEAP(h, ptr)) return h;
+
+  mm_heap_t *owner = heap_lookup(ptr, NULL);
+
+  // outside of all data segments: a mapped block. Its region records the data segment.
+  if((owner == NULL) && (GET(ptr - TYPE_SIZE) & MAPPED)){
+    DataSeg *ds = ds_region_owner(ptr - TYPE_SIZE);
+    owner = ds == h->ds ? h : heap_lookup(NULL, ds);
+  }
+
+  return owner;
+}
+
+/// @brief append a payload to the remote-free queue of its heap. Wait-free; any thread may call it.
+/// @param h heap that owns the payload
+/// @param ptr payload
+static void remote_push(mm_heap_t *h, void *ptr)
+{
+  NEXT_REMOTE(ptr) = NULL;
+  void *prev = __atomic_exchange_n(&h->remote_head, ptr, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&NEXT_REMOTE(prev), ptr, __ATOMIC_RELEASE);
+}
+
+/// @brief remove the oldest payload from the remote-free queue. Only one thread at a time may call
+///        it (the owner of the heap or the holder of the heap lock).
+/// @param h heap
+/// @retval void* payload
+/// @retval NULL if the queue is empty or the next payload is still being appended
+static void* remote_pop(mm_heap_t *h)
+{
+  void *tail = h->remote_tail;
+  void *next = __atomic_load_n(&NEXT_REMOTE(tail), __ATOMIC_ACQUIRE);
+
+  if(tail == REMOTE_STUB(h)){
+    if(next == NULL) return NULL;
+    h->remote_tail = tail = next;
+    next = __atomic_load_n(&NEXT_REMOTE(tail), __ATOMIC_ACQUIRE);
+  }
+  if(next != NULL){
+    h->remote_tail = next;
+    return tail;
+  }
+
+  // tail is the last payload: put the stub behind it so that it can be removed
+  if(tail != __atomic_load_n(&h->remote_head, __ATOMIC_ACQUIRE)) return NULL;
+  remote_push(h, REMOTE_STUB(h));
+  next = __atomic_load_n(&NEXT_REMOTE(tail), __ATOMIC_ACQUIRE);
+  if(next == NULL) return NULL;
+  h->remote_tail = next;
+  return tail;
+}
+
+/// @brief free all payloads in the remote-free queue of a heap. Caller holds the heap.
+/// @param h heap
+static void remote_drain(mm_heap_t *h)
+{
+  if((h->remote_tail == REMOTE_STUB(h)) &&
+     (__atomic_load_n(&h->remote_head, __ATOMIC_RELAXED) == REMOTE_STUB(h))) return;
+
+  void *ptr;
+  while((ptr = remote_pop(h)) != NULL) heap_free(h, ptr);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Thread-safe mode
+//
+
+/// @brief compute the thread cache class of a request
+/// @param h heap
+/// @param size requested size in bytes
+/// @retval class of the request
+/// @retval -1 if requests of this size are not cached
+static int tc_class(mm_heap_t *h, size_t size)
+{
+  if(IS_BUDDY(h)){                                                    // no slots; cached by block size
+    size_t blocksize = BUDDY_SIZE(ROUND_UP(TYPE_SIZE + size));
+    if((blocksize <= TC_BLOCK_MAX) && (size <= mmap_threshold)) return TC_BUDDY_CLASS(blocksize);
+    return -1;
+  }
+
+  if(size <= SLAB_MAX) return SLAB_CLASS(size);
+
+  size_t blocksize = ROUND_UP(TYPE_SIZE + size);
+  if((blocksize <= TC_BLOCK_MAX) && (size <= mmap_threshold)) return TC_BLOCK_CLASS(blocksize);
+  return -1;
+}
+
+/// @brief compute the thread cache class of an allocated payload. Blocks smaller than a request
+///        above SLAB_MAX (e.g., shrunk by mm_realloc) are not cached; no request would take them.
+///        Runs without the heap lock, so the heap end, the slab page map, and the header are read
+///        atomically. The class of a run does not change while the run holds allocated slots.
+/// @param h heap
+/// @param ptr payload
+/// @retval class of the payload
+/// @retval -1 if the payload is not cached
+static int tc_class_of(mm_heap_t *h, void *ptr)
+{
+  if(IS_SLOT(ptr)) return ((Slab*)PAGE_OF(ptr))->cls;
+
+  TYPE hdr = LOAD_TAG(ptr - TYPE_SIZE);
+  if(hdr & MAPPED) return -1;
+
+  size_t size = SIZE(hdr);
+  if(IS_BUDDY(h)) return (size >= BS) && (size <= TC_BLOCK_MAX) ? TC_BUDDY_CLASS(size) : -1;
+  if((size < ROUND_UP(TYPE_SIZE + SLAB_MAX + 1)) || (size > TC_BLOCK_MAX)) return -1;
+  return TC_BLOCK_CLASS(size);
+}
+
+/// @brief return cached blocks of a class to the heap until @a keep blocks remain
+/// @param tc thread cache
+/// @param cls class
+/// @param keep number of blocks to keep
+static void tc_flush(TCache *tc, int cls, unsigned int keep)
+{
+  mm_heap_t *h = tc->heap;
+
+  LOCK(h);
+  while(tc->count[cls] > keep){
+    void *ptr = tc->bins[cls];
+    tc->bins[cls] = *(void**)ptr;
+    tc->count[cls]--;
+    heap_free(h, ptr);
+  }
+  UNLOCK(h);
+}
+
+/// @brief refill an empty class of the thread cache with a batch of blocks from the heap
+/// @param tc thread cache
+/// @param cls class
+static void tc_refill(TCache *tc, int cls)
+{
+  mm_heap_t *h = tc->heap;
+  unsigned int batch = MAX(tcache_max / 2, 1);
+
+  LOCK(h);
+  while(tc->count[cls] < batch){
+    void *ptr = heap_malloc(h, TC_SIZE(cls));
+    if(ptr == NULL) break;
+    *(void**)ptr = tc->bins[cls];
+    tc->bins[cls] = ptr;
+    tc->count[cls]++;
+  }
+  UNLOCK(h);
+}
+
+/// @brief flush the cache of an exiting thread and remove it from the caches of its heap. Caches
+///        of a heap that has been destroyed or re-initialized were dropped and are not flushed.
+/// @param arg thread cache
+static void tc_exit(void *arg)
+{
+  TCache *tc = arg;
+
+  pthread_mutex_lock(&tcache_lock);
+  mm_heap_t *h = tc->heap;
+  if(h != NULL){
+    for(int cls = 0; cls < TC_CLASSES; cls++) tc_flush(tc, cls, 0);
+
+    TCache **pp = &h->caches;
+    while(*pp != tc) pp = &(*pp)->next;
+    *pp = tc->next;
+    tc->heap = NULL;
+  }
+  pthread_mutex_unlock(&tcache_lock);
+}
+
+/// @brief drop the caches of all threads for heap @a h without returning their blocks. Called
+///        when the heap is destroyed or re-initialized; the cached blocks no longer exist.
+/// @param h heap
+static void tc_drop(mm_heap_t *h)
+{
+  pthread_mutex_lock(&tcache_lock);
+  for(TCache *tc = h->caches; tc != NULL; tc = tc->next){
+    memset(tc->bins, 0, sizeof(tc->bins));
+    memset(tc->count, 0, sizeof(tc->count));
+    tc->heap = NULL;
+  }
+  h->caches = NULL;
+  pthread_mutex_unlock(&tcache_lock);
+}
+
+/// @brief create the key that flushes the thread caches
+static void tc_init(void)
+{
+  pthread_key_create(&tcache_key, tc_exit);
+}
+
+/// @brief get the cache of the calling thread for heap @a h
+/// @param h heap in thread-safe mode
+/// @retval TCache* cache of the calling thread
+/// @retval NULL if caching is disabled or the cache belongs to another heap
+static TCache* tc_get(mm_heap_t *h)
+{
+  if(tcache_max == 0) return NULL;
+  if(tcache.heap == h) return &tcache;
+  if(tcache.heap != NULL) return NULL;
+
+  pthread_once(&tcache_once, tc_init);
+  pthread_setspecific(tcache_key, &tcache);
+  pthread_mutex_lock(&tcache_lock);
+  tcache.heap = h;
+  tcache.next = h->caches;
+  h->caches = &tcache;
+  pthread_mutex_unlock(&tcache_lock);
+  return &tcache;
+}
+
+/// @brief make the calling thread the owner of a single-threaded heap. The thread that allocates
+///        from a single-threaded heap owns it; frees of other threads are queued.
+/// @param h heap
+static void heap_own(mm_heap_t *h)
+{
+  pthread_t self = pthread_self();
+  if(!h->threaded && !pthread_equal(HEAP_OWNER(h), self)){
+    __atomic_store_n(&h->owner, self, __ATOMIC_RELEASE);
+  }
+}
+
+void* mm_heap_malloc(mm_heap_t *h, size_t size)
+{
+  heap_own(h);
+
+  if(h->threaded){
+    int cls = tc_class(h, size);
+    TCache *tc = cls >= 0 ? tc_get(h) : NULL;
+
+    if(tc != NULL){
+      if(tc->bins[cls] == NULL) tc_refill(tc, cls);
+
+      void *ptr = tc->bins[cls];
+      if(ptr != NULL){
+        tc->bins[cls] = *(void**)ptr;
+        tc->count[cls]--;
+        TRACE(te_Malloc, ptr, 0, size);
+        return ptr;
+      }
+    }
+  }
+
+  LOCK(h);
+  void *ptr = heap_malloc(h, size);
+  UNLOCK(h);
+  TRACE(te_Malloc, ptr, 0, size);
+
+  return ptr;
+}
+
+void* mm_heap_calloc(mm_heap_t *h, size_t nelem, size_t size)
+{
+  heap_own(h);
+  LOCK(h);
+  void *ptr = heap_calloc(h, nelem, size);
+  UNLOCK(h);
+  TRACE(te_Calloc, ptr, nelem, size);
+
+  return ptr;
+}
+
+void* mm_heap_memalign(mm_heap_t *h, size_t alignment, size_t size)
+{
+  heap_own(h);
+  LOCK(h);
+  void *ptr = heap_memalign(h, alignment, size);
+  UNLOCK(h);
+  TRACE(te_Memalign, ptr, alignment, size);
+
+  return ptr;
+}
+
+void* mm_heap_realloc(mm_heap_t *h, void *ptr, size_t size)
+{
+  heap_own(h);
+  LOCK(h);
+  void *res = heap_realloc(h, ptr, size);
+  UNLOCK(h);
+  TRACE(te_Realloc, res, ptr, size);
+
+  return res;
+}
+
+void mm_heap_free(mm_heap_t *h, void *ptr)
+{
+  if(ptr == NULL) return;
+  TRACE(te_Free, ptr, 0, 0);
+
+  mm_heap_t *owner = heap_of(h, ptr);
+  if(owner == NULL){
+    LOG(1, "    WARNING: mm_free(%p) of a pointer outside of all heaps", ptr);
+    return;
+  }
+
+  // blocks of other heaps and frees by a thread that does not own a single-threaded heap are
+  // queued at the owning heap
+  if((owner != h) || (!h->threaded && !pthread_equal(HEAP_OWNER(h), pthread_self()))){
+    remote_push(owner, ptr);
+    return;
+  }
+
+  if(h->threaded){
+    TCache *tc = tc_get(h);
+    int cls = tc != NULL ? tc_class_of(h, ptr) : -1;
+
+    if(cls >= 0){
+      *(void**)ptr = tc->bins[cls];
+      tc->bins[cls] = ptr;
+      if(++tc->count[cls] > tcache_max) tc_flush(tc, cls, tcache_max / 2);
+      return;
+    }
+
+    // do not wait for the lock; the holder or the next allocation frees the block
+    if(pthread_mutex_trylock(&h->lock) != 0){
+      remote_push(h, ptr);
+      return;
+    }
+    heap_free(h, ptr);
+    pthread_mutex_unlock(&h->lock);
+    return;
+  }
+
+  heap_free(h, ptr);
+}
+
+size_t mm_heap_malloc_batch(mm_heap_t *h, size_t size, size_t n, void **out)
+{
+  heap_own(h);
+
+  LOCK(h);
+  size_t done = heap_malloc_batch(h, size, n, out);
+  UNLOCK(h);
+  TRACE(te_MallocBatch, done > 0 ? out[0] : NULL, done, size);
+
+  return done;
+}
+
+void mm_heap_free_batch(mm_heap_t *h, void **ptrs, size_t n)
+{
+  TRACE(te_FreeBatch, n > 0 ? ptrs[0] : NULL, n, 0);
+  int local = h->threaded || pthread_equal(HEAP_OWNER(h), pthread_self());
+
+  // queue the blocks that are not freed by the owner of their heap; keep the others
+  size_t k = 0;
+  for(size_t i = 0; i < n; i++){
+    if(ptrs[i] == NULL) continue;
+
+    mm_heap_t *owner = heap_of(h, ptrs[i]);
+    if(owner == NULL) LOG(1, "    WARNING: mm_free(%p) of a pointer outside of all heaps", ptrs[i]);
+    else if((owner != h) || !local) remote_push(owner, ptrs[i]);
+    else ptrs[k++] = ptrs[i];
+  }
+
+  LOCK(h);
+  heap_free_batch(h, ptrs, k);
+  UNLOCK(h);
+}
+
+size_t mm_heap_trim(mm_heap_t *h)
+{
+  LOCK(h);
+  size_t released = heap_trim(h);
+  UNLOCK(h);
+
+  return released;
+}
+
+void mm_heap_check(mm_heap_t *h)
+{
+  LOCK(h);
+  heap_check(h);
+  UNLOCK(h);
+}
+
+void mm_heap_stats(mm_heap_t *h, struct mm_stats *stats)
+{
+  LOCK(h);
+  heap_stats(h, stats);
+  UNLOCK(h);
+}
+
+size_t mm_heap_errors(mm_heap_t *h, struct mm_error *errors, size_t max)
+{
+  LOCK(h);
+  size_t total = h->nerrors;
+  size_t n = MIN(MIN(total, (size_t)MM_ERRORS), max);
+  for(size_t i = 0; i < n; i++) errors[i] = h->errors[(total - n + i) % MM_ERRORS];
+  UNLOCK(h);
+
+  return total;
+}
+
+void mm_heap_setthreadsafe(mm_heap_t *h, int enable)
+{
+  h->threaded = enable != 0;
+}
+
+void mm_settcache(unsigned int count)
+{
+  tcache_max = count;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Arenas
+//
+
+#define CHUNK_END(c)      ((c) - TYPE_SIZE + GET_SIZE((c) - TYPE_SIZE))
+                                                       // end of the payload of an arena chunk
+#define ARENA_DATA(a)     ((a)->chunks + CHUNK_HDR + ROUND_ARENA(sizeof(mm_arena_t)))
+                                                       // first allocation in the first chunk
+
+/// @brief take a chunk from the heap and mark it as an arena chunk
+/// @param h heap
+/// @param size size of the chunk payload in bytes (including the chunk link)
+/// @retval void* payload of the chunk
+/// @retval NULL if the heap is out of memory
+static void* arena_chunk(mm_heap_t *h, size_t size)
+{
+  LOCK(h);
+  void *chunk = heap_malloc(h, size);
+  if(chunk != NULL) PUT(chunk - TYPE_SIZE, GET(chunk - TYPE_SIZE) | ARENA);
+  UNLOCK(h);
+
+  return chunk;
+}
+
+/// @brief return a list of arena chunks to the heap (under one lock acquisition)
+/// @param h heap
+/// @param chunk first chunk of the list
+static void arena_release(mm_heap_t *h, void *chunk)
+{
+  LOCK(h);
+  while(chunk != NULL){
+    void *next = *(void**)chunk;
+    PUT(chunk - TYPE_SIZE, GET(chunk - TYPE_SIZE) & ~ARENA);
+    heap_free(h, chunk);
+    chunk = next;
+  }
+  UNLOCK(h);
+}
+
+mm_arena_t* mm_heap_arena_create(mm_heap_t *h, size_t chunksize)
+{
+  LOG(1, "mm_arena_create(0x%lx)", chunksize);
+
+  if(chunksize == 0) chunksize = ARENA_CHUNK;
+  chunksize = MAX(chunksize, (size_t)PAGESIZE);
+  if(IS_BUDDY(h)) chunksize = BUDDY_SIZE(chunksize) - TYPE_SIZE;    // chunk fills its buddy block
+
+  void *chunk = arena_chunk(h, chunksize);
+  if(chunk == NULL) return NULL;
+
+  *(void**)chunk = NULL;
+  mm_arena_t *a = chunk + CHUNK_HDR;
+  a->heap = h;
+  a->chunks = chunk;
+  a->chunksize = chunksize;
+  a->cur = ARENA_DATA(a);
+  a->end = CHUNK_END(chunk);
+
+  return a;
+}
+
+mm_arena_t* mm_arena_create(size_t chunksize)
+{
+  return mm_heap_arena_create(&default_heap, chunksize);
+}
+
+void* mm_arena_alloc(mm_arena_t *a, size_t size)
+{
+  size = ROUND_ARENA(MAX(size, 1));
+
+  if(size <= (size_t)(a->end - a->cur)){                      // bump allocation
+    void *ptr = a->cur;
+    a->cur += size;
+    return ptr;
+  }
+
+  // requests above a quarter chunk get a chunk of their own; the current chunk stays in use.
+  // Otherwise the remainder of the current chunk is abandoned. New chunks are linked after the
+  // first chunk that holds the arena.
+  int own = CHUNK_HDR + size > a->chunksize / 4;
+  void *chunk = arena_chunk(a->heap, own ? CHUNK_HDR + size : a->chunksize);
+  if(chunk == NULL) return NULL;
+
+  *(void**)chunk = *(void**)a->chunks;
+  *(void**)a->chunks = chunk;
+  if(own) return chunk + CHUNK_HDR;
+
+  a->cur = chunk + CHUNK_HDR + size;
+  a->end = CHUNK_END(chunk);
+  return chunk + CHUNK_HDR;
+}
+
+void mm_arena_reset(mm_arena_t *a)
+{
+  LOG(1, "mm_arena_reset(%p)", a);
+
+  void *chunks = *(void**)a->chunks;                          // all but the first chunk
+  *(void**)a->chunks = NULL;
+  arena_release(a->heap, chunks);
+
+  a->cur = ARENA_DATA(a);
+  a->end = CHUNK_END(a->chunks);
+}
+
+void mm_arena_destroy(mm_arena_t *a)
+{
+  LOG(1, "mm_arena_destroy(%p)", a);
+
+  if(a == NULL) return;
+  arena_release(a->heap, a->chunks);                           // the arena lives in the first chunk
+}
+
+
+//--------------------------------------------------------------------------------------------------
+// Heap handles and the default heap
+//
+
+mm_heap_t* mm_heap_create(AllocationPolicy ap, size_t size)
+{
+  LOG(1, "mm_heap_create(%d, 0x%lx)", ap, size);
+
+  DataSeg *ds = ds_create(size);
+  if (ds == NULL) return NULL;
+
+  // the heap context is mapped so that creating a heap does not depend on malloc()
+  mm_heap_t *h = mmap(NULL, sizeof(mm_heap_t), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                      -1, 0);
+  if (h == MAP_FAILED) {
+    ds_destroy(ds);
+    return NULL;
+  }
+
+  heap_init(h, ds, ap);
+  if (heap_register(h) < 0) {
+    ds_destroy(ds);
+    munmap(h, sizeof(mm_heap_t));
+    return NULL;
+  }
+  return h;
+}
+
+void mm_heap_destroy(mm_heap_t *h)
+{
+  LOG(1, "mm_heap_destroy(%p)", h);
+
+  if ((h == NULL) || (h == &default_heap)) return;
+
+  heap_unregister(h);
+  tc_drop(h);
+  pthread_mutex_destroy(&h->lock);
+  ds_destroy(h->ds);
+  munmap(h, sizeof(mm_heap_t));
+}
+
+mm_heap_t* mm_default_heap(void)
+{
+  return &default_heap;
+}
+
+void mm_init(AllocationPolicy ap)
+{
+  LOG(1, "mm_init(%d)", ap);
+  heap_init(&default_heap, ds_default(), ap);
+  heap_register(&default_heap);
+}
+
+void* mm_malloc(size_t size)
+{
+  return mm_heap_malloc(&default_heap, size);
+}
+
+void* mm_calloc(size_t nelem, size_t size)
+{
+  return mm_heap_calloc(&default_heap, nelem, size);
+}
+
+void* mm_memalign(size_t alignment, size_t size)
+{
+  return mm_heap_memalign(&default_heap, alignment, size);
+}
+
+void* mm_aligned_alloc(size_t alignment, size_t size)
+{
+  return mm_heap_memalign(&default_heap, alignment, size);
+}
+
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+  return mm_heap_malloc_batch(&default_heap, size, n, out);
+}
+
+void mm_free_batch(void **ptrs, size_t n)
+{
+  mm_heap_free_batch(&default_heap, ptrs, n);
+}
+
+void* mm_realloc(void *ptr, size_t size)
+{
+  return mm_heap_realloc(&default_heap, ptr, size);
+}
+
+void mm_free(void *ptr)
+{
+  mm_heap_free(&default_heap, ptr);
+}
+
+size_t mm_trim(void)
+{
+  return mm_heap_trim(&default_heap);
+}
+
+void mm_check(void)
+{
+  mm_heap_check(&default_heap);
+}
+
+void mm_stats(struct mm_stats *stats)
+{
+  mm_heap_stats(&default_heap, stats);
+}
+
+size_t mm_errors(struct mm_error *errors, size_t max)
+{
+  return mm_heap_errors(&default_heap, errors, max);
+}
+
+void mm_setthreadsafe(int enable)
+{
+  mm_heap_setthreadsafe(&default_heap, enable);
 }
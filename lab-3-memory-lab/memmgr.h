@@ -40,8 +40,94 @@ typedef enum {
   ap_FirstFit,                    ///< first fit allocation policy
   ap_NextFit,                     ///< next fit allocation policy
   ap_BestFit,                     ///< best fit allocation policy
+  ap_SegregatedFit,               ///< segregated fit (TLSF) allocation policy
+  ap_Buddy,                       ///< binary buddy system
 } AllocationPolicy;
 
+/// @brief kinds of heap corruption detected by the integrity checks (see mm_setcheck())
+typedef enum {
+  he_Header,                      ///< block header with an invalid canary or size
+  he_Footer,                      ///< footer of a free block does not match its header
+  he_Neighbour,                   ///< boundary tags of neighbouring blocks do not agree
+  he_Free,                        ///< free of a block that is not allocated
+} HeapError;
+
+/// @brief kinds of events recorded by the trace (see mm_settrace())
+typedef enum {
+  te_Malloc,                      ///< mm_malloc(): ptr = block, size = requested size
+  te_Calloc,                      ///< mm_calloc(): ptr = block, arg = nelem, size = element size
+  te_Memalign,                    ///< mm_memalign(): ptr = block, arg = alignment, size
+  te_Realloc,                     ///< mm_realloc(): ptr = new block, arg = old block, size
+  te_Free,                        ///< mm_free(): ptr = block
+  te_MallocBatch,                 ///< mm_malloc_batch(): ptr = first block, arg = count, size
+  te_FreeBatch,                   ///< mm_free_batch(): ptr = first block, arg = count
+  te_Expand,                      ///< heap area grew: ptr = new free block, size = increment
+  te_Trim,                        ///< heap area shrank: ptr = new break, size = decrement
+  te_Error,                       ///< corruption detected: ptr = block, arg = HeapError
+} TraceEvent;
+
+/// @brief handle of a heap. Every heap has its own data segment and can be used independently of
+///        all other heaps.
+typedef struct mm_heap mm_heap_t;
+
+/// @brief handle of an arena. An arena serves many small allocations that are released together.
+typedef struct mm_arena mm_arena_t;
+
+#define MM_STATS_CLASSES 24       ///< number of size classes of the free block histogram
+
+#define MM_ERRORS 16              ///< number of error records kept per heap
+
+/// @brief record of a detected heap corruption. See mm_errors().
+struct mm_error {
+  HeapError kind;                 ///< kind of error
+  void *block;                    ///< header of the affected block
+  unsigned long tag;              ///< offending boundary tag
+};
+
+/// @brief event record of the trace. See mm_settrace().
+struct mm_event {
+  unsigned long time;             ///< timestamp in clock ticks (see mm_trace_header)
+  void *ptr;                      ///< block (see TraceEvent)
+  unsigned long arg;              ///< second argument (see TraceEvent)
+  unsigned long size   : 48;      ///< size in bytes
+  unsigned long thread : 8;       ///< number of the thread, in the order of their first event
+  unsigned long type   : 8;       ///< TraceEvent
+};
+
+#define MM_TRACE_MAGIC "MMTRACE1" ///< first bytes of a file written by mm_trace_dump()
+
+/// @brief header of a file written by mm_trace_dump(); the event records follow. The events of a
+///        thread are in order; the events of different threads are not sorted by time.
+///        A timestamp t corresponds to (t - start) * nsec / ticks nanoseconds after tracing began.
+struct mm_trace_header {
+  char magic[8];                  ///< MM_TRACE_MAGIC
+  unsigned long events;           ///< number of event records in the file
+  unsigned long lost;             ///< number of older slots overwritten in the ring buffer
+  unsigned long start;            ///< timestamp when tracing began
+  unsigned long ticks;            ///< clock ticks between the start and the dump
+  unsigned long nsec;             ///< nanoseconds between the start and the dump
+};
+
+/// @brief occupancy and fragmentation of a heap. See mm_stats().
+struct mm_stats {
+  size_t heap_size;               ///< size of the heap area in bytes
+  size_t alloc_blocks;            ///< allocated blocks in the heap (a slab run counts as one)
+  size_t alloc_bytes;             ///< bytes in allocated blocks, including headers
+  size_t free_blocks;             ///< free blocks in the heap
+  size_t free_bytes;              ///< bytes in free blocks
+  size_t largest_free;            ///< size of the largest free block in bytes
+  double external_frag;           ///< 1 - largest_free / free_bytes (0: all free bytes in one block)
+  size_t mapped_blocks;           ///< blocks in separate mapped regions
+  size_t mapped_bytes;            ///< bytes in mapped blocks
+  unsigned long requested;        ///< bytes requested by all allocations served by the heap so far
+  unsigned long granted;          ///< bytes of the blocks, slots and regions that served them
+  double internal_frag;           ///< 1 - requested / granted: share lost to headers and rounding
+  unsigned long expansions;       ///< number of times the heap area grew
+  unsigned long trims;            ///< number of times the heap area shrank
+  size_t free_hist[MM_STATS_CLASSES]; ///< free blocks by size: class i holds blocks of [32 << i,
+                                  ///< 32 << (i+1)) bytes, the last class all larger blocks
+};
+
 /// @brief initialize heap. Must be called before any of the other functions can be used.
 /// @param ap block allocation policy
 void mm_init(AllocationPolicy ap);
@@ -59,6 +145,18 @@ void* mm_malloc(size_t size);
 /// @retval NULL if memory allocation failed
 void* mm_calloc(size_t nelem, size_t size);
 
+/// @brief allocate a block of memory of @a size bytes whose address is a multiple of @a alignment.
+///        The block is freed with mm_free.
+/// @param alignment alignment in bytes (power of two)
+/// @param size requested size in bytes
+/// @retval void* pointer to first byte of memory on success
+/// @retval NULL if memory allocation failed or @a alignment is not a power of two (or, with
+///             ap_Buddy, larger than the page size)
+void* mm_memalign(size_t alignment, size_t size);
+
+/// @brief C11 aligned_alloc(). Same as mm_memalign().
+void* mm_aligned_alloc(size_t alignment, size_t size);
+
 /// @brief re-allocate a block of memory to change its size to @a size bytes.
 /// @param ptr previously allocated block or NULL
 /// @param size requested new size in bytes
@@ -66,15 +164,187 @@ void* mm_calloc(size_t nelem, size_t size);
 /// @retval NULL if memory allocation failed
 void* mm_realloc(void *ptr, size_t size);
 
-/// @brief free a previously allocated block of memory
+/// @brief free a previously allocated block of memory. Blocks of other heaps and blocks freed by a
+///        thread other than the owner of the heap are handed to their heap without waiting.
 /// @param ptr pointer to allocated memory obtained by calling mm_malloc, mm_calloc, or mm_realloc
 void mm_free(void *ptr);
 
+/// @brief allocate @a n blocks of @a size bytes each in one call
+/// @param size requested size of each block in bytes
+/// @param n number of blocks
+/// @param[out] out receives the pointers to the blocks
+/// @retval number of blocks allocated; less than @a n if memory ran out
+size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/// @brief free @a n blocks in one call. NULL pointers are ignored. The array is reordered.
+/// @param ptrs pointers to allocated memory
+/// @param n number of pointers
+void mm_free_batch(void **ptrs, size_t n);
+
 /// @brief set log level
 /// @brief level log level (0: no logging, 1: info; 2: verbose)
 void mm_setloglevel(int level);
 
+/// @brief set the size above which requests are served from separate mapped regions instead of
+///        the heap. Mapped blocks are returned to the system as soon as they are freed.
+/// @param size threshold in bytes. Values below the largest slab size class are raised to it.
+void mm_setmmapthreshold(size_t size);
+
+/// @brief set the size of the free block at the end of the heap above which mm_free lowers the
+///        heap break.
+/// @param size threshold in bytes
+void mm_settrimthreshold(size_t size);
+
+/// @brief set the limits of a heap extension. The heap grows by the larger of the missing amount
+///        and a step that scales with the heap size and the number of recent expansions.
+/// @param min minimal extension in bytes
+/// @param max maximal extension in bytes (unless more is needed for the current request)
+void mm_setgrowth(size_t min, size_t max);
+
+/// @brief return as much free memory to the system as possible: shrink the heap to the last
+///        allocated block and release the pages inside free blocks
+/// @retval number of bytes released
+size_t mm_trim(void);
+
 /// @brief dump heap and perform some sanity checks
 void mm_check(void);
 
+/// @brief set the integrity checks of all heaps. Boundary tags carry a canary derived from the
+///        block size. With checks enabled, mm_free verifies the header of the block and coalescing
+///        the tags of its neighbours; a walker verifies @a walk blocks of the heap per allocation
+///        and free of a heap block. Corrupt blocks are neither freed nor merged. Errors are recorded and
+///        retrieved with mm_errors() instead of being printed.
+/// @param enable 1: check tags on free and coalesce; 0: no checks
+/// @param walk number of blocks checked per operation (0: no walker)
+void mm_setcheck(int enable, unsigned int walk);
+
+/// @brief retrieve the most recent errors detected by the integrity checks
+/// @param[out] errors receives up to @a max records, oldest first
+/// @param max size of @a errors
+/// @retval total number of errors detected (may exceed @a max and MM_ERRORS)
+size_t mm_errors(struct mm_error *errors, size_t max);
+
+/// @brief start or stop tracing the calls of all heaps. Every call appends a fixed-size record to
+///        a ring buffer; when the buffer is full, the oldest records are overwritten. Recording
+///        takes a timestamp and a few stores and does not lock. Start tracing while no thread
+///        allocates; stop it before the buffer is released.
+/// @param buf ring buffer provided by the caller (NULL: stop tracing)
+/// @param n size of @a buf in records (at least 64); only the largest power of two <= @a n is used
+void mm_settrace(struct mm_event *buf, size_t n);
+
+/// @brief write the trace to a file: a struct mm_trace_header followed by the recorded events.
+///        Decode the file with mm_tracedump. Call while no thread allocates.
+/// @param fd file descriptor open for writing
+/// @retval number of event records written
+/// @retval -1 on error (tracing not enabled or write failed)
+long mm_trace_dump(int fd);
+
+/// @brief retrieve occupancy and fragmentation statistics of the heap. The counters are kept up
+///        to date by every allocation and free; the call does not walk the heap and is cheap
+///        enough to be polled periodically.
+/// @param[out] stats receives the statistics
+void mm_stats(struct mm_stats *stats);
+
+/// @brief switch the default heap to thread-safe mode. Call after mm_init() and before other
+///        threads use the heap.
+/// @param enable 1: thread-safe mode; 0: single-threaded mode
+void mm_setthreadsafe(int enable);
+
+/// @brief set the number of free blocks per size class that each thread caches in thread-safe
+///        mode. Call before other threads use a heap.
+/// @param count number of cached blocks per class (0: no caching, every call takes the heap lock)
+void mm_settcache(unsigned int count);
+
+//
+// Heap handles
+//
+// The functions above operate on the default heap that is set up by mm_init() on the data segment
+// of ds_allocate(). mm_heap_create() creates an additional heap on a data segment of its own; the
+// mm_heap_*() functions operate on a given heap.
+//
+
+/// @brief create a heap with its own data segment
+/// @param ap block allocation policy
+/// @param size maximum size of the data segment of the heap
+/// @retval mm_heap_t* handle of the new heap on success
+/// @retval NULL if the data segment cannot be created or too many heaps exist
+mm_heap_t* mm_heap_create(AllocationPolicy ap, size_t size);
+
+/// @brief destroy a heap created by mm_heap_create() and release its data segment. All blocks of
+///        the heap become invalid.
+/// @param heap heap
+void mm_heap_destroy(mm_heap_t *heap);
+
+/// @brief retrieve the handle of the default heap
+/// @retval mm_heap_t* handle of the default heap
+mm_heap_t* mm_default_heap(void);
+
+/// @brief mm_malloc() on @a heap
+void* mm_heap_malloc(mm_heap_t *heap, size_t size);
+
+/// @brief mm_calloc() on @a heap
+void* mm_heap_calloc(mm_heap_t *heap, size_t nelem, size_t size);
+
+/// @brief mm_memalign() on @a heap
+void* mm_heap_memalign(mm_heap_t *heap, size_t alignment, size_t size);
+
+/// @brief mm_realloc() on @a heap. @a ptr must have been allocated from @a heap.
+void* mm_heap_realloc(mm_heap_t *heap, void *ptr, size_t size);
+
+/// @brief mm_free() on @a heap. Blocks of other heaps are queued at the heap they belong to.
+void mm_heap_free(mm_heap_t *heap, void *ptr);
+
+/// @brief mm_malloc_batch() on @a heap
+size_t mm_heap_malloc_batch(mm_heap_t *heap, size_t size, size_t n, void **out);
+
+/// @brief mm_free_batch() on @a heap
+void mm_heap_free_batch(mm_heap_t *heap, void **ptrs, size_t n);
+
+/// @brief mm_trim() on @a heap
+size_t mm_heap_trim(mm_heap_t *heap);
+
+/// @brief mm_check() on @a heap
+void mm_heap_check(mm_heap_t *heap);
+
+/// @brief mm_stats() on @a heap
+void mm_heap_stats(mm_heap_t *heap, struct mm_stats *stats);
+
+/// @brief mm_errors() on @a heap
+size_t mm_heap_errors(mm_heap_t *heap, struct mm_error *errors, size_t max);
+
+/// @brief mm_setthreadsafe() on @a heap
+void mm_heap_setthreadsafe(mm_heap_t *heap, int enable);
+
+//
+// Arenas
+//
+// An arena bump-allocates from large chunks taken from a heap. Arena allocations have no boundary
+// tags and cannot be freed individually; mm_arena_reset() and mm_arena_destroy() release all of
+// them at once. An arena must only be used by one thread at a time.
+//
+
+/// @brief create an arena on the default heap
+/// @param chunksize size of the chunks taken from the heap (0: default size)
+/// @retval mm_arena_t* handle of the new arena on success
+/// @retval NULL if memory allocation failed
+mm_arena_t* mm_arena_create(size_t chunksize);
+
+/// @brief mm_arena_create() on @a heap
+mm_arena_t* mm_heap_arena_create(mm_heap_t *heap, size_t chunksize);
+
+/// @brief allocate @a size bytes from an arena. The memory is 16-byte aligned.
+/// @param arena arena
+/// @param size requested size in bytes
+/// @retval void* pointer to first byte of memory on success
+/// @retval NULL if memory allocation failed
+void* mm_arena_alloc(mm_arena_t *arena, size_t size);
+
+/// @brief release all allocations of an arena. The arena keeps its first chunk and can be reused.
+/// @param arena arena
+void mm_arena_reset(mm_arena_t *arena);
+
+/// @brief release all allocations and the arena itself
+/// @param arena arena
+void mm_arena_destroy(mm_arena_t *arena);
+
 #endif // __MEMMGR_H__
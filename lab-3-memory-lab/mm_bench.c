@@ -0,0 +1,159 @@
+//--------------------------------------------------------------------------------------------------
+// System Programming                       Memory Lab                                   Fall 2020
+//
+/// @file
+/// @brief multi-threaded benchmark for the dynamic memory manager
+//--------------------------------------------------------------------------------------------------
+
+// Multi-threaded benchmark
+// ========================
+// mm_bench measures the throughput of the default heap in thread-safe mode for every thread count
+// from 1 up to the given number of threads (default: the number of online CPUs). Every thread
+// performs the same number of operations on a private window of blocks: a random slot of the
+// window is freed if it holds a block and allocated otherwise. Most requests are small, some go
+// up to 1 KB.
+//
+// Each thread count is run twice: with the per-thread caches and with caching disabled, i.e.,
+// every call takes the heap lock. The speedup is relative to one thread of the same mode. The
+// per-core throughput divides the throughput by the number of cores the threads can occupy
+// (at most the number of online CPUs); it stays constant while the allocator scales linearly.
+//
+// Usage: mm_bench [-t <threads>] [-n <operations per thread>] [-c <cached blocks per class>]
+//                 [-p firstfit|nextfit|bestfit|segfit|buddy]
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dataseg.h"
+#include "memmgr.h"
+
+
+#define WINDOW  1024                                 ///< number of blocks per thread
+
+static unsigned long    nops    = 1000000;           ///< operations per thread
+static AllocationPolicy policy  = ap_SegregatedFit;  ///< allocation policy
+
+
+/// @brief random number generator (xorshift)
+/// @param state generator state
+/// @retval next random number
+static unsigned long next_random(unsigned long *state)
+{
+  unsigned long x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+/// @brief benchmark thread
+/// @param arg thread index
+/// @retval NULL
+static void* worker(void *arg)
+{
+  unsigned long state = 0x9e3779b97f4a7c15UL * ((unsigned long)arg + 1);
+  void *window[WINDOW] = { NULL };
+
+  for (unsigned long i = 0; i < nops; i++) {
+    unsigned long r = next_random(&state);
+    unsigned int slot = r % WINDOW;
+
+    if (window[slot] != NULL) {
+      mm_free(window[slot]);
+      window[slot] = NULL;
+    } else {
+      size_t size = (r >> 16) % 8 ? (r >> 24) % 128 + 1 : (r >> 24) % 1024 + 1;
+      window[slot] = mm_malloc(size);
+      if (window[slot] == NULL) {
+        fprintf(stderr, "ERROR: mm_malloc(%lu) failed.\n", size);
+        exit(EXIT_FAILURE);
+      }
+      *(char*)window[slot] = (char)i;
+    }
+  }
+
+  for (unsigned int slot = 0; slot < WINDOW; slot++) mm_free(window[slot]);
+
+  return NULL;
+}
+
+/// @brief run the benchmark with @a nthreads threads on a fresh heap
+/// @param nthreads number of threads
+/// @param cache number of cached blocks per class and thread
+/// @retval throughput in million operations per second
+static double run(int nthreads, unsigned int cache)
+{
+  pthread_t tid[nthreads];
+  struct timespec start, end;
+
+  ds_allocate(256*1024*1024);
+  mm_init(policy);
+  mm_setthreadsafe(1);
+  mm_settcache(cache);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long t = 0; t < nthreads; t++) {
+    if (pthread_create(&tid[t], NULL, worker, (void*)t) != 0) {
+      fprintf(stderr, "ERROR: cannot create thread: %s\n", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int t = 0; t < nthreads; t++) pthread_join(tid[t], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  ds_release();
+
+  double time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return nthreads * nops / time / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+  int maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int cache = 64;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:n:c:p:")) != -1) {
+    switch (opt) {
+      case 't': maxthreads = atoi(optarg); break;
+      case 'n': nops = strtoul(optarg, NULL, 0); break;
+      case 'c': cache = atoi(optarg); break;
+      case 'p':
+        if (strcmp(optarg, "firstfit") == 0) policy = ap_FirstFit;
+        else if (strcmp(optarg, "nextfit") == 0) policy = ap_NextFit;
+        else if (strcmp(optarg, "bestfit") == 0) policy = ap_BestFit;
+        else if (strcmp(optarg, "segfit") == 0) policy = ap_SegregatedFit;
+        else if (strcmp(optarg, "buddy") == 0) policy = ap_Buddy;
+        else fprintf(stderr, "Invalid policy '%s'. Using segregated fit.\n", optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-t threads] [-n operations] [-c cache] [-p policy]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (maxthreads < 1) maxthreads = 1;
+
+  int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("%lu operations per thread, %d online CPUs\n\n", nops, ncpus);
+  printf("  threads   cached: Mops/s  speedup  per core   locked: Mops/s  speedup  per core\n");
+
+  double base_cached = 0, base_locked = 0;
+  for (int n = 1; n <= maxthreads; n++) {
+    double cached = run(n, cache);
+    double locked = run(n, 0);
+    int cores = n < ncpus ? n : ncpus;
+    if (n == 1) { base_cached = cached; base_locked = locked; }
+
+    printf("  %7d   %14.2f  %7.2f  %8.2f   %14.2f  %7.2f  %8.2f\n", n,
+           cached, cached / base_cached, cached / cores,
+           locked, locked / base_locked, locked / cores);
+  }
+
+  return EXIT_SUCCESS;
+}
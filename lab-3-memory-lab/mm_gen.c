@@ -0,0 +1,375 @@
+//--------------------------------------------------------------------------------------------------
+// System Programming                       Memory Lab                                   Fall 2020
+//
+/// @file
+/// @brief synthetic trace generator for mm_replay
+//--------------------------------------------------------------------------------------------------
+
+// Synthetic trace generator
+// =========================
+// mm_gen writes a script for mm_replay (see tests/*.dmas) to stdout. The block sizes and
+// lifetimes are drawn from configurable distributions; the blocks are freed in one of three
+// patterns:
+//
+//   lifetime   every block is freed when its lifetime, counted in allocations, has expired
+//   fifo       producer/consumer: the producer allocates bursts of blocks, the consumer frees the
+//              oldest blocks in bursts whenever more than <depth> blocks are queued
+//   lifo       like fifo, but the consumer frees the youngest blocks (stack)
+//
+// The trace can be split into phases. Every phase scales the sizes and lifetimes by a random
+// power of two between 1/4 and 4, so that the blocks of earlier phases fragment the heap for
+// the blocks of later ones. The blocks that are still allocated at the end are freed in random
+// order. The ids of freed blocks are reused.
+//
+// Distributions (<dist>):
+//   const:<v>                        always <v>
+//   uniform:<min>:<max>              uniform in [min, max]
+//   exp:<mean>                       exponential with the given mean
+//   pow:<min>:<max>:<alpha>          power law (bounded Pareto) in [min, max], P(x) ~ x^-(alpha+1)
+//
+// Usage: mm_gen [-n <allocations>] [-s <size dist>] [-l <lifetime dist>] [-w lifetime|fifo|lifo]
+//               [-q <depth>] [-b <burst dist>] [-P <phases>] [-r <realloc prob>]
+//               [-c <calloc prob>] [-S <seed>] [-p <policy>] [-m <mode>] [-d <dataseg size>]
+//
+// Example: 5000 allocations with power-law sizes in four phases, checked by mm_replay:
+//   $ ./mm_gen -n 5000 -s pow:16:65536:1.2 -P 4 -r 0.05 -m correctness > power.dmas
+//   $ ./mm_replay power.dmas
+//
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/// @brief distribution kinds
+typedef enum {
+  d_Const,                        ///< constant
+  d_Uniform,                      ///< uniform
+  d_Exp,                          ///< exponential
+  d_Pow,                          ///< bounded Pareto
+} DistKind;
+
+/// @brief a distribution
+typedef struct {
+  DistKind kind;                  ///< kind
+  double a, b, c;                 ///< parameters (see header)
+} Dist;
+
+/// @brief free patterns
+typedef enum {
+  w_Lifetime,                     ///< free when the lifetime expires
+  w_Fifo,                         ///< free oldest blocks in bursts
+  w_Lifo,                         ///< free youngest blocks in bursts
+} Pattern;
+
+/// @brief a block of the trace
+typedef struct {
+  size_t size;                    ///< current size
+  size_t pos;                     ///< index in live[]
+} Block;
+
+/// @brief an entry of the death queue (lifetime pattern)
+typedef struct {
+  unsigned long death;            ///< time of death (allocation count)
+  unsigned long id;               ///< block id
+} Death;
+
+
+static unsigned long rng = 0x9e3779b97f4a7c15UL;      ///< random number generator state
+
+static Block         *blocks;                         ///< blocks indexed by id
+static unsigned long *live;                           ///< ids of live blocks
+static size_t        nlive;                           ///< number of live blocks
+static unsigned long *freeids;                        ///< stack of unused ids
+static size_t        nfreeids;                        ///< number of unused ids
+static unsigned long nextid;                          ///< smallest id never used
+
+static Death         *deaths;                         ///< min-heap of deaths (lifetime pattern)
+static size_t        ndeaths;                         ///< number of entries in deaths
+
+static unsigned long *queue;                          ///< queued ids (fifo/lifo), ring buffer
+static size_t        qhead, qlen;                     ///< index of oldest entry, number of ids
+
+static size_t        capacity;                        ///< capacity of all arrays above
+
+
+/// @brief print error message and terminate process
+/// @param msg error message
+static void fatal(const char *msg)
+{
+  fprintf(stderr, "ERROR: %s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+/// @brief random number generator (xorshift)
+/// @retval next random number
+static unsigned long next_random(void)
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+/// @brief uniform random number in [0, 1)
+static double uniform(void)
+{
+  return (next_random() >> 11) * (1.0 / (1UL << 53));
+}
+
+/// @brief parse a distribution
+/// @param s distribution as given on the command line
+/// @retval Dist distribution
+static Dist parse_dist(const char *s)
+{
+  Dist d = { d_Const, 0, 0, 0 };
+
+  if (sscanf(s, "const:%lf", &d.a) == 1) d.kind = d_Const;
+  else if (sscanf(s, "uniform:%lf:%lf", &d.a, &d.b) == 2) d.kind = d_Uniform;
+  else if (sscanf(s, "exp:%lf", &d.a) == 1) d.kind = d_Exp;
+  else if (sscanf(s, "pow:%lf:%lf:%lf", &d.a, &d.b, &d.c) == 3) d.kind = d_Pow;
+  else {
+    fprintf(stderr, "Invalid distribution '%s'.\n", s);
+    exit(EXIT_FAILURE);
+  }
+
+  if (((d.kind == d_Uniform) || (d.kind == d_Pow)) && ((d.a <= 0) || (d.b < d.a))) {
+    fprintf(stderr, "Invalid range in distribution '%s'.\n", s);
+    exit(EXIT_FAILURE);
+  }
+  if ((d.kind == d_Pow) && (d.c <= 0)) {
+    fprintf(stderr, "Invalid exponent in distribution '%s'.\n", s);
+    exit(EXIT_FAILURE);
+  }
+
+  return d;
+}
+
+/// @brief draw from a distribution
+/// @param d distribution
+/// @param scale factor applied to the drawn value
+/// @retval value rounded to an integer, at least 1
+static unsigned long draw(Dist *d, double scale)
+{
+  double x = 0;
+
+  switch (d->kind) {
+    case d_Const:   x = d->a; break;
+    case d_Uniform: x = d->a + uniform() * (d->b - d->a + 1); break;
+    case d_Exp:     x = -d->a * log(1.0 - uniform()); break;
+    case d_Pow: {
+      // inverse of the CDF of the bounded Pareto distribution
+      double la = pow(d->a, -d->c), ha = pow(d->b, -d->c);
+      x = pow(la - uniform() * (la - ha), -1.0 / d->c);
+      break;
+    }
+  }
+
+  x *= scale;
+  return x < 1 ? 1 : (unsigned long)x;
+}
+
+/// @brief grow all arrays so that ids and counts up to @a n fit
+/// @param n number of entries
+static void reserve(size_t n)
+{
+  if (n <= capacity) return;
+
+  size_t c = capacity ? capacity : 1024;
+  while (c < n) c *= 2;
+
+  blocks  = realloc(blocks,  c*sizeof(Block));
+  live    = realloc(live,    c*sizeof(unsigned long));
+  freeids = realloc(freeids, c*sizeof(unsigned long));
+  deaths  = realloc(deaths,  c*sizeof(Death));
+  unsigned long *q = malloc(c*sizeof(unsigned long));
+  if (!blocks || !live || !freeids || !deaths || !q) fatal("cannot allocate tables");
+
+  // unwrap the ring buffer
+  for (size_t i = 0; i < qlen; i++) q[i] = queue[(qhead + i) % capacity];
+  free(queue);
+  queue = q;
+  qhead = 0;
+
+  capacity = c;
+}
+
+/// @brief push an entry onto the death queue
+/// @param d entry
+static void death_push(Death d)
+{
+  size_t i = ndeaths++;
+  while ((i > 0) && (deaths[(i-1)/2].death > d.death)) {
+    deaths[i] = deaths[(i-1)/2];
+    i = (i-1)/2;
+  }
+  deaths[i] = d;
+}
+
+/// @brief remove the earliest entry of the death queue
+/// @retval Death earliest entry
+static Death death_pop(void)
+{
+  Death top = deaths[0], last = deaths[--ndeaths];
+  size_t i = 0;
+
+  for (;;) {
+    size_t c = 2*i + 1;
+    if (c >= ndeaths) break;
+    if ((c + 1 < ndeaths) && (deaths[c+1].death < deaths[c].death)) c++;
+    if (deaths[c].death >= last.death) break;
+    deaths[i] = deaths[c];
+    i = c;
+  }
+  deaths[i] = last;
+  return top;
+}
+
+/// @brief emit an allocation of a new block
+/// @param size size in bytes
+/// @param calloc_prob probability that the block is allocated with calloc
+/// @retval id of the new block
+static unsigned long allocate(size_t size, double calloc_prob)
+{
+  reserve(nextid + 1);
+  unsigned long id = nfreeids > 0 ? freeids[--nfreeids] : nextid++;
+
+  blocks[id].size = size;
+  blocks[id].pos = nlive;
+  live[nlive++] = id;
+
+  if (uniform() < calloc_prob) {
+    if (size % 8 == 0) printf("c %lu %lu 8\n", id, size / 8);
+    else printf("c %lu 1 %lu\n", id, size);
+  } else {
+    printf("m %lu %lu\n", id, size);
+  }
+  return id;
+}
+
+/// @brief emit the release of a block
+/// @param id block id
+static void release(unsigned long id)
+{
+  size_t pos = blocks[id].pos;
+  live[pos] = live[--nlive];
+  blocks[live[pos]].pos = pos;
+  freeids[nfreeids++] = id;
+
+  printf("f %lu\n", id);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned long n = 10000, depth = 1000, seed = 1;
+  Dist size = parse_dist("pow:16:4096:1.5"), lifetime = parse_dist("exp:100");
+  Dist burst = parse_dist("uniform:1:64");
+  Pattern pattern = w_Lifetime;
+  unsigned int phases = 1;
+  double realloc_prob = 0, calloc_prob = 0;
+  const char *policy = "firstfit", *mode = "performance";
+  size_t dataseg = 0x10000000;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:l:w:q:b:P:r:c:S:p:m:d:")) != -1) {
+    switch (opt) {
+      case 'n': n = strtoul(optarg, NULL, 0); break;
+      case 's': size = parse_dist(optarg); break;
+      case 'l': lifetime = parse_dist(optarg); break;
+      case 'w':
+        if (strcmp(optarg, "lifetime") == 0) pattern = w_Lifetime;
+        else if (strcmp(optarg, "fifo") == 0) pattern = w_Fifo;
+        else if (strcmp(optarg, "lifo") == 0) pattern = w_Lifo;
+        else fatal("pattern must be lifetime, fifo, or lifo");
+        break;
+      case 'q': depth = strtoul(optarg, NULL, 0); break;
+      case 'b': burst = parse_dist(optarg); break;
+      case 'P': phases = atoi(optarg); break;
+      case 'r': realloc_prob = atof(optarg); break;
+      case 'c': calloc_prob = atof(optarg); break;
+      case 'S': seed = strtoul(optarg, NULL, 0); break;
+      case 'p': policy = optarg; break;
+      case 'm': mode = optarg; break;
+      case 'd': dataseg = strtoul(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr, "Usage: %s [-n allocations] [-s size] [-l lifetime] [-w pattern] "
+                        "[-q depth] [-b burst] [-P phases] [-r realloc] [-c calloc] [-S seed] "
+                        "[-p policy] [-m mode] [-d dataseg]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (phases < 1) phases = 1;
+  rng ^= seed * 0xbf58476d1ce4e5b9UL;
+  if (rng == 0) rng = 1;
+
+  // header: the command line reproduces the trace
+  printf("#\n# Generated by");
+  for (int i = 0; i < argc; i++) printf(" %s", argv[i]);
+  printf("\n#\n\ndataseg 0x%lx\nheap %s\n\nmode %s\n\nstart\n", dataseg, policy, mode);
+
+  unsigned long t = 0;
+  for (unsigned int p = 0; p < phases; p++) {
+    double sscale = 1, lscale = 1;
+    if (p > 0) {
+      sscale = ldexp(1.0, (int)(next_random() % 5) - 2);
+      lscale = ldexp(1.0, (int)(next_random() % 5) - 2);
+      printf("# phase %u: sizes x%g, lifetimes x%g\n", p, sscale, lscale);
+    }
+
+    unsigned long end = n * (p + 1) / phases;
+    while (t < end) {
+      // lifetime pattern: free the blocks whose lifetime has expired
+      while ((ndeaths > 0) && (deaths[0].death <= t)) release(death_pop().id);
+
+      // occasionally resize a live block
+      if ((nlive > 0) && (uniform() < realloc_prob)) {
+        unsigned long id = live[next_random() % nlive];
+        blocks[id].size = draw(&size, sscale);
+        printf("r %lu %lu\n", id, blocks[id].size);
+      }
+
+      if (pattern == w_Lifetime) {
+        unsigned long id = allocate(draw(&size, sscale), calloc_prob);
+        death_push((Death){ t + draw(&lifetime, lscale), id });
+        t++;
+      } else {
+        // producer: a burst of allocations
+        unsigned long b = draw(&burst, 1);
+        for (; (b > 0) && (t < end); b--, t++) {
+          unsigned long id = allocate(draw(&size, sscale), calloc_prob);
+          queue[(qhead + qlen++) % capacity] = id;
+        }
+
+        // consumer: bursts of frees while the queue is too long
+        unsigned long limit = (unsigned long)(depth * lscale);
+        while (qlen > limit) {
+          for (b = draw(&burst, 1); (b > 0) && (qlen > 0); b--) {
+            if (pattern == w_Fifo) {
+              release(queue[qhead]);
+              qhead = (qhead + 1) % capacity;
+              qlen--;
+            } else {
+              release(queue[(qhead + --qlen) % capacity]);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // free the remaining blocks in random order
+  while (nlive > 0) release(live[next_random() % nlive]);
+
+  printf("stop\n\nstat\n");
+
+  free(blocks);
+  free(live);
+  free(freeids);
+  free(deaths);
+  free(queue);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,996 @@
+//--------------------------------------------------------------------------------------------------
+// System Programming                       Memory Lab                                   Fall 2020
+//
+/// @file
+/// @brief trace replay driver for the dynamic memory manager
+//--------------------------------------------------------------------------------------------------
+
+// Trace replay driver
+// ===================
+// mm_replay executes the same scripts (tests/*.dmas) as the pre-compiled mm_driver and extends
+// them with the actions that mm_driver does not support.
+//
+// Usage: mm_replay [-j] [-p firstfit|nextfit|bestfit|segfit|buddy] [-t <trace>] [script]
+//   -j                               print statistics as one JSON object per line
+//   -p <policy>                      allocation policy; overrides the 'heap' command of the script
+//   -t <trace>                       record the calls of the memory manager (see mm_settrace())
+//                                    and write the last TRACE_SIZE events to file <trace> at the
+//                                    end; decode it with mm_tracedump
+//
+// Script format:
+// --------------
+// Empty lines and lines starting with '#' are ignored.
+//
+// Commands:
+//   dataseg <size>                   size of simulated data segment (default 0x4000000)
+//   heap firstfit|nextfit|bestfit|segfit|buddy
+//                                    allocation policy (default first fit)
+//   log ds|mm <level>                set log level of data segment / memory manager
+//   mode correctness|performance|debug
+//                                    correctness: payloads are filled and verified
+//                                    performance: payloads are not touched, actions are timed
+//                                    debug:       like correctness, print each action
+//   threads <n>                      number of replay threads (default 1). With more than one
+//                                    thread, the heap is made thread-safe by 'start'
+//   batch on|off                     on:  batch actions call mm_malloc_batch / mm_free_batch
+//                                    off: batch actions loop over mm_malloc / mm_free
+//   latency on|off                   on:  time every malloc/calloc/realloc/free call (default)
+//                                    off: time only the replay as a whole
+//   reset                            clear statistics
+//   start                            initialize the heap and begin recording actions
+//   stop                             replay the recorded actions
+//   stat                             print statistics
+//   quit                             stop processing the script
+//
+// Actions (between start and stop):
+//   m <id> <size>                    id = mm_malloc(size)
+//   c <id> <nelem> <size>            id = mm_calloc(nelem, size)
+//   r <id> <size>                    id = mm_realloc(id, size)
+//   f <id>                           mm_free(id)
+//   v                                mm_check()
+//   t                                mm_trim(), print resident bytes before and after
+//   M <id> <count> <size>            ids id...id+count-1 = mm_malloc_batch(size, count)
+//   F <id> <count>                   mm_free_batch(ids id...id+count-1)
+//   b                                barrier: all threads wait until every thread has reached it
+//
+// Multi-threaded scripts:
+// -----------------------
+// An action prefixed with '@<tid>' is executed by thread <tid> (0 <= tid < n); actions without a
+// prefix belong to thread 0. The threads replay their actions concurrently and synchronize only
+// at barriers. A block may be used by several threads, e.g., allocated by one and freed by
+// another, but between two barriers all actions on a block must belong to the same thread. This
+// is checked while the script is parsed, so the replay is free of races on the blocks. For each
+// thread, the throughput is its number of actions divided by the time from the start of the
+// replay until it completed its last action; the aggregate throughput uses the time until all
+// threads are done. With one thread, the actions of all threads are replayed in the order of
+// the script and barriers have no effect; this is the baseline for the same script.
+//
+// The actions are parsed completely before they are replayed so that the time reported in
+// performance mode does not include parsing the script. Every block of a batch action counts as
+// one action, so the performance of a script with batch on and off can be compared directly.
+//
+// Statistics:
+// -----------
+// With latency on, every call to mm_malloc(), mm_calloc(), mm_realloc() and mm_free() is timed
+// with CLOCK_MONOTONIC and recorded in a histogram per function. The buckets are exact up to
+// 2^(LAT_SUB+1) ns; above, every power of two is split into 2^LAT_SUB buckets, i.e., a reported
+// percentile is at most 6.25% above the actual value. Batch actions are not included. Timing
+// adds two clock reads per call; switch it off to compare throughput only.
+//
+// The driver also keeps track of the live payload, i.e., the sum of the sizes of all allocated
+// blocks. The peak utilization is the largest live payload divided by the largest footprint of
+// the heap (heap area plus mapped regions, see ds_peak_stat()); expansions counts how often the
+// footprint was enlarged. Both refer to the heap set up by the last 'start' command.
+// The free blocks and the fragmentation indices are taken from mm_stats() at the time of 'stat'.
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dataseg.h"
+#include "memmgr.h"
+
+
+/// @brief execution modes
+typedef enum {
+  m_Correctness,                  ///< fill and verify payloads
+  m_Performance,                  ///< time actions, do not touch payloads
+  m_Debug,                        ///< like correctness and print each action
+} Mode;
+
+/// @brief action types
+typedef enum {
+  a_Malloc,                       ///< mm_malloc()
+  a_Calloc,                       ///< mm_calloc()
+  a_Realloc,                      ///< mm_realloc()
+  a_Free,                         ///< mm_free()
+  a_Check,                        ///< mm_check()
+  a_Trim,                         ///< mm_trim()
+  a_MallocBatch,                  ///< mm_malloc_batch()
+  a_FreeBatch,                    ///< mm_free_batch()
+  a_Barrier,                      ///< barrier of all threads
+} ActionType;
+
+/// @brief one action of a trace
+typedef struct {
+  ActionType type;                ///< action type
+  unsigned int tid;               ///< thread executing the action
+  unsigned long id;               ///< block id
+  size_t nelem;                   ///< number of elements (calloc) or blocks (batch actions)
+  size_t size;                    ///< size in bytes
+} Action;
+
+/// @brief a block allocated by the trace
+typedef struct {
+  void *ptr;                      ///< payload or NULL
+  size_t size;                    ///< payload size
+  unsigned int tid;               ///< thread of the last action on the block (while parsing)
+  unsigned long epoch;            ///< barrier epoch of the last action + 1, 0 if unused
+} Slot;
+
+#define LAT_SUB     4                                 ///< log2 of buckets per power of two
+#define LAT_BUCKETS ((64 - LAT_SUB + 1) << LAT_SUB)   ///< number of histogram buckets
+
+/// @brief latency histogram of one function
+typedef struct {
+  unsigned long count;            ///< number of calls
+  unsigned long sum;              ///< total latency (ns)
+  unsigned long max;              ///< largest latency (ns)
+  unsigned long bucket[LAT_BUCKETS]; ///< number of calls per latency bucket
+} Histogram;
+
+/// @brief replay statistics
+typedef struct {
+  unsigned long actions;          ///< total number of actions
+  unsigned long malloc;           ///< number of mm_malloc() actions
+  unsigned long calloc;           ///< number of mm_calloc() actions
+  unsigned long realloc;          ///< number of mm_realloc() actions
+  unsigned long free;             ///< number of mm_free() actions
+  unsigned long errors;           ///< number of errors
+  struct timespec time;           ///< replay time
+  Histogram latency[a_Free+1];    ///< latencies of malloc, calloc, realloc and free
+} Stats;
+
+/// @brief a replay thread
+typedef struct {
+  pthread_t thread;               ///< thread handle
+  unsigned int tid;               ///< thread index
+  Action **actions;               ///< actions of the thread
+  size_t nactions;                ///< number of actions
+} Thread;
+
+#define MAX_THREADS 64                               ///< largest number of replay threads
+#define TRACE_SIZE  (1UL << 20)                      ///< number of events kept by the trace
+
+
+static size_t           dataseg_size = 0x4000000;    ///< size of simulated data segment
+static AllocationPolicy policy       = ap_FirstFit;  ///< allocation policy
+static Mode             mode         = m_Correctness;///< execution mode
+static int              batch        = 1;            ///< use the batch functions for batch actions
+static int              latency      = 1;            ///< time individual calls
+static unsigned int     nthreads     = 1;            ///< number of replay threads
+static int              json         = 0;            ///< print statistics as JSON
+static int              fixed_policy = 0;            ///< policy set on the command line
+static const char       *script      = "-";          ///< name of the script
+static const char       *trace_file  = NULL;         ///< file of the event trace (-t)
+
+static Action *actions   = NULL;                     ///< recorded actions
+static size_t nactions   = 0;                        ///< number of recorded actions
+static size_t maxactions = 0;                        ///< capacity of actions
+
+static Slot   *slots     = NULL;                     ///< blocks indexed by id
+static size_t nslots     = 0;                        ///< capacity of slots
+static unsigned int  cur_tid = 0;                    ///< thread of the action being parsed
+static unsigned long epoch   = 0;                    ///< number of barriers parsed since start
+
+static __thread Stats stats;                         ///< statistics of the thread. The main
+                                                     ///< thread's hold the totals
+static Stats  *total;                                ///< statistics of the main thread
+static pthread_mutex_t total_lock = PTHREAD_MUTEX_INITIALIZER; ///< protects *total
+static pthread_barrier_t start_barrier;              ///< start of the replay threads
+static pthread_barrier_t barrier;                    ///< barrier actions of the replay threads
+static unsigned long thread_actions[MAX_THREADS];    ///< actions per thread
+static unsigned long thread_ns[MAX_THREADS];         ///< replay time per thread (ns)
+
+static size_t live;                                  ///< payload bytes currently allocated
+static size_t peak_live;                             ///< largest value of live
+
+static __thread void **batch_ptrs = NULL;            ///< pointers of a batch action
+static __thread size_t nbatch_ptrs = 0;              ///< capacity of batch_ptrs
+
+static const char *policy_names[] = { "firstfit", "nextfit", "bestfit", "segfit", "buddy" };
+static const char *mode_names[]   = { "correctness", "performance", "debug" };
+static const char *op_names[]     = { "malloc", "calloc", "realloc", "free" };
+
+
+/// @brief print error message and terminate process
+/// @param msg error message
+static void fatal(const char *msg)
+{
+  fprintf(stderr, "ERROR: %s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+/// @brief read the monotonic clock
+/// @retval time in ns
+static unsigned long clock_ns(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+/// @brief map a latency to its histogram bucket
+/// @param ns latency
+/// @retval bucket index
+static unsigned int lat_bucket(unsigned long ns)
+{
+  if (ns < (2UL << LAT_SUB)) return ns;
+
+  int e = 63 - __builtin_clzl(ns);                     // ns in [2^e, 2^(e+1))
+  return ((e - LAT_SUB + 1) << LAT_SUB) + (ns >> (e - LAT_SUB)) - (1UL << LAT_SUB);
+}
+
+/// @brief smallest latency that maps to a histogram bucket
+/// @param b bucket index
+/// @retval latency in ns
+static unsigned long lat_value(unsigned int b)
+{
+  if (b < (2U << LAT_SUB)) return b;
+
+  int e = (b >> LAT_SUB) + LAT_SUB - 1;
+  return ((b & ((1U << LAT_SUB) - 1)) + (1UL << LAT_SUB)) << (e - LAT_SUB);
+}
+
+/// @brief record the latency of a call that started at @a t0
+/// @param type action type (a_Malloc...a_Free)
+/// @param t0 start time returned by clock_ns()
+static void sample(ActionType type, unsigned long t0)
+{
+  unsigned long ns = clock_ns() - t0;
+  Histogram *h = &stats.latency[type];
+
+  h->count++;
+  h->sum += ns;
+  if (ns > h->max) h->max = ns;
+  h->bucket[lat_bucket(ns)]++;
+}
+
+/// @brief compute a percentile of a latency histogram
+/// @param h histogram
+/// @param q quantile (0 < q <= 1)
+/// @retval upper bound of the bucket holding the percentile, at most the largest latency
+static unsigned long percentile(Histogram *h, double q)
+{
+  unsigned long rank = (unsigned long)(q * h->count + 0.999999), seen = 0;
+
+  for (unsigned int b = 0; b < LAT_BUCKETS; b++) {
+    seen += h->bucket[b];
+    if ((seen >= rank) && (seen > 0)) {
+      unsigned long v = b + 1 < LAT_BUCKETS ? lat_value(b + 1) - 1 : h->max;
+      return v < h->max ? v : h->max;
+    }
+  }
+  return 0;
+}
+
+/// @brief adjust the live payload by @a delta bytes
+/// @param delta change in bytes
+static void account(long delta)
+{
+  if (nthreads == 1) {
+    live += delta;
+    if (live > peak_live) peak_live = live;
+    return;
+  }
+
+  size_t l = __atomic_add_fetch(&live, delta, __ATOMIC_RELAXED);
+  size_t p = __atomic_load_n(&peak_live, __ATOMIC_RELAXED);
+  while ((l > p) &&
+         !__atomic_compare_exchange_n(&peak_live, &p, l, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/// @brief get the slot of block @a id, growing the slot table as necessary
+/// @param id block id
+/// @retval Slot* slot of block @a id
+static Slot* get_slot(unsigned long id)
+{
+  if (id >= nslots) {
+    size_t n = nslots ? nslots : 1024;
+    while (n <= id) n *= 2;
+    slots = realloc(slots, n*sizeof(Slot));
+    if (slots == NULL) fatal("cannot allocate slot table");
+    memset(&slots[nslots], 0, (n-nslots)*sizeof(Slot));
+    nslots = n;
+  }
+  return &slots[id];
+}
+
+/// @brief append an action to the list of recorded actions
+/// @param a action
+static void record(Action a)
+{
+  a.tid = cur_tid;
+
+  if (a.type == a_Barrier) {
+    epoch++;
+  } else if ((a.type <= a_Free) || (a.type == a_MallocBatch) || (a.type == a_FreeBatch)) {
+    // between two barriers, a block must not be used by more than one thread
+    size_t n = (a.type == a_MallocBatch) || (a.type == a_FreeBatch) ? a.nelem : 1;
+    Slot *s = get_slot(a.id + n - 1) - (n - 1);
+    for (size_t i = 0; i < n; i++) {
+      if ((s[i].epoch == epoch + 1) && (s[i].tid != a.tid)) {
+        printf("Invalid action of thread %u: block %lu is used by thread %u since the last "
+               "barrier.\n", a.tid, a.id + i, s[i].tid);
+        stats.errors++;
+        return;
+      }
+    }
+    for (size_t i = 0; i < n; i++) {
+      s[i].tid = a.tid;
+      s[i].epoch = epoch + 1;
+    }
+  }
+
+  if (nactions == maxactions) {
+    maxactions = maxactions ? 2*maxactions : 1024;
+    actions = realloc(actions, maxactions*sizeof(Action));
+    if (actions == NULL) fatal("cannot allocate action list");
+  }
+  actions[nactions++] = a;
+}
+
+/// @brief fill the payload of block @a id with a pattern derived from its id
+/// @param id block id
+/// @param s slot of block
+/// @param from first byte to fill
+static void fill(unsigned long id, Slot *s, size_t from)
+{
+  unsigned char *p = s->ptr;
+  for (size_t i = from; i < s->size; i++) p[i] = (unsigned char)(id + i);
+}
+
+/// @brief verify the first @a len bytes of the payload of block @a id
+/// @param id block id
+/// @param s slot of block
+/// @param len number of bytes to verify
+/// @retval 1 if the payload is intact
+/// @retval 0 otherwise
+static int verify(unsigned long id, Slot *s, size_t len)
+{
+  unsigned char *p = s->ptr;
+  for (size_t i = 0; i < len; i++) {
+    if (p[i] != (unsigned char)(id + i)) {
+      printf("ERROR: payload of block %lu (%p) corrupted at offset %lu.\n", id, s->ptr, i);
+      stats.errors++;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/// @brief check that the payload of block @a id lies within the heap or outside the data segment
+/// @param id block id
+/// @param s slot of block
+static void check_bounds(unsigned long id, Slot *s)
+{
+  void *start, *brk, *end;
+  ds_heap_stat(&start, &brk, &end);
+
+  // blocks outside of the heap area live in separate mapped regions
+  if ((s->ptr + s->size <= start) || (s->ptr >= end)) return;
+
+  if ((s->ptr < start) || (s->ptr + s->size > brk)) {
+    printf("ERROR: block %lu (%p) lies outside valid heap area [%p...%p).\n",
+           id, s->ptr, start, brk);
+    stats.errors++;
+  }
+}
+
+/// @brief execute a batch action on blocks a->id...a->id+a->nelem-1
+/// @param a action
+static void execute_batch(Action *a)
+{
+  int check = mode != m_Performance;
+  size_t n = a->nelem;
+
+  if (n > nbatch_ptrs) {
+    nbatch_ptrs = n;
+    batch_ptrs = realloc(batch_ptrs, n*sizeof(void*));
+    if (batch_ptrs == NULL) fatal("cannot allocate batch");
+  }
+  get_slot(a->id + n - 1);                             // grow the slot table once
+  Slot *s = &slots[a->id];
+
+  stats.actions += n - 1;                              // execute() counted one
+  if (a->type == a_MallocBatch) {
+    stats.malloc += n;
+    size_t done = 0;
+    if (batch) {
+      done = mm_malloc_batch(a->size, n, batch_ptrs);
+    } else {
+      while ((done < n) && ((batch_ptrs[done] = mm_malloc(a->size)) != NULL)) done++;
+    }
+    if (done < n) printf("Warning: allocation of %lu of %lu blocks failed.\n", n - done, n);
+
+    account(done * a->size);
+    for (size_t i = 0; i < done; i++) {
+      if (s[i].ptr != NULL) printf("Warning: overwriting block with id %lu.\n", a->id + i);
+      s[i].ptr = batch_ptrs[i];
+      s[i].size = a->size;
+      if (check) {
+        check_bounds(a->id + i, &s[i]);
+        fill(a->id + i, &s[i], 0);
+      }
+    }
+  } else {
+    stats.free += n;
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (s[i].ptr == NULL) {
+        printf("Warning: double-free detected.\n");
+        continue;
+      }
+      if (check) verify(a->id + i, &s[i], s[i].size);
+      account(-(long)s[i].size);
+      batch_ptrs[k++] = s[i].ptr;
+      s[i].ptr = NULL;
+    }
+    if (batch) mm_free_batch(batch_ptrs, k);
+    else for (size_t i = 0; i < k; i++) mm_free(batch_ptrs[i]);
+  }
+}
+
+/// @brief execute a single action
+/// @param a action
+static void execute(Action *a)
+{
+  int check = mode != m_Performance;
+  Slot *s = (a->type <= a_Free) ? get_slot(a->id) : NULL;
+  unsigned long t0;
+
+  if (mode == m_Debug) {
+    char tid[16] = "";
+    if (nthreads > 1) snprintf(tid, sizeof(tid), "@%u ", a->tid);
+    switch (a->type) {
+      case a_Malloc:  printf("Action: %sm %lu %lu\n", tid, a->id, a->size); break;
+      case a_Calloc:  printf("Action: %sc %lu %lu %lu\n", tid, a->id, a->nelem, a->size); break;
+      case a_Realloc: printf("Action: %sr %lu %lu\n", tid, a->id, a->size); break;
+      case a_Free:    printf("Action: %sf %lu\n", tid, a->id); break;
+      case a_Check:   printf("Action: %sv\n", tid); break;
+      case a_Trim:    printf("Action: %st\n", tid); break;
+      case a_MallocBatch: printf("Action: %sM %lu %lu %lu\n", tid, a->id, a->nelem, a->size); break;
+      case a_FreeBatch:   printf("Action: %sF %lu %lu\n", tid, a->id, a->nelem); break;
+      case a_Barrier:     printf("Action: b\n"); break;
+    }
+  }
+  if (a->type == a_Barrier) return;                    // synchronized by the replay loop
+
+  stats.actions++;
+  switch (a->type) {
+    case a_Malloc:
+    case a_Calloc:
+      if (s->ptr != NULL) printf("Warning: overwriting block with id %lu.\n", a->id);
+      t0 = latency ? clock_ns() : 0;
+      if (a->type == a_Malloc) {
+        stats.malloc++;
+        s->ptr = mm_malloc(a->size);
+        s->size = a->size;
+      } else {
+        stats.calloc++;
+        s->ptr = mm_calloc(a->nelem, a->size);
+        s->size = a->nelem * a->size;
+      }
+      if (latency) sample(a->type, t0);
+      if (s->ptr == NULL) {
+        printf("Warning: allocation of %lu bytes failed.\n", s->size);
+        break;
+      }
+      account(s->size);
+      if (check) {
+        check_bounds(a->id, s);
+        if (a->type == a_Calloc) {
+          for (size_t i = 0; i < s->size; i++) {
+            if (((unsigned char*)s->ptr)[i] != 0) {
+              printf("ERROR: calloc'ed block %lu not zeroed at offset %lu.\n", a->id, i);
+              stats.errors++;
+              break;
+            }
+          }
+        }
+        fill(a->id, s, 0);
+      }
+      break;
+
+    case a_Realloc: {
+      stats.realloc++;
+      size_t keep = s->size < a->size ? s->size : a->size;
+      if (check && (s->ptr != NULL)) verify(a->id, s, s->size);
+      t0 = latency ? clock_ns() : 0;
+      void *ptr = mm_realloc(s->ptr, a->size);
+      if (latency) sample(a_Realloc, t0);
+      if ((ptr == NULL) && (a->size > 0)) {
+        printf("Warning: mm_realloc(%p, %lu) failed.\n", s->ptr, a->size);
+        break;
+      }
+      account((ptr != NULL ? (long)a->size : 0) - (long)(s->ptr != NULL ? s->size : 0));
+      s->ptr = ptr;
+      s->size = a->size;
+      if (check && (ptr != NULL)) {
+        check_bounds(a->id, s);
+        verify(a->id, s, keep);
+        fill(a->id, s, keep);
+      }
+      break;
+    }
+
+    case a_Free:
+      stats.free++;
+      if (s->ptr == NULL) {
+        printf("Warning: double-free detected.\n");
+        break;
+      }
+      if (check) verify(a->id, s, s->size);
+      account(-(long)s->size);
+      t0 = latency ? clock_ns() : 0;
+      mm_free(s->ptr);
+      if (latency) sample(a_Free, t0);
+      s->ptr = NULL;
+      break;
+
+    case a_Check:
+      mm_check();
+      break;
+
+    case a_Trim: {
+      size_t before = ds_resident();
+      size_t released = mm_trim();
+      printf("mm_trim: released %lu bytes, resident %lu -> %lu bytes\n", released, before,
+             ds_resident());
+      break;
+    }
+
+    case a_MallocBatch:
+    case a_FreeBatch:
+      execute_batch(a);
+      break;
+
+    case a_Barrier:
+      break;
+  }
+}
+
+/// @brief add the time between @a start and @a end to the replay time
+/// @param start start time
+/// @param end end time
+static void add_time(struct timespec *start, struct timespec *end)
+{
+  stats.time.tv_sec += end->tv_sec - start->tv_sec;
+  stats.time.tv_nsec += end->tv_nsec - start->tv_nsec;
+  while (stats.time.tv_nsec < 0) { stats.time.tv_nsec += 1000000000; stats.time.tv_sec--; }
+  while (stats.time.tv_nsec >= 1000000000) { stats.time.tv_nsec -= 1000000000; stats.time.tv_sec++; }
+}
+
+/// @brief add the statistics of a replay thread to the totals
+/// @param t statistics of the thread
+static void merge(Stats *t)
+{
+  pthread_mutex_lock(&total_lock);
+  total->actions += t->actions;
+  total->malloc  += t->malloc;
+  total->calloc  += t->calloc;
+  total->realloc += t->realloc;
+  total->free    += t->free;
+  total->errors  += t->errors;
+  for (int i = a_Malloc; i <= a_Free; i++) {
+    Histogram *d = &total->latency[i], *h = &t->latency[i];
+    d->count += h->count;
+    d->sum   += h->sum;
+    if (h->max > d->max) d->max = h->max;
+    for (unsigned int b = 0; b < LAT_BUCKETS; b++) d->bucket[b] += h->bucket[b];
+  }
+  pthread_mutex_unlock(&total_lock);
+}
+
+/// @brief replay thread. Executes the actions of one thread of the script.
+/// @param arg Thread
+/// @retval NULL
+static void* worker(void *arg)
+{
+  Thread *t = arg;
+
+  pthread_barrier_wait(&start_barrier);
+  unsigned long t0 = clock_ns();
+
+  for (size_t i = 0; i < t->nactions; i++) {
+    execute(t->actions[i]);
+    if (t->actions[i]->type == a_Barrier) pthread_barrier_wait(&barrier);
+  }
+
+  thread_ns[t->tid] += clock_ns() - t0;
+  thread_actions[t->tid] += stats.actions;
+  merge(&stats);
+  free(batch_ptrs);
+
+  return NULL;
+}
+
+/// @brief replay the recorded actions with nthreads threads
+static void replay_threads(void)
+{
+  Thread threads[MAX_THREADS] = { { 0 } };
+
+  // distribute the actions; barriers belong to all threads
+  for (size_t i = 0; i < nactions; i++) {
+    for (unsigned int t = 0; t < nthreads; t++) {
+      if ((actions[i].type == a_Barrier) || (actions[i].tid == t)) threads[t].nactions++;
+    }
+  }
+  for (unsigned int t = 0; t < nthreads; t++) {
+    threads[t].tid = t;
+    threads[t].actions = malloc(threads[t].nactions*sizeof(Action*));
+    if (threads[t].actions == NULL) fatal("cannot allocate action list");
+    threads[t].nactions = 0;
+  }
+  for (size_t i = 0; i < nactions; i++) {
+    for (unsigned int t = 0; t < nthreads; t++) {
+      if ((actions[i].type == a_Barrier) || (actions[i].tid == t)) {
+        threads[t].actions[threads[t].nactions++] = &actions[i];
+      }
+    }
+  }
+
+  struct timespec start, end;
+  total = &stats;
+  pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+  pthread_barrier_init(&barrier, NULL, nthreads);
+  for (unsigned int t = 0; t < nthreads; t++) {
+    if (pthread_create(&threads[t].thread, NULL, worker, &threads[t]) != 0) {
+      fatal("cannot create replay thread");
+    }
+  }
+
+  pthread_barrier_wait(&start_barrier);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned int t = 0; t < nthreads; t++) pthread_join(threads[t].thread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_barrier_destroy(&start_barrier);
+  pthread_barrier_destroy(&barrier);
+  for (unsigned int t = 0; t < nthreads; t++) free(threads[t].actions);
+
+  add_time(&start, &end);
+}
+
+/// @brief replay all recorded actions
+static void replay(void)
+{
+  struct timespec start, end;
+
+  if (nthreads > 1) {
+    replay_threads();
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < nactions; i++) execute(&actions[i]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    add_time(&start, &end);
+  }
+
+  nactions = 0;
+}
+
+/// @brief print statistics as text
+static void print_text(void)
+{
+  double t = stats.time.tv_sec + stats.time.tv_nsec / 1e9;
+  unsigned long calls, nsec, expansions;
+  size_t peak;
+  struct mm_stats st;
+  ds_sbrk_stat(&calls, &nsec);
+  ds_peak_stat(&peak, &expansions);
+  mm_stats(&st);
+
+  printf("--------------------------------------------\n"
+         "Statistics:\n"
+         "  actions:          %6lu\n"
+         "    malloc:         %6lu\n"
+         "    calloc:         %6lu\n"
+         "    realloc:        %6lu\n"
+         "    free:           %6lu\n"
+         "  errors:           %6lu\n"
+         "  resident:         %6lu bytes\n"
+         "  sbrk calls:       %6lu (%.2f per million actions)\n"
+         "  sbrk time:        %lu.%09lu sec\n"
+         "  expansions:       %6lu\n"
+         "  peak live:        %6lu bytes\n"
+         "  peak footprint:   %6lu bytes\n"
+         "  utilization:      %6.2f%%\n"
+         "  free blocks:      %6lu (%lu bytes, largest %lu bytes)\n"
+         "  fragmentation:    %6.2f%% external, %.2f%% internal\n"
+         "  time:             %lu.%09lu sec\n"
+         "  \n"
+         "  performance:      %.2f kops/sec\n",
+         stats.actions, stats.malloc, stats.calloc, stats.realloc, stats.free, stats.errors,
+         ds_resident(),
+         calls, stats.actions > 0 ? calls * 1e6 / stats.actions : 0.0,
+         nsec / 1000000000, nsec % 1000000000,
+         expansions, peak_live, peak, peak > 0 ? 100.0 * peak_live / peak : 0.0,
+         st.free_blocks, st.free_bytes, st.largest_free,
+         100.0 * st.external_frag, 100.0 * st.internal_frag,
+         stats.time.tv_sec, stats.time.tv_nsec, t > 0 ? stats.actions / t / 1000 : 0.0);
+
+  if (nthreads > 1) {
+    printf("  \n"
+           "  thread             actions     time (sec)      kops/sec\n");
+    for (unsigned int i = 0; i < nthreads; i++) {
+      printf("    %-10u %11lu %14.9f %13.2f\n", i, thread_actions[i], thread_ns[i] / 1e9,
+             thread_ns[i] > 0 ? thread_actions[i] * 1e6 / thread_ns[i] : 0.0);
+    }
+  }
+
+  const char *header = "  \n"
+                       "  latency (ns)        calls     mean      p50      p99    p99.9      max\n";
+  for (int i = a_Malloc; (i <= a_Free) && latency; i++) {
+    Histogram *h = &stats.latency[i];
+    if (h->count == 0) continue;
+    printf("%s", header);
+    header = "";
+    printf("    %-10s %11lu %8lu %8lu %8lu %8lu %8lu\n", op_names[i], h->count, h->sum / h->count,
+           percentile(h, 0.5), percentile(h, 0.99), percentile(h, 0.999), h->max);
+  }
+
+  printf("--------------------------------------------\n");
+}
+
+/// @brief print statistics as one JSON object on a single line
+static void print_json(void)
+{
+  double t = stats.time.tv_sec + stats.time.tv_nsec / 1e9;
+  unsigned long calls, nsec, expansions;
+  size_t peak;
+  struct mm_stats st;
+  ds_sbrk_stat(&calls, &nsec);
+  ds_peak_stat(&peak, &expansions);
+  mm_stats(&st);
+
+  printf("{\"script\":\"%s\",\"policy\":\"%s\",\"mode\":\"%s\",\"batch\":%d,\"threads\":%u,"
+         "\"actions\":%lu,\"malloc\":%lu,\"calloc\":%lu,\"realloc\":%lu,\"free\":%lu,"
+         "\"errors\":%lu,\"resident\":%lu,\"sbrk_calls\":%lu,\"sbrk_ns\":%lu,\"expansions\":%lu,"
+         "\"peak_live\":%lu,\"peak_footprint\":%lu,\"utilization\":%.4f,"
+         "\"free_blocks\":%lu,\"free_bytes\":%lu,\"largest_free\":%lu,"
+         "\"external_frag\":%.4f,\"internal_frag\":%.4f,"
+         "\"time_ns\":%lu,\"kops\":%.2f,\"latency\":{",
+         script, policy_names[policy], mode_names[mode], batch, nthreads,
+         stats.actions, stats.malloc, stats.calloc, stats.realloc, stats.free,
+         stats.errors, ds_resident(), calls, nsec, expansions,
+         peak_live, peak, peak > 0 ? (double)peak_live / peak : 0.0,
+         st.free_blocks, st.free_bytes, st.largest_free, st.external_frag, st.internal_frag,
+         stats.time.tv_sec * 1000000000UL + stats.time.tv_nsec,
+         t > 0 ? stats.actions / t / 1000 : 0.0);
+
+  const char *sep = "";
+  for (int i = a_Malloc; (i <= a_Free) && latency; i++) {
+    Histogram *h = &stats.latency[i];
+    if (h->count == 0) continue;
+    printf("%s\"%s\":{\"count\":%lu,\"mean\":%lu,\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}",
+           sep, op_names[i], h->count, h->sum / h->count,
+           percentile(h, 0.5), percentile(h, 0.99), percentile(h, 0.999), h->max);
+    sep = ",";
+  }
+  printf("},\"thread\":[");
+  for (unsigned int i = 0; (i < nthreads) && (nthreads > 1); i++) {
+    printf("%s{\"actions\":%lu,\"time_ns\":%lu,\"kops\":%.2f}", i > 0 ? "," : "",
+           thread_actions[i], thread_ns[i],
+           thread_ns[i] > 0 ? thread_actions[i] * 1e6 / thread_ns[i] : 0.0);
+  }
+  printf("]}\n");
+}
+
+/// @brief print statistics
+static void print_stats(void)
+{
+  if (json) print_json();
+  else print_text();
+}
+
+/// @brief parse an allocation policy name
+/// @param name policy name
+/// @retval AllocationPolicy policy
+static AllocationPolicy parse_policy(const char *name)
+{
+  if (strcmp(name, "firstfit") == 0) return ap_FirstFit;
+  if (strcmp(name, "nextfit") == 0) return ap_NextFit;
+  if (strcmp(name, "bestfit") == 0) return ap_BestFit;
+  if (strcmp(name, "segfit") == 0) return ap_SegregatedFit;
+  if (strcmp(name, "buddy") == 0) return ap_Buddy;
+
+  printf("Invalid allocation policy '%s'. Defaulting to first fit.\n", name);
+  return ap_FirstFit;
+}
+
+/// @brief parse and execute one line of a script
+/// @param line script line
+/// @retval 0 to continue, 1 to stop processing the script
+static int process(char *line)
+{
+  static int started = 0;
+  char cmd[32], arg[32];
+  unsigned long id;
+  size_t size, nelem;
+  int level;
+
+  line[strcspn(line, "\r\n")] = '\0';
+  if ((line[0] == '\0') || (line[0] == '#') || (sscanf(line, "%31s", cmd) != 1)) return 0;
+
+  if (started) {
+    // thread prefix
+    cur_tid = 0;
+    if (cmd[0] == '@') {
+      int n = 0;
+      unsigned int max = nthreads > 1 ? nthreads : MAX_THREADS;
+      if ((sscanf(line, "@%u %n", &cur_tid, &n) != 1) || (cur_tid >= max) || (n == 0)) {
+        printf("Invalid thread in '%s'.\n", line);
+        return 0;
+      }
+      line += n;
+      if (sscanf(line, "%31s", cmd) != 1) cmd[0] = '\0';
+    }
+
+    // actions
+    if (strcmp(cmd, "m") == 0) {
+      if (sscanf(line, "m %lu %li", &id, &size) != 2) printf("Invalid malloc action: '%s'.\n", line);
+      else record((Action){ .type = a_Malloc, .id = id, .size = size });
+    } else if (strcmp(cmd, "c") == 0) {
+      if (sscanf(line, "c %lu %li %li", &id, &nelem, &size) != 3) {
+        printf("Invalid calloc action: '%s'.\n", line);
+      } else {
+        record((Action){ .type = a_Calloc, .id = id, .nelem = nelem, .size = size });
+      }
+    } else if (strcmp(cmd, "r") == 0) {
+      if (sscanf(line, "r %lu %li", &id, &size) != 2) printf("Invalid realloc action: '%s'.\n", line);
+      else record((Action){ .type = a_Realloc, .id = id, .size = size });
+    } else if (strcmp(cmd, "f") == 0) {
+      if (sscanf(line, "f %lu", &id) != 1) printf("Invalid free action: '%s'.\n", line);
+      else record((Action){ .type = a_Free, .id = id });
+    } else if (strcmp(cmd, "v") == 0) {
+      record((Action){ .type = a_Check });
+    } else if (strcmp(cmd, "t") == 0) {
+      record((Action){ .type = a_Trim });
+    } else if (strcmp(cmd, "b") == 0) {
+      record((Action){ .type = a_Barrier });
+    } else if (strcmp(cmd, "M") == 0) {
+      if ((sscanf(line, "M %lu %li %li", &id, &nelem, &size) != 3) || (nelem == 0)) {
+        printf("Invalid malloc batch action: '%s'.\n", line);
+      } else {
+        record((Action){ .type = a_MallocBatch, .id = id, .nelem = nelem, .size = size });
+      }
+    } else if (strcmp(cmd, "F") == 0) {
+      if ((sscanf(line, "F %lu %li", &id, &nelem) != 2) || (nelem == 0)) {
+        printf("Invalid free batch action: '%s'.\n", line);
+      } else {
+        record((Action){ .type = a_FreeBatch, .id = id, .nelem = nelem });
+      }
+    } else if (strcmp(cmd, "stop") == 0) {
+      replay();
+      started = 0;
+    } else {
+      printf("Invalid action: %s\n", line);
+    }
+    return 0;
+  }
+
+  // commands
+  if (strcmp(cmd, "dataseg") == 0) {
+    if (sscanf(line, "dataseg %li", &size) != 1) printf("Invalid size in '%s' command.\n", cmd);
+    else dataseg_size = size;
+  } else if (strcmp(cmd, "heap") == 0) {
+    if ((sscanf(line, "heap %31s", arg) == 1) && !fixed_policy) policy = parse_policy(arg);
+  } else if (strcmp(cmd, "log") == 0) {
+    if (sscanf(line, "log %31s %d", arg, &level) != 2) printf("Invalid options in 'log' command.\n");
+    else if (strcmp(arg, "ds") == 0) ds_setloglevel(level);
+    else if (strcmp(arg, "mm") == 0) mm_setloglevel(level);
+    else printf("Invalid entity '%s' in 'log' command.\n", arg);
+  } else if (strcmp(cmd, "mode") == 0) {
+    if (sscanf(line, "mode %31s", arg) != 1) arg[0] = '\0';
+    if (strcmp(arg, "correctness") == 0) mode = m_Correctness;
+    else if (strcmp(arg, "performance") == 0) mode = m_Performance;
+    else if (strcmp(arg, "debug") == 0) mode = m_Debug;
+    else printf("Invalid execution mode '%s'. Defaulting to correctness mode.\n", arg);
+  } else if (strcmp(cmd, "batch") == 0) {
+    if (sscanf(line, "batch %31s", arg) != 1) arg[0] = '\0';
+    if (strcmp(arg, "on") == 0) batch = 1;
+    else if (strcmp(arg, "off") == 0) batch = 0;
+    else printf("Invalid option '%s' in 'batch' command.\n", arg);
+  } else if (strcmp(cmd, "threads") == 0) {
+    unsigned int n;
+    if ((sscanf(line, "threads %u", &n) != 1) || (n < 1) || (n > MAX_THREADS)) {
+      printf("Invalid number of threads in '%s' (1...%d).\n", line, MAX_THREADS);
+    } else {
+      nthreads = n;
+    }
+  } else if (strcmp(cmd, "latency") == 0) {
+    if (sscanf(line, "latency %31s", arg) != 1) arg[0] = '\0';
+    if (strcmp(arg, "on") == 0) latency = 1;
+    else if (strcmp(arg, "off") == 0) latency = 0;
+    else printf("Invalid option '%s' in 'latency' command.\n", arg);
+  } else if (strcmp(cmd, "reset") == 0) {
+    memset(&stats, 0, sizeof(stats));
+    memset(thread_actions, 0, sizeof(thread_actions));
+    memset(thread_ns, 0, sizeof(thread_ns));
+  } else if (strcmp(cmd, "start") == 0) {
+    ds_allocate(dataseg_size);
+    mm_init(policy);
+    if (nthreads > 1) mm_setthreadsafe(1);
+    memset(slots, 0, nslots*sizeof(Slot));
+    live = peak_live = 0;
+    epoch = 0;
+    started = 1;
+  } else if (strcmp(cmd, "stat") == 0) {
+    print_stats();
+  } else if (strcmp(cmd, "quit") == 0) {
+    return 1;
+  } else {
+    printf("Invalid command : '%s'.\n", line);
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  FILE *f = stdin;
+  char *line = NULL;
+  size_t len = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "jp:t:")) != -1) {
+    switch (opt) {
+      case 'j': json = 1; break;
+      case 'p': policy = parse_policy(optarg); fixed_policy = 1; break;
+      case 't': trace_file = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-j] [-p policy] [-t trace] [script]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  struct mm_event *trace = NULL;
+  if (trace_file != NULL) {
+    trace = malloc(TRACE_SIZE * sizeof(*trace));
+    if (trace == NULL) fatal("Cannot allocate trace buffer");
+    mm_settrace(trace, TRACE_SIZE);
+  }
+
+  if (optind < argc) {
+    script = argv[optind];
+    f = fopen(script, "r");
+    if (f == NULL) {
+      fprintf(stderr, "Cannot open script '%s': %s\n", script, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  while (getline(&line, &len, f) != -1) {
+    if (process(line)) break;
+  }
+
+  if (trace != NULL) {
+    FILE *tf = fopen(trace_file, "wb");
+    long n = tf != NULL ? mm_trace_dump(fileno(tf)) : -1;
+    if ((tf == NULL) || (n < 0)) fprintf(stderr, "Cannot write trace '%s'\n", trace_file);
+    if (tf != NULL) fclose(tf);
+    mm_settrace(NULL, 0);
+    free(trace);
+  }
+
+  free(line);
+  free(batch_ptrs);
+  if (f != stdin) fclose(f);
+
+  return stats.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,151 @@
+//--------------------------------------------------------------------------------------------------
+// System Programming                       Memory Lab                                   Fall 2020
+//
+/// @file
+/// @brief decoder for event traces written by mm_trace_dump()
+//--------------------------------------------------------------------------------------------------
+
+// Trace decoder
+// =============
+// mm_tracedump reads a file written by mm_trace_dump() (see mm_settrace()) and prints one line
+// per event: the time since tracing began, the thread, the event and its arguments. The
+// timestamps are recorded in clock ticks and converted with the clock rate measured between the
+// start of the trace and the dump. Threads record their events into separate parts of the ring
+// buffer, so the events are sorted by time before they are printed.
+//
+// Usage: mm_tracedump [-s] [-t <thread>] <trace>
+//   -s                               print a summary instead of the events: counts and bytes per
+//                                    event, events per thread, and the event rate
+//   -t <thread>                      only the events of thread <thread>
+//
+// Example: trace a replay and summarize it
+//   $ ./mm_replay -t replay.trace tests/phases.dmas
+//   $ ./mm_tracedump -s replay.trace
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memmgr.h"
+
+
+#define NEVENTS  (te_Error + 1)   ///< number of event kinds
+#define NTHREADS 256              ///< number of thread numbers (8 bits)
+
+/// @brief names of the events, indexed by TraceEvent
+static const char *event_name[NEVENTS] = {
+  "malloc", "calloc", "memalign", "realloc", "free", "malloc_batch", "free_batch", "expand",
+  "trim", "error",
+};
+
+/// @brief order events by time, events of a thread in the order they were recorded
+static int compare_events(const void *a, const void *b)
+{
+  const struct mm_event *x = a, *y = b;
+  if (x->time != y->time) return x->time < y->time ? -1 : 1;
+  return x < y ? -1 : x > y;
+}
+
+/// @brief print an error message and exit
+static void fatal(const char *msg, const char *arg)
+{
+  fprintf(stderr, "mm_tracedump: %s%s%s\n", msg, arg ? ": " : "", arg ? arg : "");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int summary = 0, thread = -1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "st:")) != -1) {
+    switch (opt) {
+      case 's': summary = 1; break;
+      case 't': thread = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-s] [-t thread] trace\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "Usage: %s [-s] [-t thread] trace\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *f = fopen(argv[optind], "rb");
+  if (f == NULL) fatal(strerror(errno), argv[optind]);
+
+  struct mm_trace_header hdr;
+  if ((fread(&hdr, sizeof(hdr), 1, f) != 1) ||
+      (memcmp(hdr.magic, MM_TRACE_MAGIC, sizeof(hdr.magic)) != 0)) {
+    fatal("not a trace", argv[optind]);
+  }
+
+  double ns_per_tick = hdr.ticks > 0 ? (double)hdr.nsec / hdr.ticks : 1.0;
+
+  struct mm_event *events = malloc((hdr.events + 1) * sizeof(*events));
+  if (events == NULL) fatal("out of memory", NULL);
+  size_t nevents = fread(events, sizeof(*events), hdr.events, f);
+  fclose(f);
+  if (nevents != hdr.events) {
+    fprintf(stderr, "mm_tracedump: trace truncated (%lu of %lu events)\n", nevents, hdr.events);
+  }
+  qsort(events, nevents, sizeof(*events), compare_events);
+
+  unsigned long count[NEVENTS] = { 0 }, bytes[NEVENTS] = { 0 }, per_thread[NTHREADS] = { 0 };
+  unsigned long n = 0, other = 0;
+  double first = 0, last = 0;
+
+  if (!summary) {
+    printf("# %10s %4s  %-12s %18s %18s %12s\n", "time [us]", "thr", "event", "ptr", "arg", "size");
+  }
+
+  for (size_t i = 0; i < nevents; i++) {
+    struct mm_event e = events[i];
+    if ((thread >= 0) && ((int)e.thread != thread)) continue;
+
+    double t = (double)(long)(e.time - hdr.start) * ns_per_tick;
+    if (n == 0) first = t;
+    last = t;
+    n++;
+
+    if (e.type < NEVENTS) {
+      count[e.type]++;
+      // calloc and batches record the size of one element
+      int many = (e.type == te_Calloc) || (e.type == te_MallocBatch);
+      bytes[e.type] += many ? e.arg * e.size : e.size;
+    } else other++;
+    per_thread[e.thread]++;
+
+    if (summary) continue;
+
+    const char *name = e.type < NEVENTS ? event_name[e.type] : "?";
+    printf("  %10.3f %4u  %-12s %18p %18lx %12lu\n", t / 1000.0, (unsigned int)e.thread, name,
+           e.ptr, e.arg, (unsigned long)e.size);
+  }
+  free(events);
+
+  if (summary) {
+    double span = last - first;
+    printf("events:     %lu (%lu lost)\n"
+           "time span:  %.3f ms\n"
+           "event rate: %.2f kevents/sec\n\n",
+           n, hdr.lost, span / 1e6, span > 0 ? n / span * 1e6 : 0.0);
+
+    printf("  %-12s %12s %16s\n", "event", "count", "bytes");
+    for (int i = 0; i < NEVENTS; i++) {
+      if (count[i] > 0) printf("  %-12s %12lu %16lu\n", event_name[i], count[i], bytes[i]);
+    }
+    if (other > 0) printf("  %-12s %12lu\n", "?", other);
+
+    printf("\n  %-12s %12s\n", "thread", "events");
+    for (int i = 0; i < NTHREADS; i++) {
+      if (per_thread[i] > 0) printf("  %-12d %12lu\n", i, per_thread[i]);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}